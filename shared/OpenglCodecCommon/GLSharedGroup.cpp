@@ -265,7 +265,7 @@ AttribValidationInfo ProgramData::compileAttribValidationInfo(bool* error) const
 }
 /***** GLSharedGroup ****/
 
-GLSharedGroup::GLSharedGroup() { }
+GLSharedGroup::GLSharedGroup() : m_shaderSourceCacheBytes(0) { }
 
 GLSharedGroup::~GLSharedGroup() {
     m_buffers.clear();
@@ -688,6 +688,8 @@ bool GLSharedGroup::addShaderData(GLuint shader, GLenum shaderType) {
         m_shaders[shader] = data;
         data->refcount = 1;
         data->shaderType = shaderType;
+        data->sourcesOnHost = false;
+        data->compiled = false;
     }
 
     return data != NULL;
@@ -707,6 +709,54 @@ void GLSharedGroup::unrefShaderData(GLuint shader) {
     unrefShaderDataLocked(shader);
 }
 
+void GLSharedGroup::setShaderCompiled(GLuint shader) {
+
+    AutoLock<Lock> _lock(m_lock);
+
+    ShaderData* sData = findObjectOrDefault(m_shaders, shader);
+    if (!sData) return;
+
+    sData->compiledSource.clear();
+    for (size_t i = 0; i < sData->sources.size(); ++i) {
+        sData->compiledSource += sData->sources[i];
+    }
+    sData->compiled = true;
+}
+
+// Upper bound on the memory held by the shader source cache; both the
+// original and the translated text are counted.
+static const size_t kMaxShaderSourceCacheBytes = 4 * 1024 * 1024;
+
+bool GLSharedGroup::getCachedShaderSource(const std::string& source, ShaderSourceCacheEntry* out) {
+
+    AutoLock<Lock> _lock(m_lock);
+
+    std::map<std::string, ShaderSourceCacheEntry>::const_iterator it =
+        m_shaderSourceCache.find(source);
+
+    if (it == m_shaderSourceCache.end()) return false;
+
+    *out = it->second;
+    return true;
+}
+
+void GLSharedGroup::cacheShaderSource(const std::string& source, const ShaderSourceCacheEntry& entry) {
+
+    AutoLock<Lock> _lock(m_lock);
+
+    size_t entryBytes = source.size() + entry.translated.size();
+    if (entryBytes > kMaxShaderSourceCacheBytes) return;
+
+    if (m_shaderSourceCacheBytes + entryBytes > kMaxShaderSourceCacheBytes) {
+        m_shaderSourceCache.clear();
+        m_shaderSourceCacheBytes = 0;
+    }
+
+    if (m_shaderSourceCache.insert(std::make_pair(source, entry)).second) {
+        m_shaderSourceCacheBytes += entryBytes;
+    }
+}
+
 void GLSharedGroup::refShaderDataLocked(GLuint shaderId) {
     ShaderData* data = findObjectOrDefault(m_shaders, shaderId);
     data->refcount++;
@@ -878,6 +928,40 @@ GLint GLSharedGroup::getProgramLinkStatus(GLuint program) {
     return pData->getLinkStatus();
 }
 
+void GLSharedGroup::setProgramLinkParam(GLuint program, const std::string& key, const std::string& value) {
+    AutoLock<Lock> _lock(m_lock);
+    ProgramData* pData = getProgramDataLocked(program);
+    if (!pData) return;
+    pData->setLinkParam(key, value);
+}
+
+bool GLSharedGroup::getProgramCacheKey(GLuint program, std::string* key) {
+    AutoLock<Lock> _lock(m_lock);
+    ProgramData* pData = getProgramDataLocked(program);
+    if (!pData || !pData->getNumShaders()) return false;
+
+    key->clear();
+
+    for (size_t i = 0; i < pData->getNumShaders(); ++i) {
+        ShaderData* sData = findObjectOrDefault(m_shaders, pData->getShader(i));
+        // Keyed on the compiled source: the current one may have been
+        // replaced since without a recompile.
+        if (!sData || !sData->compiled) return false;
+
+        const std::string& source = sData->compiledSource;
+
+        // Length-prefixed so that shader boundaries are unambiguous.
+        *key += std::to_string(sData->shaderType);
+        *key += ':';
+        *key += std::to_string(source.size());
+        *key += ':';
+        *key += source;
+    }
+
+    *key += pData->getLinkParams();
+    return true;
+}
+
 void GLSharedGroup::setActiveUniformBlockCountForProgram(GLuint program, GLint count) {
     AutoLock<Lock> _lock(m_lock);
     ProgramData* pData =
@@ -99,6 +99,11 @@ private:
     uint32_t m_activeUniformBlockCount;
     uint32_t m_transformFeedbackVaryingsCount;;
 
+    // Pre-link state that changes the link result (attribute bindings,
+    // transform feedback varyings, program parameters). Keyed by what is
+    // set, so that setting it again replaces the previous value.
+    std::map<std::string, std::string> m_linkParams;
+
 public:
     enum {
         INDEX_FLAG_SAMPLER_EXTERNAL = 0x00000001,
@@ -157,6 +162,24 @@ public:
     GLuint getActiveAttributesCount() const {
         return m_numAttributes;
     }
+
+    void setLinkParam(const std::string& key, const std::string& value) {
+        m_linkParams[key] = value;
+    }
+
+    // Serialized in key order, so that the result does not depend on the
+    // order of the calls that set them.
+    std::string getLinkParams() const {
+        std::string res;
+        for (const auto& it : m_linkParams) {
+            res += it.first;
+            res += ':';
+            res += std::to_string(it.second.size());
+            res += ':';
+            res += it.second;
+        }
+        return res;
+    }
 };
 
 struct ShaderData {
@@ -165,6 +188,19 @@ struct ShaderData {
     int refcount;
     std::vector<std::string> sources;
     GLenum shaderType;
+    // Whether the host shader object already holds the translation of
+    // |sources|, so that re-specifying identical source can be skipped.
+    bool sourcesOnHost;
+    // |sources| as of the last glCompileShader. glLinkProgram links what was
+    // compiled, which glShaderSource alone does not change.
+    bool compiled;
+    std::string compiledSource;
+};
+
+// Result of preprocessing one packed shader source string.
+struct ShaderSourceCacheEntry {
+    std::string translated;
+    ShaderData::StringList samplerExternalNames;
 };
 
 class ShaderProgramData {
@@ -181,6 +217,8 @@ private:
     std::map<GLuint, ShaderData*> m_shaders;
     std::map<uint32_t, ShaderProgramData*> m_shaderPrograms;
     std::map<GLuint, uint32_t> m_shaderProgramIdMap;
+    std::map<std::string, ShaderSourceCacheEntry> m_shaderSourceCache;
+    size_t m_shaderSourceCacheBytes;
     RenderbufferInfo m_renderbufferInfo;
     SamplerInfo m_samplerInfo;
 
@@ -232,6 +270,14 @@ public:
     // caller must hold a reference to the shader as long as it holds the pointer
     ShaderData* getShaderData(GLuint shader);
     void    unrefShaderData(GLuint shader);
+    // Records the current sources as the ones the shader was compiled from.
+    void    setShaderCompiled(GLuint shader);
+
+    // Content-addressed cache of preprocessed shader sources. Toolkits
+    // tend to compile the same few sources over and over, so the
+    // samplerExternalOES rewrite only runs once per distinct source.
+    bool    getCachedShaderSource(const std::string& source, ShaderSourceCacheEntry* out);
+    void    cacheShaderSource(const std::string& source, const ShaderSourceCacheEntry& entry);
 
     // For separable shader programs.
     uint32_t addNewShaderProgramData();
@@ -250,6 +296,10 @@ public:
     void setProgramLinkStatus(GLuint program, GLint linkStatus);
     GLint getProgramLinkStatus(GLuint program);
 
+    // Program binary cache support
+    void setProgramLinkParam(GLuint program, const std::string& key, const std::string& value);
+    bool getProgramCacheKey(GLuint program, std::string* key);
+
     void setActiveUniformBlockCountForProgram(GLuint program, GLint numBlocks);
     GLint getActiveUniformBlockCount(GLuint program);
 
@@ -7,6 +7,7 @@ LOCAL_SRC_FILES := \
     GL2EncoderUtils.cpp \
     GL2Encoder.cpp \
     GLESv2Validation.cpp \
+    ProgramBinaryCache.cpp \
     gl2_client_context.cpp \
     gl2_enc.cpp \
     gl2_entry.cpp \
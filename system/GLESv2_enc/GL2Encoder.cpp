@@ -17,9 +17,11 @@
 #include "GL2Encoder.h"
 #include "GLESv2Validation.h"
 #include "GLESTextureUtils.h"
+#include "ProgramBinaryCache.h"
 
 #include <string>
 #include <map>
+#include <set>
 
 #include <assert.h>
 #include <ctype.h>
@@ -1676,172 +1678,181 @@ GLint * GL2Encoder::getCompressedTextureFormats()
 //   #extension GL_OES_EGL_image_external_essl3 : require
 // statements.
 //
-// This implementation assumes the input has already been pre-processed. If not,
-// a few cases will be mishandled:
+// The source is tokenized first, so comments are skipped and object-like
+// macros that expand to samplerExternalOES (directly or through another
+// alias) are followed:
+//      #define SAMPLER_TYPE samplerExternalOES
+//      uniform SAMPLER_TYPE mySampler;
 //
-// 1. "mySampler" will be incorrectly recorded as being a samplerExternalOES in
-//    the following code:
+// Conditional compilation is not evaluated, so "mySampler" will still be
+// recorded as being a samplerExternalOES in the following code:
 //      #if 1
 //      uniform sampler2D mySampler;
 //      #else
 //      uniform samplerExternalOES mySampler;
 //      #endif
 //
-// 2. Comments that look like sampler declarations will be incorrectly modified
-//    and recorded:
-//      // samplerExternalOES hahaFooledYou
-//
-// 3. However, GLSL ES does not have a concatentation operator, so things like
-//    this (valid in C) are invalid and not a problem:
+// GLSL ES does not have a concatentation operator, so things like
+// this (valid in C) are invalid and not a problem:
 //      #define SAMPLER(TYPE, NAME) uniform sampler#TYPE NAME
 //      SAMPLER(ExternalOES, mySampler);
 //
 
 static const char STR_SAMPLER_EXTERNAL_OES[] = "samplerExternalOES";
 static const char STR_SAMPLER2D_SPACE[]      = "sampler2D         ";
-static const char STR_DEFINE[] = "#define";
-
-static std::vector<std::string> getSamplerExternalAliases(char* str) {
-    std::vector<std::string> res;
-
-    res.push_back(STR_SAMPLER_EXTERNAL_OES);
-
-    // -- capture #define x samplerExternalOES
-    char* c = str;
-    while ((c = strstr(c, STR_DEFINE))) {
-        // Don't push it if samplerExternalOES is not even there.
-        char* samplerExternalOES_next = strstr(c, STR_SAMPLER_EXTERNAL_OES);
-        if (!samplerExternalOES_next) break;
-
-        bool prevIdent = false;
 
-        std::vector<std::string> idents;
-        std::string curr;
+struct ShaderToken {
+    std::string text;
+    size_t pos;
+    bool ident;
+    // Set for every token of a preprocessor directive line.
+    bool directive;
+    // Set for the '#' that starts a directive.
+    bool directiveStart;
+};
 
-        while (*c != '\0') {
+static bool isShaderIdentStart(char c) {
+    return isalpha(c) || c == '_';
+}
 
-            if (isspace(*c)) {
-                if (prevIdent) {
-                    idents.push_back(curr);
-                    curr = "";
-                }
-            }
+static bool isShaderIdentChar(char c) {
+    return isalnum(c) || c == '_';
+}
 
-            if (*c == '\n' || idents.size() == 3) break;
+static std::vector<ShaderToken> tokenizeShaderSource(const char* str) {
+    std::vector<ShaderToken> res;
 
-            if (isalpha(*c) || *c == '_') {
-                curr.push_back(*c);
-                prevIdent = true;
-            }
+    bool atLineStart = true;
+    bool inDirective = false;
 
+    const char* c = str;
+    while (*c != '\0') {
+        if (*c == '\n') {
+            atLineStart = true;
+            inDirective = false;
             ++c;
+            continue;
         }
 
-        if (idents.size() != 3) continue;
-
-        const std::string& defineLhs = idents[1];
-        const std::string& defineRhs = idents[2];
-
-        if (defineRhs == STR_SAMPLER_EXTERNAL_OES) {
-            res.push_back(defineLhs);
+        if (isspace(*c)) {
+            ++c;
+            continue;
         }
 
-        if (*c == '\0') break;
-    }
-
-    return res;
-}
-
-static bool replaceExternalSamplerUniformDefinition(char* str, const std::string& samplerExternalType, ShaderData* data) {
-    // -- replace "samplerExternalOES" with "sampler2D" and record name
-    char* c = str;
-    while ((c = strstr(c, samplerExternalType.c_str()))) {
-        // Make sure "samplerExternalOES" isn't a substring of a larger token
-        if (c == str || !isspace(*(c-1))) {
-            c++;
+        // Comments are replaced by a single space; a block comment does not
+        // end a directive even if it spans lines.
+        if (c[0] == '/' && c[1] == '/') {
+            while (*c != '\0' && *c != '\n') ++c;
             continue;
         }
-        char* sampler_start = c;
-        c += samplerExternalType.size();
-        if (!isspace(*c) && *c != '\0' && *c != ';') {
+
+        if (c[0] == '/' && c[1] == '*') {
+            c += 2;
+            while (*c != '\0' && !(c[0] == '*' && c[1] == '/')) ++c;
+            if (*c != '\0') c += 2;
             continue;
-        } else {
-            // capture sampler name
-            while (isspace(*c) && *c != '\0') {
-                c++;
-            }
         }
 
-        if ((!isalpha(*c) && *c != '_') || *c == ';') {
-            // not an identifier, but might have some effect anyway.
-            if (samplerExternalType == STR_SAMPLER_EXTERNAL_OES) {
-                memcpy(sampler_start, STR_SAMPLER2D_SPACE, sizeof(STR_SAMPLER2D_SPACE)-1);
-            }
-        } else {
-            char* name_start = c;
-            do {
-                c++;
-            } while (isalnum(*c) || *c == '_');
-
-            size_t len = (size_t)(c - name_start);
-            if (len) {
-                data->samplerExternalNames.push_back(
-                        std::string(name_start, len));
-            }
+        ShaderToken tok;
+        tok.pos = (size_t)(c - str);
+        tok.ident = false;
+        tok.directiveStart = false;
 
-            // We only need to perform a string replacement for the original
-            // occurrence of samplerExternalOES if a #define was used.
-            //
-            // The important part was to record the name in
-            // |data->samplerExternalNames|.
-            if (samplerExternalType == STR_SAMPLER_EXTERNAL_OES) {
-                memcpy(sampler_start, STR_SAMPLER2D_SPACE, sizeof(STR_SAMPLER2D_SPACE)-1);
-            }
+        const char* start = c;
+        if (*c == '#' && atLineStart) {
+            inDirective = true;
+            tok.directiveStart = true;
+            ++c;
+        } else if (isShaderIdentStart(*c)) {
+            tok.ident = true;
+            while (isShaderIdentChar(*c)) ++c;
+        } else if (isdigit(*c) || (c[0] == '.' && isdigit(c[1]))) {
+            // Numbers, so that suffixes and exponents are not
+            // mistaken for identifiers.
+            while (isShaderIdentChar(*c) || *c == '.') ++c;
+        } else {
+            ++c;
         }
+
+        tok.text.assign(start, c - start);
+        tok.directive = inDirective;
+        atLineStart = false;
+
+        res.push_back(tok);
     }
 
-    return true;
+    return res;
 }
 
 static bool replaceSamplerExternalWith2D(char* const str, ShaderData* const data)
 {
-    static const char STR_HASH_EXTENSION[] = "#extension";
     static const char STR_GL_OES_EGL_IMAGE_EXTERNAL[] = "GL_OES_EGL_image_external";
     static const char STR_GL_OES_EGL_IMAGE_EXTERNAL_ESSL3[] = "GL_OES_EGL_image_external_essl3";
 
-    // -- overwrite all "#extension GL_OES_EGL_image_external : xxx" statements
-    char* c = str;
-    while ((c = strstr(c, STR_HASH_EXTENSION))) {
-        char* start = c;
-        c += sizeof(STR_HASH_EXTENSION)-1;
-        while (isspace(*c) && *c != '\0') {
-            c++;
+    const std::vector<ShaderToken> tokens = tokenizeShaderSource(str);
+
+    std::set<std::string> aliases;
+    aliases.insert(STR_SAMPLER_EXTERNAL_OES);
+
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const ShaderToken& tok = tokens[i];
+
+        if (tok.directiveStart) {
+            size_t end = i + 1;
+            while (end < tokens.size() &&
+                   tokens[end].directive &&
+                   !tokens[end].directiveStart) {
+                ++end;
+            }
+
+            const size_t numTokens = end - i;
+
+            if (numTokens >= 3 && tokens[i + 1].text == "extension" &&
+                (tokens[i + 2].text == STR_GL_OES_EGL_IMAGE_EXTERNAL ||
+                 tokens[i + 2].text == STR_GL_OES_EGL_IMAGE_EXTERNAL_ESSL3)) {
+                // -- overwrite "#extension GL_OES_EGL_image_external : xxx";
+                // #extension statements are terminated by end of line
+                char* c = str + tok.pos;
+                while (*c != '\0' && *c != '\r' && *c != '\n') {
+                    *c++ = ' ';
+                }
+            } else if (numTokens == 4 && tokens[i + 1].text == "define" &&
+                       tokens[i + 2].ident &&
+                       aliases.count(tokens[i + 3].text)) {
+                // -- capture #define x samplerExternalOES
+                aliases.insert(tokens[i + 2].text);
+            } else if (numTokens >= 3 && tokens[i + 1].text == "undef" &&
+                       tokens[i + 2].text != STR_SAMPLER_EXTERNAL_OES) {
+                aliases.erase(tokens[i + 2].text);
+            }
+
+            i = end - 1;
+            continue;
         }
 
-        bool hasBaseImageExternal =
-            !strncmp(c, STR_GL_OES_EGL_IMAGE_EXTERNAL,
-                     sizeof(STR_GL_OES_EGL_IMAGE_EXTERNAL) - 1);
-        bool hasEssl3ImageExternal =
-            !strncmp(c, STR_GL_OES_EGL_IMAGE_EXTERNAL_ESSL3,
-                     sizeof(STR_GL_OES_EGL_IMAGE_EXTERNAL_ESSL3) - 1);
+        if (!tok.ident || !aliases.count(tok.text)) continue;
 
-        if (hasBaseImageExternal || hasEssl3ImageExternal)
-        {
-            // #extension statements are terminated by end of line
-            c = start;
-            while (*c != '\0' && *c != '\r' && *c != '\n') {
-                *c++ = ' ';
+        // -- record the declared names, e.g. "samplerExternalOES a[2], b;"
+        size_t j = i + 1;
+        while (j < tokens.size() && tokens[j].ident && !tokens[j].directive) {
+            data->samplerExternalNames.push_back(tokens[j].text);
+            ++j;
+            if (j < tokens.size() && tokens[j].text == "[") {
+                while (j < tokens.size() && tokens[j].text != "]") ++j;
+                ++j;
             }
+            if (j >= tokens.size() || tokens[j].text != ",") break;
+            ++j;
         }
     }
 
-    std::vector<std::string> samplerExternalAliases =
-        getSamplerExternalAliases(str);
-
-    for (size_t i = 0; i < samplerExternalAliases.size(); i++) {
-        if (!replaceExternalSamplerUniformDefinition(
-                str, samplerExternalAliases[i], data))
-            return false;
+    // -- replace "samplerExternalOES" with "sampler2D", including inside
+    // #define directives that alias it.
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i].ident && tokens[i].text == STR_SAMPLER_EXTERNAL_OES) {
+            memcpy(str + tokens[i].pos, STR_SAMPLER2D_SPACE,
+                   sizeof(STR_SAMPLER2D_SPACE) - 1);
+        }
     }
 
     return true;
@@ -1881,21 +1892,38 @@ void GL2Encoder::s_glShaderSource(void *self, GLuint shader, GLsizei count, cons
             orig_sources.push_back(std::string((const char*)(string[i])));
         }
     }
+
+    // Re-specifying the source the host already has is a no-op.
+    if (shaderData->sourcesOnHost && shaderData->sources == orig_sources) {
+        return;
+    }
     shaderData->sources = orig_sources;
+    shaderData->sourcesOnHost = false;
 
     int len = glUtilsCalcShaderSourceLen((char**)string, (GLint*)length, count);
     char *str = new char[len + 1];
     glUtilsPackStrings(str, (char**)string, (GLint*)length, count);
 
-    // TODO: pre-process str before calling replaceSamplerExternalWith2D().
-    // Perhaps we can borrow Mesa's pre-processor?
+    std::string packed(str);
+    ShaderSourceCacheEntry cached;
 
-    if (!replaceSamplerExternalWith2D(str, shaderData)) {
-        delete[] str;
-        ctx->setError(GL_OUT_OF_MEMORY);
-        return;
+    if (ctx->m_shared->getCachedShaderSource(packed, &cached)) {
+        memcpy(str, cached.translated.c_str(), cached.translated.size() + 1);
+    } else {
+        ShaderData translated;
+        if (!replaceSamplerExternalWith2D(str, &translated)) {
+            delete[] str;
+            ctx->setError(GL_OUT_OF_MEMORY);
+            return;
+        }
+        cached.translated.assign(str);
+        cached.samplerExternalNames = translated.samplerExternalNames;
+        ctx->m_shared->cacheShaderSource(packed, cached);
     }
+
+    shaderData->samplerExternalNames = cached.samplerExternalNames;
     ctx->glShaderString(ctx, shader, str, len + 1);
+    shaderData->sourcesOnHost = true;
     delete[] str;
 }
 
@@ -1918,27 +1946,71 @@ void GL2Encoder::s_glLinkProgram(void * self, GLuint program)
         SET_ERROR_IF(ctx->m_state->getTransformFeedbackActive(), GL_INVALID_OPERATION);
     }
 
+    // Opt-in persistent cache: satisfy the link with a binary from an
+    // earlier run if the inputs and the host renderer are unchanged.
+    ProgramBinaryCache* binaryCache = ProgramBinaryCache::get();
+    std::string cacheKey;
+    bool useBinaryCache =
+        ctx->majorVersion() > 2 &&
+        binaryCache->isEnabled() &&
+        ctx->m_shared->getProgramCacheKey(program, &cacheKey);
+
+    if (useBinaryCache) {
+        GLenum binaryFormat = 0;
+        std::vector<char> binary;
+        if (binaryCache->load(cacheKey, &binaryFormat, &binary)) {
+            ctx->m_glProgramBinary_enc(self, program, binaryFormat,
+                                       binary.data(), binary.size());
+            if (ctx->updateProgramInfoAfterLink(program)) return;
+        }
+    }
+
     ctx->m_glLinkProgram_enc(self, program);
 
+    if (!ctx->updateProgramInfoAfterLink(program)) return;
+
+    // A cache miss costs two more round trips than a plain link, for the
+    // binary length and the binary itself. They are only paid once per
+    // distinct program while the cache is enabled; later runs link from
+    // the stored binary instead.
+    if (useBinaryCache) {
+        GLint binaryLength = 0;
+        ctx->m_glGetProgramiv_enc(self, program, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+        if (binaryLength > 0) {
+            std::vector<char> binary(binaryLength);
+            GLsizei length = 0;
+            GLenum binaryFormat = 0;
+            ctx->m_glGetProgramBinary_enc(self, program, binaryLength, &length,
+                                          &binaryFormat, binary.data());
+            if (length > 0 && length <= binaryLength) {
+                binaryCache->store(cacheKey, binaryFormat, binary.data(), length);
+            }
+        }
+    }
+}
+
+bool GL2Encoder::updateProgramInfoAfterLink(GLuint program) {
+    GL2Encoder *ctx = this;
+
     GLint linkStatus = 0;
-    ctx->m_glGetProgramiv_enc(self, program, GL_LINK_STATUS, &linkStatus);
+    ctx->m_glGetProgramiv_enc(ctx, program, GL_LINK_STATUS, &linkStatus);
     ctx->m_shared->setProgramLinkStatus(program, linkStatus);
     if (!linkStatus) {
-        return;
+        return false;
     }
 
     // get number of active uniforms and attributes in the program
     GLint numUniforms=0;
     GLint numAttributes=0;
-    ctx->m_glGetProgramiv_enc(self, program, GL_ACTIVE_UNIFORMS, &numUniforms);
-    ctx->m_glGetProgramiv_enc(self, program, GL_ACTIVE_ATTRIBUTES, &numAttributes);
+    ctx->m_glGetProgramiv_enc(ctx, program, GL_ACTIVE_UNIFORMS, &numUniforms);
+    ctx->m_glGetProgramiv_enc(ctx, program, GL_ACTIVE_ATTRIBUTES, &numAttributes);
     ctx->m_shared->initProgramData(program,numUniforms,numAttributes);
 
     //get the length of the longest uniform name
     GLint maxLength=0;
     GLint maxAttribLength=0;
-    ctx->m_glGetProgramiv_enc(self, program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
-    ctx->m_glGetProgramiv_enc(self, program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxAttribLength);
+    ctx->m_glGetProgramiv_enc(ctx, program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    ctx->m_glGetProgramiv_enc(ctx, program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxAttribLength);
 
     GLint size;
     GLenum type;
@@ -1948,14 +2020,14 @@ void GL2Encoder::s_glLinkProgram(void * self, GLuint program)
     //for each active uniform, get its size and starting location.
     for (GLint i=0 ; i<numUniforms ; ++i)
     {
-        ctx->m_glGetActiveUniform_enc(self, program, i, maxLength, NULL, &size, &type, name);
-        location = ctx->m_glGetUniformLocation_enc(self, program, name);
+        ctx->m_glGetActiveUniform_enc(ctx, program, i, maxLength, NULL, &size, &type, name);
+        location = ctx->m_glGetUniformLocation_enc(ctx, program, name);
         ctx->m_shared->setProgramIndexInfo(program, i, location, size, type, name);
     }
 
     for (GLint i = 0; i < numAttributes; ++i) {
-        ctx->m_glGetActiveAttrib_enc(self, program, i, maxAttribLength,  NULL, &size, &type, name);
-        location = ctx->m_glGetAttribLocation_enc(self, program, name);
+        ctx->m_glGetActiveAttrib_enc(ctx, program, i, maxAttribLength,  NULL, &size, &type, name);
+        location = ctx->m_glGetAttribLocation_enc(ctx, program, name);
         ctx->m_shared->setProgramAttribInfo(program, i, location, size, type, name);
     }
 
@@ -1970,6 +2042,7 @@ void GL2Encoder::s_glLinkProgram(void * self, GLuint program)
     }
 
     delete[] name;
+    return true;
 }
 
 #define VALIDATE_PROGRAM_NAME(program) \
@@ -4183,6 +4256,9 @@ void GL2Encoder::s_glTransformFeedbackVaryings(void* self, GLuint program, GLsiz
     std::string packed = packVarNames(count, varyings, &err);
     SET_ERROR_IF(err != GL_NO_ERROR, GL_INVALID_OPERATION);
 
+    ctx->m_shared->setProgramLinkParam(program, "tfv",
+        std::to_string(bufferMode) + ":" + packed);
+
     ctx->glTransformFeedbackVaryingsAEMU(ctx, program, count, (const char*)&packed[0], packed.size() + 1, bufferMode);
 }
 
@@ -5683,6 +5759,8 @@ void GL2Encoder::s_glProgramParameteri(void* self, GLuint program, GLenum pname,
     VALIDATE_PROGRAM_NAME(program);
     SET_ERROR_IF(pname != GL_PROGRAM_BINARY_RETRIEVABLE_HINT && pname != GL_PROGRAM_SEPARABLE, GL_INVALID_ENUM);
     SET_ERROR_IF(value != GL_FALSE && value != GL_TRUE, GL_INVALID_VALUE);
+    ctx->m_shared->setProgramLinkParam(program,
+        std::string("param:") + std::to_string(pname), std::to_string(value));
     ctx->m_glProgramParameteri_enc(self, program, pname, value);
 }
 
@@ -6188,6 +6266,7 @@ void GL2Encoder::s_glCompileShader(void* self, GLuint shader) {
     SET_ERROR_IF(!isShaderOrProgramObject && !isShader, GL_INVALID_VALUE);
 
     ctx->m_glCompileShader_enc(ctx, shader);
+    ctx->m_shared->setShaderCompiled(shader);
 }
 
 void GL2Encoder::s_glValidateProgram(void* self, GLuint program ) {
@@ -6206,6 +6285,7 @@ void GL2Encoder::s_glProgramBinary(void *self , GLuint program, GLenum binaryFor
     SET_ERROR_IF(~0 == binaryFormat, GL_INVALID_ENUM);
 
     ctx->m_glProgramBinary_enc(self, program, binaryFormat, binary, length);
+    ctx->updateProgramInfoAfterLink(program);
 }
 
 void GL2Encoder::s_glGetSamplerParameterfv(void *self, GLuint sampler, GLenum pname, GLfloat* params) {
@@ -6296,6 +6376,8 @@ void GL2Encoder::s_glBindAttribLocation(void *self , GLuint program, GLuint inde
     SET_ERROR_IF(name && !strncmp("gl_", name, 3), GL_INVALID_OPERATION);
 
     fprintf(stderr, "%s: bind attrib %u name %s\n", __func__, index, name);
+    ctx->m_shared->setProgramLinkParam(program,
+        std::string("attrib:") + (name ? name : ""), std::to_string(index));
     ctx->m_glBindAttribLocation_enc(ctx, program, index, name);
 }
 
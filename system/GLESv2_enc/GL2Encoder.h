@@ -172,6 +172,10 @@ private:
     void sendVertexAttributes(GLint first, GLsizei count, bool hasClientArrays, GLsizei primcount = 0);
     void flushDrawCall();
 
+    // Refreshes link status and GLSharedGroup reflection data after
+    // glLinkProgram or glProgramBinary; returns the link status.
+    bool updateProgramInfoAfterLink(GLuint program);
+
     bool updateHostTexture2DBinding(GLenum texUnit, GLenum newTarget);
     void updateHostTexture2DBindingsFromProgramData(GLuint program);
     bool texture2DNeedsOverride(GLenum target) const;
@@ -0,0 +1,172 @@
+/*
+* Copyright (C) 2021 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#include "ProgramBinaryCache.h"
+
+#include <log/log.h>
+#include <string.h>
+
+using android::base::guest::AutoLock;
+using android::base::guest::Lock;
+
+namespace {
+
+const uint32_t kBlobMagic = 0x43425047; // 'GPBC'
+const uint32_t kBlobVersion = 1;
+
+struct BlobKey {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    uint64_t length;
+};
+
+struct BlobHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t keyCheck;
+    uint32_t binaryFormat;
+    uint32_t binaryLength;
+    uint64_t binaryChecksum;
+};
+
+// FNV-1a. Two different offset bases give the lookup hash and the
+// independent check value stored inside the entry.
+const uint64_t kHashBasis = 0xcbf29ce484222325ULL;
+const uint64_t kCheckBasis = 0x84222325cbf29ce4ULL;
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+BlobKey makeBlobKey(const std::string& deviceKey, const std::string& programKey) {
+    BlobKey key;
+    memset(&key, 0, sizeof(key));
+    key.magic = kBlobMagic;
+    key.version = kBlobVersion;
+    key.hash = fnv1a(fnv1a(kHashBasis, deviceKey.data(), deviceKey.size()),
+                     programKey.data(), programKey.size());
+    key.length = deviceKey.size() + programKey.size();
+    return key;
+}
+
+uint64_t makeKeyCheck(const std::string& deviceKey, const std::string& programKey) {
+    return fnv1a(fnv1a(kCheckBasis, deviceKey.data(), deviceKey.size()),
+                 programKey.data(), programKey.size());
+}
+
+}  // namespace
+
+ProgramBinaryCache* ProgramBinaryCache::get() {
+    static ProgramBinaryCache* sCache = new ProgramBinaryCache;
+    return sCache;
+}
+
+ProgramBinaryCache::ProgramBinaryCache() :
+    m_setBlob(NULL), m_getBlob(NULL) {
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+void ProgramBinaryCache::setBlobFuncs(SetBlobFunc setFunc, GetBlobFunc getFunc) {
+    AutoLock<Lock> lock(m_lock);
+    m_setBlob = setFunc;
+    m_getBlob = getFunc;
+}
+
+void ProgramBinaryCache::setDeviceKey(const std::string& deviceKey) {
+    AutoLock<Lock> lock(m_lock);
+    m_deviceKey = deviceKey;
+}
+
+bool ProgramBinaryCache::isEnabled() {
+    AutoLock<Lock> lock(m_lock);
+    return m_setBlob && m_getBlob && !m_deviceKey.empty();
+}
+
+bool ProgramBinaryCache::load(const std::string& programKey, GLenum* binaryFormat,
+                              std::vector<char>* binary) {
+    AutoLock<Lock> lock(m_lock);
+    if (!m_getBlob || m_deviceKey.empty()) return false;
+
+    BlobKey key = makeBlobKey(m_deviceKey, programKey);
+
+    khronos_ssize_t size = m_getBlob(&key, sizeof(key), NULL, 0);
+    if (size <= (khronos_ssize_t)sizeof(BlobHeader)) {
+        ++m_stats.misses;
+        return false;
+    }
+
+    std::vector<char> value(size);
+    if (m_getBlob(&key, sizeof(key), value.data(), size) != size) {
+        ++m_stats.misses;
+        return false;
+    }
+
+    BlobHeader header;
+    memcpy(&header, value.data(), sizeof(header));
+
+    const char* payload = value.data() + sizeof(header);
+    size_t payloadSize = value.size() - sizeof(header);
+
+    if (header.magic != kBlobMagic ||
+        header.version != kBlobVersion ||
+        header.keyCheck != makeKeyCheck(m_deviceKey, programKey) ||
+        header.binaryLength != payloadSize ||
+        header.binaryChecksum != fnv1a(kHashBasis, payload, payloadSize)) {
+        ALOGW("%s: rejecting stale or corrupted program binary entry", __func__);
+        ++m_stats.rejected;
+        return false;
+    }
+
+    *binaryFormat = header.binaryFormat;
+    binary->assign(payload, payload + payloadSize);
+    ++m_stats.hits;
+    return true;
+}
+
+void ProgramBinaryCache::store(const std::string& programKey, GLenum binaryFormat,
+                               const void* binary, size_t length) {
+    AutoLock<Lock> lock(m_lock);
+    if (!m_setBlob || m_deviceKey.empty() || !length) return;
+
+    BlobKey key = makeBlobKey(m_deviceKey, programKey);
+
+    BlobHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kBlobMagic;
+    header.version = kBlobVersion;
+    header.keyCheck = makeKeyCheck(m_deviceKey, programKey);
+    header.binaryFormat = binaryFormat;
+    header.binaryLength = length;
+    header.binaryChecksum = fnv1a(kHashBasis, binary, length);
+
+    std::vector<char> value(sizeof(header) + length);
+    memcpy(value.data(), &header, sizeof(header));
+    memcpy(value.data() + sizeof(header), binary, length);
+
+    // Entries over the platform's size limit are dropped by the platform.
+    m_setBlob(&key, sizeof(key), value.data(), value.size());
+    ++m_stats.stores;
+}
+
+ProgramBinaryCache::Stats ProgramBinaryCache::getStats() {
+    AutoLock<Lock> lock(m_lock);
+    return m_stats;
+}
@@ -0,0 +1,73 @@
+/*
+* Copyright (C) 2021 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#ifndef _PROGRAM_BINARY_CACHE_H_
+#define _PROGRAM_BINARY_CACHE_H_
+
+#include <GLES2/gl2.h>
+#include <KHR/khrplatform.h>
+
+#include "android/base/synchronization/AndroidLock.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Persists linked program binaries across process launches through the
+// callbacks the platform EGL loader installs with
+// eglSetBlobCacheFuncsANDROID. The platform owns the backing file, its size
+// budget and eviction; this class frames each entry so that binaries from
+// another host renderer, hash collisions and corrupted entries are rejected.
+class ProgramBinaryCache {
+public:
+    typedef void (*SetBlobFunc)(const void* key, khronos_ssize_t keySize,
+                                const void* value, khronos_ssize_t valueSize);
+    typedef khronos_ssize_t (*GetBlobFunc)(const void* key, khronos_ssize_t keySize,
+                                           void* value, khronos_ssize_t valueSize);
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t rejected;
+        uint64_t stores;
+    };
+
+    static ProgramBinaryCache* get();
+
+    void setBlobFuncs(SetBlobFunc setFunc, GetBlobFunc getFunc);
+    // Identifies the host renderer and driver that produced the binaries.
+    void setDeviceKey(const std::string& deviceKey);
+    bool isEnabled();
+
+    // |programKey| is the link input as built by
+    // GLSharedGroup::getProgramCacheKey().
+    bool load(const std::string& programKey, GLenum* binaryFormat,
+              std::vector<char>* binary);
+    void store(const std::string& programKey, GLenum binaryFormat,
+               const void* binary, size_t length);
+
+    Stats getStats();
+
+private:
+    ProgramBinaryCache();
+
+    android::base::guest::Lock m_lock;
+    SetBlobFunc m_setBlob;
+    GetBlobFunc m_getBlob;
+    std::string m_deviceKey;
+    Stats m_stats;
+};
+
+#endif
@@ -89,6 +89,89 @@ signed clamp_rgb(signed value) {
     return value;
 }
 
+// The kernels below are written as branch-free integer loops over one
+// row at a time so that the compiler can vectorize them: luma is produced
+// for every pixel of the row, chroma only on even rows and for even
+// columns, one sample per 2x2 block. Chroma samples that would fall past
+// the last complete 2x2 block of an odd-sized frame are not written, and
+// the last row or column of such a frame reads the chroma of the block
+// next to it.
+//
+// The RGB side of every conversion holds only the [left, right] x
+// [top, bottom] rectangle, tightly packed, so that callers only need to
+// read back the region being locked.
+//
+// FormatConversions_unittests.cpp checks every kernel against a per-pixel
+// reference of the formulas below.
+
+// frameworks/base/core/jni/android_hardware_camera2_legacy_LegacyCameraDevice.cpp
+static inline uint8_t legacy_rgb_to_y(signed R, signed G, signed B) {
+    return clamp_rgb((77 * R + 150 * G +  29 * B) >> 8);
+}
+
+static inline uint8_t legacy_rgb_to_u(signed R, signed G, signed B) {
+    return clamp_rgb((( -43 * R - 85 * G + 128 * B) >> 8) + 128);
+}
+
+static inline uint8_t legacy_rgb_to_v(signed R, signed G, signed B) {
+    return clamp_rgb((( 128 * R - 107 * G - 21 * B) >> 8) + 128);
+}
+
+// https://en.wikipedia.org/wiki/YCbCr#ITU-R_BT.601_conversion
+// (limited range), but scale up U by 1/0.96:
+//   Y = 16  + ( 65.481 R + 128.553 G +  24.966 B) / 255
+//   U = 128 + (-37.797 R -  74.203 G + 112.000 B) / (255 * 0.96)
+//   V = 128 + (112.000 R -  93.786 G -  18.214 B) / 255
+// rounded down. With the coefficients scaled by 1000 the integer division
+// is exact, and the biased sums never leave [0, 255 * divisor), so there
+// is nothing to clamp.
+static inline uint8_t bt601_rgb_to_y(uint32_t R, uint32_t G, uint32_t B) {
+    return (65481 * R + 128553 * G + 24966 * B + 16 * 255000) / 255000;
+}
+
+static inline uint8_t bt601_rgb_to_u(uint32_t R, uint32_t G, uint32_t B) {
+    return (112000 * B + 128 * 244800 - 37797 * R - 74203 * G) / 244800;
+}
+
+static inline uint8_t bt601_rgb_to_v(uint32_t R, uint32_t G, uint32_t B) {
+    return (112000 * R + 128 * 255000 - 93786 * G - 18214 * B) / 255000;
+}
+
+// Back to RGB, but scale down U by 0.97 to mitigate rgb over/under flow:
+//   R = 255/219 (Y - 16) + 255/224 * 1.402 (V - 128)
+//   G = 255/219 (Y - 16) - 255/224 * 1.772 * 0.114/0.587 * 0.97 (U - 128)
+//                        - 255/224 * 1.402 * 0.299/0.587 (V - 128)
+//   B = 255/219 (Y - 16) + 255/224 * 1.772 * 0.97 (U - 128)
+// rounded toward zero and clamped. Every coefficient is an exact multiple
+// of 1 / kYuvToRgbDen.
+static const int64_t kYuvToRgbDen = 219LL * 224 * 587 * 100000000;
+static const int64_t kYuvToRgbY = 255LL * 224 * 587 * 100000000;
+static const int64_t kYuvToRgbVr = 255LL * 1402 * 219 * 587 * 100000;
+static const int64_t kYuvToRgbUg = 255LL * 1772 * 114 * 97 * 219 * 1000;
+static const int64_t kYuvToRgbVg = 255LL * 1402 * 299 * 219 * 100000;
+static const int64_t kYuvToRgbUb = 255LL * 1772 * 97 * 219 * 587 * 1000;
+
+static inline void bt601_yuv_to_rgb(signed Y, signed U, signed V,
+                                    uint8_t* rgb) {
+    int64_t y1 = kYuvToRgbY * (Y - 16);
+    int64_t u = U - 128;
+    int64_t v = V - 128;
+    rgb[0] = clamp_rgb((y1 + kYuvToRgbVr * v) / kYuvToRgbDen);
+    rgb[1] = clamp_rgb((y1 - kYuvToRgbUg * u - kYuvToRgbVg * v) / kYuvToRgbDen);
+    rgb[2] = clamp_rgb((y1 + kYuvToRgbUb * u) / kYuvToRgbDen);
+}
+
+static inline void rgb565_unpack(uint16_t pixel, signed* R, signed* G, signed* B) {
+    signed r = (pixel >> 11) & 0x01f;
+    signed g = (pixel >> 5) & 0x03f;
+    signed b = pixel & 0x01f;
+    // convert to 8bits
+    // http://stackoverflow.com/questions/2442576/how-does-one-convert-16-bit-rgb565-to-24-bit-rgb888
+    *R = (r * 527 + 23) >> 6;
+    *G = (g * 259 + 33) >> 6;
+    *B = (b * 527 + 23) >> 6;
+}
+
 void rgb565_to_yv12(char* dest, char* src, int width, int height,
         int left, int top, int right, int bottom) {
     const int rgb_stride = 2;
@@ -96,7 +179,11 @@ void rgb565_to_yv12(char* dest, char* src, int width, int height,
     int align = 16;
     int yStride = (width + (align -1)) & ~(align-1);
     int cStride = (yStride / 2 + (align - 1)) & ~(align-1);
-    int cSize = cStride * height/2;
+    int cSize = cStride * (height / 2);
+    int cWidth = width / 2;
+    int cHeight = height / 2;
+    int cLeft = (left + 1) / 2;
+    int cRight = right / 2 < cWidth - 1 ? right / 2 : cWidth - 1;
 
     uint16_t *rgb_ptr0 = (uint16_t *)src;
     uint8_t *yv12_y0 = (uint8_t *)dest;
@@ -104,27 +191,22 @@ void rgb565_to_yv12(char* dest, char* src, int width, int height,
 
     for (int j = top; j <= bottom; ++j) {
         uint8_t *yv12_y = yv12_y0 + j * yStride;
+        uint16_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j - top, right - left + 1, rgb_stride) / 2;
+        for (int i = left; i <= right; ++i) {
+            signed R, G, B;
+            rgb565_unpack(rgb_ptr[i - left], &R, &G, &B);
+            yv12_y[i] = legacy_rgb_to_y(R, G, B);
+        }
+
+        if ((j & 1) || j / 2 >= cHeight) continue;
+
         uint8_t *yv12_v = yv12_v0 + (j/2) * cStride;
         uint8_t *yv12_u = yv12_v + cSize;
-        uint16_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j, width, rgb_stride) / 2;
-        bool jeven = (j & 1) == 0;
-        for (int i = left; i <= right; ++i) {
-            uint8_t r = ((rgb_ptr[i]) >> 11) & 0x01f;
-            uint8_t g = ((rgb_ptr[i]) >> 5) & 0x03f;
-            uint8_t b = (rgb_ptr[i]) & 0x01f;
-            // convert to 8bits
-            // http://stackoverflow.com/questions/2442576/how-does-one-convert-16-bit-rgb565-to-24-bit-rgb888
-            uint8_t R = (r * 527 + 23) >> 6;
-            uint8_t G = (g * 259 + 33) >> 6;
-            uint8_t B = (b * 527 + 23) >> 6;
-            // convert to YV12
-            // frameworks/base/core/jni/android_hardware_camera2_legacy_LegacyCameraDevice.cpp
-            yv12_y[i] = clamp_rgb((77 * R + 150 * G +  29 * B) >> 8);
-            bool ieven = (i & 1) == 0;
-            if (jeven && ieven) {
-                yv12_u[i] = clamp_rgb((( -43 * R - 85 * G + 128 * B) >> 8) + 128);
-                yv12_v[i] = clamp_rgb((( 128 * R - 107 * G - 21 * B) >> 8) + 128);
-            }
+        for (int c = cLeft; c <= cRight; ++c) {
+            signed R, G, B;
+            rgb565_unpack(rgb_ptr[2 * c - left], &R, &G, &B);
+            yv12_u[c] = legacy_rgb_to_u(R, G, B);
+            yv12_v[c] = legacy_rgb_to_v(R, G, B);
         }
     }
 }
@@ -137,52 +219,48 @@ void rgb888_to_yv12(char* dest, char* src, int width, int height,
     int align = 16;
     int yStride = (width + (align -1)) & ~(align-1);
     int cStride = (yStride / 2 + (align - 1)) & ~(align-1);
-    int cSize = cStride * height/2;
-
+    int cSize = cStride * (height / 2);
+    int cWidth = width / 2;
+    int cHeight = height / 2;
+    int cLeft = (left + 1) / 2;
+    int cRight = right / 2 < cWidth - 1 ? right / 2 : cWidth - 1;
 
     uint8_t *rgb_ptr0 = (uint8_t *)src;
     uint8_t *yv12_y0 = (uint8_t *)dest;
-    uint8_t *yv12_u0 = yv12_y0 + yStride * height + cSize;
     uint8_t *yv12_v0 = yv12_y0 + yStride * height;
 
 #if DEBUG
     char mybuf[1024];
-    snprintf(mybuf, sizeof(mybuf), "/sdcard/raw_%d_%d_rgb.ppm", width, height);
+    int rectWidth = right - left + 1;
+    int rectHeight = bottom - top + 1;
+    snprintf(mybuf, sizeof(mybuf), "/sdcard/raw_%d_%d_rgb.ppm", rectWidth, rectHeight);
     FILE *myfp = fopen(mybuf, "wb"); /* b - binary mode */
-    (void) fprintf(myfp, "P6\n%d %d\n255\n", width, height);
 
     if (myfp == NULL) {
         DD("failed to open /sdcard/raw_rgb888.ppm");
     } else {
-        fwrite(rgb_ptr0, width * height * rgb_stride, 1, myfp);
+        (void) fprintf(myfp, "P6\n%d %d\n255\n", rectWidth, rectHeight);
+        fwrite(rgb_ptr0, rectWidth * rectHeight * rgb_stride, 1, myfp);
         fclose(myfp);
     }
 #endif
 
-    int uvcount = 0;
     for (int j = top; j <= bottom; ++j) {
         uint8_t *yv12_y = yv12_y0 + j * yStride;
-        uint8_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j, width, rgb_stride);
-        bool jeven = (j & 1) == 0;
+        uint8_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j - top, right - left + 1, rgb_stride);
         for (int i = left; i <= right; ++i) {
-            uint8_t R = rgb_ptr[i*rgb_stride];
-            uint8_t G = rgb_ptr[i*rgb_stride+1];
-            uint8_t B = rgb_ptr[i*rgb_stride+2];
-            // convert to YV12
-            // https://en.wikipedia.org/wiki/YCbCr#ITU-R_BT.601_conversion
-            // but scale up U by 1/0.96
-            yv12_y[i] = clamp_rgb(1.0 * ((0.25678823529411765 * R) + (0.5041294117647058 * G) + (0.09790588235294118 * B)) + 16);
-            bool ieven = (i & 1) == 0;
-            if (jeven && ieven) {
-                yv12_u0[uvcount] = clamp_rgb((1/0.96) * (-(0.1482235294117647 * R) - (0.2909921568627451 * G) + (0.4392156862745098 * B)) + 128);
-                yv12_v0[uvcount] = clamp_rgb((1.0)* ((0.4392156862745098 * R) - (0.36778823529411764 * G) - (0.07142745098039215 * B)) + 128);
-                uvcount ++;
-            }
+            const uint8_t* rgb = rgb_ptr + (i - left) * rgb_stride;
+            yv12_y[i] = bt601_rgb_to_y(rgb[0], rgb[1], rgb[2]);
         }
-        if (jeven) {
-            yv12_u0 += cStride;
-            yv12_v0 += cStride;
-            uvcount = 0;
+
+        if ((j & 1) || j / 2 >= cHeight) continue;
+
+        uint8_t *yv12_v = yv12_v0 + (j/2) * cStride;
+        uint8_t *yv12_u = yv12_v + cSize;
+        for (int c = cLeft; c <= cRight; ++c) {
+            const uint8_t* rgb = rgb_ptr + (2 * c - left) * rgb_stride;
+            yv12_u[c] = bt601_rgb_to_u(rgb[0], rgb[1], rgb[2]);
+            yv12_v[c] = bt601_rgb_to_v(rgb[0], rgb[1], rgb[2]);
         }
     }
 
@@ -204,7 +282,11 @@ void rgb888_to_yuv420p(char* dest, char* src, int width, int height,
     DD("%s convert %d by %d", __func__, width, height);
     int yStride = width;
     int cStride = yStride / 2;
-    int cSize = cStride * height/2;
+    int cSize = cStride * (height / 2);
+    int cWidth = width / 2;
+    int cHeight = height / 2;
+    int cLeft = (left + 1) / 2;
+    int cRight = right / 2 < cWidth - 1 ? right / 2 : cWidth - 1;
 
     uint8_t *rgb_ptr0 = (uint8_t *)src;
     uint8_t *yv12_y0 = (uint8_t *)dest;
@@ -212,22 +294,20 @@ void rgb888_to_yuv420p(char* dest, char* src, int width, int height,
 
     for (int j = top; j <= bottom; ++j) {
         uint8_t *yv12_y = yv12_y0 + j * yStride;
+        uint8_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j - top, right - left + 1, rgb_stride);
+        for (int i = left; i <= right; ++i) {
+            const uint8_t* rgb = rgb_ptr + (i - left) * rgb_stride;
+            yv12_y[i] = legacy_rgb_to_y(rgb[0], rgb[1], rgb[2]);
+        }
+
+        if ((j & 1) || j / 2 >= cHeight) continue;
+
         uint8_t *yv12_u = yv12_u0 + (j/2) * cStride;
         uint8_t *yv12_v = yv12_u + cSize;
-        uint8_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j, width, rgb_stride);
-        bool jeven = (j & 1) == 0;
-        for (int i = left; i <= right; ++i) {
-            uint8_t R = rgb_ptr[i*rgb_stride];
-            uint8_t G = rgb_ptr[i*rgb_stride+1];
-            uint8_t B = rgb_ptr[i*rgb_stride+2];
-            // convert to YV12
-            // frameworks/base/core/jni/android_hardware_camera2_legacy_LegacyCameraDevice.cpp
-            yv12_y[i] = clamp_rgb((77 * R + 150 * G +  29 * B) >> 8);
-            bool ieven = (i & 1) == 0;
-            if (jeven && ieven) {
-                yv12_u[i] = clamp_rgb((( -43 * R - 85 * G + 128 * B) >> 8) + 128);
-                yv12_v[i] = clamp_rgb((( 128 * R - 107 * G - 21 * B) >> 8) + 128);
-            }
+        for (int c = cLeft; c <= cRight; ++c) {
+            const uint8_t* rgb = rgb_ptr + (2 * c - left) * rgb_stride;
+            yv12_u[c] = legacy_rgb_to_u(rgb[0], rgb[1], rgb[2]);
+            yv12_v[c] = legacy_rgb_to_v(rgb[0], rgb[1], rgb[2]);
         }
     }
 }
@@ -242,23 +322,27 @@ void yv12_to_rgb565(char* dest, char* src, int width, int height,
     int align = 16;
     int yStride = (width + (align -1)) & ~(align-1);
     int cStride = (yStride / 2 + (align - 1)) & ~(align-1);
-    int cSize = cStride * height/2;
+    int cSize = cStride * (height / 2);
+    int cWidth = width / 2;
+    int cHeight = height / 2;
 
     uint16_t *rgb_ptr0 = (uint16_t *)dest;
     uint8_t *yv12_y0 = (uint8_t *)src;
     uint8_t *yv12_v0 = yv12_y0 + yStride * height;
 
     for (int j = top; j <= bottom; ++j) {
+        int cRow = j / 2 < cHeight ? j / 2 : cHeight - 1;
         uint8_t *yv12_y = yv12_y0 + j * yStride;
-        uint8_t *yv12_v = yv12_v0 + (j/2) * cStride;
+        uint8_t *yv12_v = yv12_v0 + cRow * cStride;
         uint8_t *yv12_u = yv12_v + cSize;
         uint16_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j, width, rgb_stride);
         for (int i = left; i <= right; ++i) {
+            int c = i / 2 < cWidth ? i / 2 : cWidth - 1;
             // convert to rgb
             // frameworks/av/media/libstagefright/colorconversion/ColorConverter.cpp
             signed y1 = (signed)yv12_y[i] - 16;
-            signed u = (signed)yv12_u[i / 2] - 128;
-            signed v = (signed)yv12_v[i / 2] - 128;
+            signed u = (signed)yv12_u[c] - 128;
+            signed v = (signed)yv12_v[c] - 128;
 
             signed u_b = u * 517;
             signed u_g = -u * 100;
@@ -287,32 +371,24 @@ void yv12_to_rgb888(char* dest, char* src, int width, int height,
     int align = 16;
     int yStride = (width + (align -1)) & ~(align-1);
     int cStride = (yStride / 2 + (align - 1)) & ~(align-1);
-    int cSize = cStride * height/2;
+    int cSize = cStride * (height / 2);
+    int cWidth = width / 2;
+    int cHeight = height / 2;
 
     uint8_t *rgb_ptr0 = (uint8_t *)dest;
     uint8_t *yv12_y0 = (uint8_t *)src;
     uint8_t *yv12_v0 = yv12_y0 + yStride * height;
 
     for (int j = top; j <= bottom; ++j) {
+        int cRow = j / 2 < cHeight ? j / 2 : cHeight - 1;
         uint8_t *yv12_y = yv12_y0 + j * yStride;
-        uint8_t *yv12_v = yv12_v0 + (j/2) * cStride;
+        uint8_t *yv12_v = yv12_v0 + cRow * cStride;
         uint8_t *yv12_u = yv12_v + cSize;
         uint8_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j - top, right - left + 1, rgb_stride);
         for (int i = left; i <= right; ++i) {
-            // convert to rgb
-            // https://en.wikipedia.org/wiki/YCbCr#ITU-R_BT.601_conversion
-            // but scale down U by 0.96 to mitigate rgb over/under flow
-            signed y1 = (signed)yv12_y[i] - 16;
-            signed u = (signed)yv12_u[i / 2] - 128;
-            signed v = (signed)yv12_v[i / 2] - 128;
-
-            signed r1 = clamp_rgb(1 * (1.1643835616438356 * y1 + 1.5960267857142856 * v));
-            signed g1 = clamp_rgb(1 * (1.1643835616438356 * y1 - 0.39176229009491365 * u * 0.97  - 0.8129676472377708 * v));
-            signed b1 = clamp_rgb(1 * (1.1643835616438356 * y1 + 2.017232142857143 * u * 0.97));
-
-            rgb_ptr[(i-left)*rgb_stride] = r1;
-            rgb_ptr[(i-left)*rgb_stride+1] = g1;
-            rgb_ptr[(i-left)*rgb_stride+2] = b1;
+            int c = i / 2 < cWidth ? i / 2 : cWidth - 1;
+            bt601_yuv_to_rgb(yv12_y[i], yv12_u[c], yv12_v[c],
+                             rgb_ptr + (i - left) * rgb_stride);
         }
     }
 }
@@ -326,23 +402,27 @@ void yuv420p_to_rgb888(char* dest, char* src, int width, int height,
     DD("%s convert %d by %d", __func__, width, height);
     int yStride = width;
     int cStride = yStride / 2;
-    int cSize = cStride * height/2;
+    int cSize = cStride * (height / 2);
+    int cWidth = width / 2;
+    int cHeight = height / 2;
 
     uint8_t *rgb_ptr0 = (uint8_t *)dest;
     uint8_t *yv12_y0 = (uint8_t *)src;
     uint8_t *yv12_u0 = yv12_y0 + yStride * height;
 
     for (int j = top; j <= bottom; ++j) {
+        int cRow = j / 2 < cHeight ? j / 2 : cHeight - 1;
         uint8_t *yv12_y = yv12_y0 + j * yStride;
-        uint8_t *yv12_u = yv12_u0 + (j/2) * cStride;
+        uint8_t *yv12_u = yv12_u0 + cRow * cStride;
         uint8_t *yv12_v = yv12_u + cSize;
         uint8_t *rgb_ptr = rgb_ptr0 + get_rgb_offset(j - top, right - left + 1, rgb_stride);
         for (int i = left; i <= right; ++i) {
+            int c = i / 2 < cWidth ? i / 2 : cWidth - 1;
             // convert to rgb
             // frameworks/av/media/libstagefright/colorconversion/ColorConverter.cpp
             signed y1 = (signed)yv12_y[i] - 16;
-            signed u = (signed)yv12_u[i / 2] - 128;
-            signed v = (signed)yv12_v[i / 2] - 128;
+            signed u = (signed)yv12_u[c] - 128;
+            signed v = (signed)yv12_v[c] - 128;
 
             signed u_b = u * 517;
             signed u_g = -u * 100;
@@ -375,3 +455,43 @@ void copy_rgb_buffer_from_unlocked(
         dst += dst_line_len;
     }
 }
+
+// The murmur3 finalizer. Every input bit affects every output bit, so
+// changes in different words of a band can not cancel out.
+static inline uint64_t mix_hash_word(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void hash_rgb_bands_from_unlocked(
+        uint64_t* hashes, const char* raw_data,
+        int unlockedWidth,
+        int width, int height, int top, int left,
+        int bpp, int bandRows) {
+    int line_len = width * bpp;
+    int src_line_len = unlockedWidth * bpp;
+    const char *src = raw_data + top*src_line_len + left*bpp;
+    for (int y = 0; y < height; y += bandRows) {
+        uint64_t hash = 0;
+        int rows = height - y < bandRows ? height - y : bandRows;
+        for (int r = 0; r < rows; r++) {
+            int x = 0;
+            for (; x + 8 <= line_len; x += 8) {
+                uint64_t word;
+                memcpy(&word, src + x, 8);
+                hash = mix_hash_word(hash ^ word);
+            }
+            if (x < line_len) {
+                uint64_t word = 0;
+                memcpy(&word, src + x, line_len - x);
+                hash = mix_hash_word(hash ^ word);
+            }
+            src += src_line_len;
+        }
+        *hashes++ = hash;
+    }
+}
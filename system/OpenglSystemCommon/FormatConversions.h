@@ -45,4 +45,12 @@ void copy_rgb_buffer_from_unlocked(char* _dst, const char* raw_data,
                                    int unlockedWidth,
                                    int width, int height, int top, int left,
                                    int bpp);
+// Hashes the same rectangle copy_rgb_buffer_from_unlocked() copies, one
+// hash per band of |bandRows| rows (the last band may be shorter), so
+// that changes can be located without keeping a copy of the pixels.
+// |hashes| receives (height + bandRows - 1) / bandRows values.
+void hash_rgb_bands_from_unlocked(uint64_t* hashes, const char* raw_data,
+                                  int unlockedWidth,
+                                  int width, int height, int top, int left,
+                                  int bpp, int bandRows);
 #endif
@@ -0,0 +1,411 @@
+// Copyright 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gtest/gtest.h>
+
+#include "FormatConversions.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Scalar reference for the conversions in FormatConversions.cpp. It works
+// one pixel at a time, straight from the formulas, with exact rational
+// arithmetic; the row kernels must produce the same bytes.
+
+struct Rect {
+    int left;
+    int top;
+    int right;
+    int bottom;
+
+    int width() const { return right - left + 1; }
+    int height() const { return bottom - top + 1; }
+};
+
+// Plane layout of a planar 4:2:0 frame. Chroma has one sample per complete
+// 2x2 block of luma.
+struct YuvLayout {
+    int width;
+    int height;
+    int yStride;
+    int cStride;
+    // YV12 stores V before U, YUV420P stores U before V.
+    bool vFirst;
+
+    static YuvLayout yv12(int width, int height) {
+        int yStride = (width + 15) & ~15;
+        return {width, height, yStride, (yStride / 2 + 15) & ~15, true};
+    }
+    static YuvLayout yuv420p(int width, int height) {
+        return {width, height, width, width / 2, false};
+    }
+
+    int cWidth() const { return width / 2; }
+    int cHeight() const { return height / 2; }
+    size_t ySize() const { return (size_t)yStride * height; }
+    size_t cSize() const { return (size_t)cStride * cHeight(); }
+    size_t size() const { return ySize() + 2 * cSize(); }
+    size_t uOffset() const { return ySize() + (vFirst ? cSize() : 0); }
+    size_t vOffset() const { return ySize() + (vFirst ? 0 : cSize()); }
+};
+
+int clamp8(int64_t value) {
+    return value < 0 ? 0 : value > 255 ? 255 : (int)value;
+}
+
+int64_t floorDiv(int64_t num, int64_t den) {
+    int64_t q = num / den;
+    return (num % den != 0 && num < 0) ? q - 1 : q;
+}
+
+struct Yuv {
+    int y;
+    int u;
+    int v;
+};
+
+struct Rgb {
+    int r;
+    int g;
+    int b;
+};
+
+// ITU-R BT.601, limited range, from full range RGB, with U scaled up by
+// 1/0.96 and the results rounded down:
+//   Y = 16  + ( 65.481 R + 128.553 G +  24.966 B) / 255
+//   U = 128 + (-37.797 R -  74.203 G + 112.000 B) / (255 * 0.96)
+//   V = 128 + (112.000 R -  93.786 G -  18.214 B) / 255
+Yuv bt601FromRgb(int r, int g, int b) {
+    return {
+        clamp8(16 + floorDiv(65481LL * r + 128553LL * g + 24966LL * b,
+                             255000)),
+        clamp8(128 + floorDiv(-37797LL * r - 74203LL * g + 112000LL * b,
+                              255000LL * 96 / 100)),
+        clamp8(128 + floorDiv(112000LL * r - 93786LL * g - 18214LL * b,
+                              255000)),
+    };
+}
+
+// Back to RGB with U scaled down by 0.97, rounded toward zero:
+//   R = 255/219 (Y - 16) + 255/224 * 1.402 (V - 128)
+//   G = 255/219 (Y - 16) - 255/224 * 1.772 * 0.114/0.587 * 0.97 (U - 128)
+//                        - 255/224 * 1.402 * 0.299/0.587 (V - 128)
+//   B = 255/219 (Y - 16) + 255/224 * 1.772 * 0.97 (U - 128)
+// Each channel is summed over its own common denominator.
+Rgb bt601ToRgb(int y, int u, int v) {
+    typedef __int128 int128;
+    int64_t y1 = y - 16;
+    int64_t u1 = u - 128;
+    int64_t v1 = v - 128;
+
+    // In units of 1 / (219 * 224 * 1000).
+    int128 r = (int128)255 * 224 * 1000 * y1 + (int128)255 * 1402 * 219 * v1;
+    int128 rDen = (int128)219 * 224 * 1000;
+
+    // In units of 1 / (219 * 224 * 587 * 1000^2 * 100).
+    int128 gDen = (int128)219 * 224 * 587 * 1000 * 1000 * 100;
+    int128 g = (int128)255 * 224 * 587 * 1000 * 1000 * 100 * y1 -
+               (int128)255 * 1772 * 114 * 97 * 219 * 1000 * u1 -
+               (int128)255 * 1402 * 299 * 219 * 1000 * 100 * v1;
+
+    // In units of 1 / (219 * 224 * 1000 * 100).
+    int128 bDen = (int128)219 * 224 * 1000 * 100;
+    int128 b = (int128)255 * 224 * 1000 * 100 * y1 +
+               (int128)255 * 1772 * 97 * 219 * u1;
+
+    return {clamp8((int64_t)(r / rDen)), clamp8((int64_t)(g / gDen)),
+            clamp8((int64_t)(b / bDen))};
+}
+
+// frameworks/base/core/jni/android_hardware_camera2_legacy_LegacyCameraDevice.cpp
+Yuv legacyFromRgb(int r, int g, int b) {
+    return {
+        clamp8(floorDiv(77 * r + 150 * g + 29 * b, 256)),
+        clamp8(floorDiv(-43 * r - 85 * g + 128 * b, 256) + 128),
+        clamp8(floorDiv(128 * r - 107 * g - 21 * b, 256) + 128),
+    };
+}
+
+// frameworks/av/media/libstagefright/colorconversion/ColorConverter.cpp
+Rgb legacyToRgb(int y, int u, int v) {
+    int y1 = 298 * (y - 16);
+    int u1 = u - 128;
+    int v1 = v - 128;
+    return {clamp8((y1 + 409 * v1) / 256),
+            clamp8((y1 - 100 * u1 - 208 * v1) / 256),
+            clamp8((y1 + 517 * u1) / 256)};
+}
+
+// Expands 5/6 bit RGB565 channels to 8 bits, rounding to nearest.
+Rgb unpackRgb565(uint16_t pixel) {
+    return {(((pixel >> 11) & 0x1f) * 527 + 23) >> 6,
+            (((pixel >> 5) & 0x3f) * 259 + 33) >> 6,
+            ((pixel & 0x1f) * 527 + 23) >> 6};
+}
+
+// |rgb| holds |rect| tightly packed. Luma is written for every pixel of
+// |rect|, chroma from the top left pixel of every complete 2x2 block whose
+// top left pixel lies in |rect|.
+template <class FromRgb>
+void referenceRgbToYuv(std::vector<uint8_t>* yuv, const YuvLayout& layout,
+                       const Rect& rect, FromRgb fromRgb) {
+    for (int j = rect.top; j <= rect.bottom; ++j) {
+        for (int i = rect.left; i <= rect.right; ++i) {
+            Yuv p = fromRgb(i - rect.left, j - rect.top);
+            (*yuv)[(size_t)j * layout.yStride + i] = p.y;
+            if (i % 2 == 0 && j % 2 == 0 && i / 2 < layout.cWidth() &&
+                j / 2 < layout.cHeight()) {
+                size_t c = (size_t)(j / 2) * layout.cStride + i / 2;
+                (*yuv)[layout.uOffset() + c] = p.u;
+                (*yuv)[layout.vOffset() + c] = p.v;
+            }
+        }
+    }
+}
+
+// Writes |rect| tightly packed to |rgb|. Every pixel takes the chroma of
+// the 2x2 block it lies in; the last row or column of an odd-sized frame
+// takes that of the block next to it.
+template <class ToRgb>
+void referenceYuvToRgb888(std::vector<uint8_t>* rgb,
+                          const std::vector<uint8_t>& yuv,
+                          const YuvLayout& layout, const Rect& rect,
+                          ToRgb toRgb) {
+    for (int j = rect.top; j <= rect.bottom; ++j) {
+        for (int i = rect.left; i <= rect.right; ++i) {
+            int cx = std::min(i / 2, layout.cWidth() - 1);
+            int cy = std::min(j / 2, layout.cHeight() - 1);
+            size_t c = (size_t)cy * layout.cStride + cx;
+            Rgb p = toRgb(yuv[(size_t)j * layout.yStride + i],
+                          yuv[layout.uOffset() + c],
+                          yuv[layout.vOffset() + c]);
+            uint8_t* out =
+                rgb->data() +
+                ((size_t)(j - rect.top) * rect.width() + (i - rect.left)) * 3;
+            out[0] = p.r;
+            out[1] = p.g;
+            out[2] = p.b;
+        }
+    }
+}
+
+// Bytes past the end of every buffer, which no conversion may touch.
+constexpr size_t kGuardSize = 64;
+constexpr uint8_t kUntouched = 0xa5;
+
+std::vector<uint8_t> randomBytes(std::mt19937* rng, size_t size) {
+    std::uniform_int_distribution<int> dist(0, 255);
+    std::vector<uint8_t> bytes(size);
+    for (uint8_t& b : bytes) {
+        b = dist(*rng);
+    }
+    return bytes;
+}
+
+// Rectangles of |width| x |height| starting on even and odd rows and
+// columns, ending on the frame's edge or inside it, down to single pixels.
+std::vector<Rect> testRects(int width, int height) {
+    std::vector<Rect> rects;
+    for (int left : {0, 1, width / 2, width - 1}) {
+        for (int top : {0, 1, height / 2, height - 1}) {
+            if (left >= width || top >= height) continue;
+            rects.push_back({left, top, width - 1, height - 1});
+            rects.push_back({left, top, left + (width - 1 - left) / 2,
+                             top + (height - 1 - top) / 2});
+            rects.push_back({left, top, left, top});
+        }
+    }
+    return rects;
+}
+
+struct Size {
+    int width;
+    int height;
+};
+
+const Size kSizes[] = {{2, 2}, {3, 3}, {5, 2}, {2, 7},  {4, 6},  {17, 9},
+                       {18, 10}, {33, 31}, {64, 3}, {15, 64}, {48, 32}};
+
+typedef void (*RgbToYuvFunc)(char* dest, char* src, int width, int height,
+                             int left, int top, int right, int bottom);
+
+template <size_t N, class FromRgb>
+void checkRgbToYuv(RgbToYuvFunc convert, int bpp, bool yv12,
+                   const Size (&sizes)[N], FromRgb fromRgb) {
+    std::mt19937 rng(1234);
+    for (const Size& size : sizes) {
+        int width = size.width;
+        int height = size.height;
+        YuvLayout layout = yv12 ? YuvLayout::yv12(width, height)
+                                : YuvLayout::yuv420p(width, height);
+        for (const Rect& rect : testRects(width, height)) {
+            SCOPED_TRACE(testing::Message()
+                         << width << "x" << height << " rect " << rect.left
+                         << "," << rect.top << "-" << rect.right << ","
+                         << rect.bottom);
+            std::vector<uint8_t> rgb =
+                randomBytes(&rng, (size_t)rect.width() * rect.height() * bpp);
+            std::vector<uint8_t> expected(layout.size() + kGuardSize,
+                                          kUntouched);
+            std::vector<uint8_t> actual = expected;
+
+            referenceRgbToYuv(&expected, layout, rect, [&](int x, int y) {
+                return fromRgb(&rgb[((size_t)y * rect.width() + x) * bpp]);
+            });
+            convert((char*)actual.data(), (char*)rgb.data(), width, height,
+                    rect.left, rect.top, rect.right, rect.bottom);
+
+            ASSERT_EQ(expected, actual);
+        }
+    }
+}
+
+typedef void (*YuvToRgbFunc)(char* dest, char* src, int width, int height,
+                             int left, int top, int right, int bottom);
+
+template <size_t N, class ToRgb>
+void checkYuvToRgb888(YuvToRgbFunc convert, bool yv12,
+                      const Size (&sizes)[N], ToRgb toRgb) {
+    std::mt19937 rng(5678);
+    for (const Size& size : sizes) {
+        int width = size.width;
+        int height = size.height;
+        YuvLayout layout = yv12 ? YuvLayout::yv12(width, height)
+                                : YuvLayout::yuv420p(width, height);
+        std::vector<uint8_t> yuv = randomBytes(&rng, layout.size());
+        for (const Rect& rect : testRects(width, height)) {
+            SCOPED_TRACE(testing::Message()
+                         << width << "x" << height << " rect " << rect.left
+                         << "," << rect.top << "-" << rect.right << ","
+                         << rect.bottom);
+            std::vector<uint8_t> expected(
+                (size_t)rect.width() * rect.height() * 3 + kGuardSize,
+                kUntouched);
+            std::vector<uint8_t> actual = expected;
+
+            referenceYuvToRgb888(&expected, yuv, layout, rect, toRgb);
+            convert((char*)actual.data(), (char*)yuv.data(), width, height,
+                    rect.left, rect.top, rect.right, rect.bottom);
+
+            ASSERT_EQ(expected, actual);
+        }
+    }
+}
+
+Yuv bt601FromRgb888(const uint8_t* p) { return bt601FromRgb(p[0], p[1], p[2]); }
+
+Yuv legacyFromRgb888(const uint8_t* p) {
+    return legacyFromRgb(p[0], p[1], p[2]);
+}
+
+Yuv legacyFromRgb565(const uint8_t* p) {
+    Rgb rgb = unpackRgb565(p[0] | (p[1] << 8));
+    return legacyFromRgb(rgb.r, rgb.g, rgb.b);
+}
+
+}  // namespace
+
+TEST(FormatConversions, Bt601ReferenceKeepsGrayNeutral) {
+    for (int level = 0; level < 256; ++level) {
+        Yuv yuv = bt601FromRgb(level, level, level);
+        EXPECT_EQ(128, yuv.u) << level;
+        EXPECT_EQ(128, yuv.v) << level;
+    }
+    EXPECT_EQ(16, bt601FromRgb(0, 0, 0).y);
+    EXPECT_EQ(235, bt601FromRgb(255, 255, 255).y);
+}
+
+TEST(FormatConversions, Rgb888ToYv12) {
+    checkRgbToYuv(rgb888_to_yv12, 3, true, kSizes, bt601FromRgb888);
+}
+
+TEST(FormatConversions, Rgb565ToYv12) {
+    checkRgbToYuv(rgb565_to_yv12, 2, true, kSizes, legacyFromRgb565);
+}
+
+TEST(FormatConversions, Rgb888ToYuv420p) {
+    checkRgbToYuv(rgb888_to_yuv420p, 3, false, kSizes, legacyFromRgb888);
+}
+
+TEST(FormatConversions, Yv12ToRgb888) {
+    checkYuvToRgb888(yv12_to_rgb888, true, kSizes, bt601ToRgb);
+}
+
+TEST(FormatConversions, Yuv420pToRgb888) {
+    checkYuvToRgb888(yuv420p_to_rgb888, false, kSizes, legacyToRgb);
+}
+
+// Every RGB888 input, through a 512x2 frame per (G, B) pair: pixel 2k of
+// the first row holds R = k, so that it is also a chroma sample, and the
+// other pixels hold R = 255 - k.
+TEST(FormatConversions, Rgb888ToYv12AllInputs) {
+    const int width = 512;
+    const int height = 2;
+    YuvLayout layout = YuvLayout::yv12(width, height);
+    Rect rect = {0, 0, width - 1, height - 1};
+    std::vector<uint8_t> rgb((size_t)width * height * 3);
+    std::vector<uint8_t> expected(layout.size());
+    std::vector<uint8_t> actual(layout.size());
+    for (int g = 0; g < 256; ++g) {
+        for (int b = 0; b < 256; ++b) {
+            for (int i = 0; i < width * height; ++i) {
+                int k = (i % width) / 2;
+                rgb[i * 3] = (i % 2 == 0 && i < width) ? k : 255 - k;
+                rgb[i * 3 + 1] = g;
+                rgb[i * 3 + 2] = b;
+            }
+            referenceRgbToYuv(&expected, layout, rect, [&](int x, int y) {
+                return bt601FromRgb888(&rgb[((size_t)y * width + x) * 3]);
+            });
+            rgb888_to_yv12((char*)actual.data(), (char*)rgb.data(), width,
+                           height, rect.left, rect.top, rect.right,
+                           rect.bottom);
+            ASSERT_EQ(expected, actual) << "g " << g << " b " << b;
+        }
+    }
+}
+
+// Every YUV input, through 512x2 frames: block k of frame (u, n) has
+// V = k and luma 4n .. 4n + 3.
+TEST(FormatConversions, Yv12ToRgb888AllInputs) {
+    const int width = 512;
+    const int height = 2;
+    YuvLayout layout = YuvLayout::yv12(width, height);
+    Rect rect = {0, 0, width - 1, height - 1};
+    std::vector<uint8_t> yuv(layout.size());
+    std::vector<uint8_t> expected((size_t)width * height * 3);
+    std::vector<uint8_t> actual(expected.size());
+    for (int u = 0; u < 256; ++u) {
+        for (int n = 0; n < 64; ++n) {
+            for (int j = 0; j < height; ++j) {
+                for (int i = 0; i < width; ++i) {
+                    yuv[(size_t)j * layout.yStride + i] = 4 * n + j * 2 + i % 2;
+                }
+            }
+            for (int k = 0; k < width / 2; ++k) {
+                yuv[layout.uOffset() + k] = u;
+                yuv[layout.vOffset() + k] = k;
+            }
+            referenceYuvToRgb888(&expected, yuv, layout, rect, bt601ToRgb);
+            yv12_to_rgb888((char*)actual.data(), (char*)yuv.data(), width,
+                           height, rect.left, rect.top, rect.right,
+                           rect.bottom);
+            ASSERT_EQ(expected, actual) << "u " << u << " n " << n;
+        }
+    }
+}
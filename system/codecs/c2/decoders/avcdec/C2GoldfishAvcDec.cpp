@@ -39,6 +39,7 @@
 #include <gralloc_cb_bp.h>
 
 #include <color_buffer_utils.h>
+#include <yuv_copy_utils.h>
 
 #include "C2GoldfishAvcDec.h"
 
@@ -460,13 +461,11 @@ c2_status_t C2GoldfishAvcDec::onFlush_sm() {
 status_t C2GoldfishAvcDec::createDecoder() {
 
     DDD("creating avc context now w %d h %d", mWidth, mHeight);
-    if (mEnableAndroidNativeBuffers) {
-        mContext.reset(new MediaH264Decoder(RenderMode::RENDER_BY_HOST_GPU));
-    } else {
-        mContext.reset(new MediaH264Decoder(RenderMode::RENDER_BY_GUEST_CPU));
-    }
-    mContext->initH264Context(mWidth, mHeight, mWidth, mHeight,
-                              MediaH264Decoder::PixelFormat::YUV420P);
+    mContext = MediaH264Decoder::obtain(
+        mEnableAndroidNativeBuffers ? RenderMode::RENDER_BY_HOST_GPU
+                                    : RenderMode::RENDER_BY_GUEST_CPU,
+        mWidth, mHeight, mWidth, mHeight,
+        MediaH264Decoder::PixelFormat::YUV420P);
     return OK;
 }
 
@@ -544,8 +543,9 @@ void C2GoldfishAvcDec::resetPlugin() {
 
 void C2GoldfishAvcDec::deleteContext() {
     if (mContext) {
-        mContext->destroyH264Context();
-        mContext.reset(nullptr);
+        // the host context is reset for the next stream instead of being
+        // destroyed and created again
+        MediaH264Decoder::recycle(std::move(mContext));
         mPts2Index.clear();
         mOldPts2Index.clear();
         mIndex2Pts.clear();
@@ -741,25 +741,20 @@ void C2GoldfishAvcDec::copyImageData(h264_image_t &img) {
         ALOGE("graphic view map failed %d", writeView.error());
         return;
     }
-    size_t dstYStride = writeView.layout().planes[C2PlanarLayout::PLANE_Y].rowInc;
-    size_t dstUVStride = writeView.layout().planes[C2PlanarLayout::PLANE_U].rowInc;
-
-    uint8_t *pYBuffer = const_cast<uint8_t *>(writeView.data()[C2PlanarLayout::PLANE_Y]);
-    uint8_t *pUBuffer = const_cast<uint8_t *>(writeView.data()[C2PlanarLayout::PLANE_U]);
-    uint8_t *pVBuffer = const_cast<uint8_t *>(writeView.data()[C2PlanarLayout::PLANE_V]);
-
-    for (int i = 0; i < mHeight; ++i) {
-        memcpy(pYBuffer + i * dstYStride, img.data + i * mWidth, mWidth);
-    }
-    for (int i = 0; i < mHeight / 2; ++i) {
-        memcpy(pUBuffer + i * dstUVStride,
-               img.data + mWidth * mHeight + i * mWidth / 2, mWidth / 2);
-    }
-    for (int i = 0; i < mHeight / 2; ++i) {
-        memcpy(pVBuffer + i * dstUVStride,
-               img.data + mWidth * mHeight * 5 / 4 + i * mWidth / 2,
-               mWidth / 2);
-    }
+    const C2PlanarLayout &layout = writeView.layout();
+    YuvPlanes dst;
+    dst.y = const_cast<uint8_t *>(writeView.data()[C2PlanarLayout::PLANE_Y]);
+    dst.u = const_cast<uint8_t *>(writeView.data()[C2PlanarLayout::PLANE_U]);
+    dst.v = const_cast<uint8_t *>(writeView.data()[C2PlanarLayout::PLANE_V]);
+    dst.yRowInc = layout.planes[C2PlanarLayout::PLANE_Y].rowInc;
+    dst.uvRowInc = layout.planes[C2PlanarLayout::PLANE_U].rowInc;
+    dst.uvColInc = layout.planes[C2PlanarLayout::PLANE_U].colInc;
+
+    const uint8_t *srcY = img.data;
+    const uint8_t *srcU = srcY + mWidth * mHeight;
+    const uint8_t *srcV = srcU + mWidth * mHeight / 4;
+    copyI420ToYuvPlanes(srcY, srcU, srcV, mWidth, mWidth / 2, dst, mWidth,
+                        mHeight);
 }
 
 uint64_t C2GoldfishAvcDec::getWorkIndex(uint64_t pts) {
@@ -872,13 +867,6 @@ void C2GoldfishAvcDec::process(const std::unique_ptr<C2Work> &work,
         (int)work->input.ordinal.frameIndex.peeku(), work->input.flags);
     size_t inPos = 0;
     while (inPos < inSize && inSize - inPos >= kMinInputBytes) {
-        if (C2_OK != ensureDecoderState(pool)) {
-            mSignalledError = true;
-            work->workletsProcessed = 1u;
-            work->result = C2_CORRUPTED;
-            return;
-        }
-
         {
             // C2GraphicView wView;// = mOutBlock->map().get();
             // if (wView.error()) {
@@ -917,18 +905,36 @@ void C2GoldfishAvcDec::process(const std::unique_ptr<C2Work> &work,
             GETTIME(&mTimeStart, nullptr);
             TIME_DIFF(mTimeEnd, mTimeStart, delay);
             //(void) ivdec_api_function(mDecHandle, &s_decode_ip, &s_decode_op);
-            DDD("decoding");
-            h264_result_t h264Res =
-                mContext->decodeFrame(mInPBuffer, mInPBufferSize, mIndex2Pts[mInTsMarker]);
-            mConsumedBytes = h264Res.bytesProcessed;
-            DDD("decoding consumed %d", (int)mConsumedBytes);
-
-            if (mHostColorBufferId > 0) {
-                mImg = mContext->renderOnHostAndReturnImageMetadata(
-                    mHostColorBufferId);
-            } else {
-                mImg = mContext->getImage();
+
+            // copy the access unit into host-visible memory while the host
+            // is still decoding the one submitted by the previous call
+            uint8_t *accessUnit = mContext->getInputBuffer(mInPBufferSize);
+            if (accessUnit == nullptr) {
+                mSignalledError = true;
+                work->workletsProcessed = 1u;
+                work->result = C2_NO_MEMORY;
+                return;
             }
+            memcpy(accessUnit, mInPBuffer, mInPBufferSize);
+            if (!collectPendingDecode(work, pool)) {
+                return;
+            }
+            // the output block may have been consumed by the collected image
+            if (C2_OK != ensureDecoderState(pool)) {
+                mSignalledError = true;
+                work->workletsProcessed = 1u;
+                work->result = C2_CORRUPTED;
+                return;
+            }
+
+            DDD("decoding");
+            mContext->submitDecodeFrame(
+                accessUnit, mInPBufferSize, mIndex2Pts[mInTsMarker],
+                mHostColorBufferId > 0 ? mHostColorBufferId : -1);
+            // the decode thread feeds the whole access unit to the host
+            mConsumedBytes = mInPBufferSize;
+            // the image comes out of the next process() call or a drain
+            mImg = h264_image_t{};
             uint32_t decodeTime;
             GETTIME(&mTimeEnd, nullptr);
             TIME_DIFF(mTimeStart, mTimeEnd, decodeTime);
@@ -946,38 +952,7 @@ void C2GoldfishAvcDec::process(const std::unique_ptr<C2Work> &work,
             //            (void) ivdec_api_function(mDecHandle, &s_decode_ip,
             //            &s_decode_op);
         }
-        if (mImg.data != nullptr) {
-            // check for new width and height
-            auto decodedW = mImg.width;
-            auto decodedH = mImg.height;
-            if (decodedW != mWidth || decodedH != mHeight) {
-                mWidth = decodedW;
-                mHeight = decodedH;
-
-                C2StreamPictureSizeInfo::output size(0u, mWidth, mHeight);
-                std::vector<std::unique_ptr<C2SettingResult>> failures;
-                c2_status_t err = mIntf->config({&size}, C2_MAY_BLOCK, &failures);
-                if (err == OK) {
-                    work->worklets.front()->output.configUpdate.push_back(
-                        C2Param::Copy(size));
-                    ensureDecoderState(pool);
-                } else {
-                    ALOGE("Cannot set width and height");
-                    mSignalledError = true;
-                    work->workletsProcessed = 1u;
-                    work->result = C2_CORRUPTED;
-                    return;
-                }
-            }
-
-            DDD("got data %" PRIu64 " with pts %" PRIu64,  getWorkIndex(mImg.pts), mImg.pts);
-            mHeaderDecoded = true;
-            copyImageData(mImg);
-            finishWork(getWorkIndex(mImg.pts), work);
-            removePts(mImg.pts);
-        } else {
-            work->workletsProcessed = 0u;
-        }
+        work->workletsProcessed = 0u;
 
         inPos += mConsumedBytes;
     }
@@ -993,6 +968,59 @@ void C2GoldfishAvcDec::process(const std::unique_ptr<C2Work> &work,
     work->input.buffers.clear();
 }
 
+bool C2GoldfishAvcDec::outputImage(const std::unique_ptr<C2Work> &work,
+                                   const std::shared_ptr<C2BlockPool> &pool) {
+    if (mImg.data == nullptr) {
+        return true;
+    }
+
+    // check for new width and height
+    auto decodedW = mImg.width;
+    auto decodedH = mImg.height;
+    if (decodedW != mWidth || decodedH != mHeight) {
+        mWidth = decodedW;
+        mHeight = decodedH;
+
+        C2StreamPictureSizeInfo::output size(0u, mWidth, mHeight);
+        std::vector<std::unique_ptr<C2SettingResult>> failures;
+        c2_status_t err = mIntf->config({&size}, C2_MAY_BLOCK, &failures);
+        if (err == OK) {
+            if (work) {
+                work->worklets.front()->output.configUpdate.push_back(
+                    C2Param::Copy(size));
+            }
+            ensureDecoderState(pool);
+        } else {
+            ALOGE("Cannot set width and height");
+            mSignalledError = true;
+            if (work) {
+                work->workletsProcessed = 1u;
+                work->result = C2_CORRUPTED;
+            }
+            return false;
+        }
+    }
+
+    DDD("got data %" PRIu64 " with pts %" PRIu64,  getWorkIndex(mImg.pts), mImg.pts);
+    mHeaderDecoded = true;
+    copyImageData(mImg);
+    finishWork(getWorkIndex(mImg.pts), work);
+    removePts(mImg.pts);
+    return true;
+}
+
+bool C2GoldfishAvcDec::collectPendingDecode(
+    const std::unique_ptr<C2Work> &work,
+    const std::shared_ptr<C2BlockPool> &pool) {
+    if (!mContext || !mContext->hasPendingDecode()) {
+        return true;
+    }
+    h264_decode_result_t res = mContext->waitForDecodedFrame();
+    DDD("decoding consumed %d", (int)res.result.bytesProcessed);
+    mImg = res.image;
+    return outputImage(work, pool);
+}
+
 c2_status_t
 C2GoldfishAvcDec::drainInternal(uint32_t drainMode,
                                 const std::shared_ptr<C2BlockPool> &pool,
@@ -1006,6 +1034,9 @@ C2GoldfishAvcDec::drainInternal(uint32_t drainMode,
         return C2_OMITTED;
     }
 
+    if (!collectPendingDecode(work, pool))
+        return C2_CORRUPTED;
+
     if (OK != setFlushMode())
         return C2_CORRUPTED;
     while (true) {
@@ -107,6 +107,13 @@ class C2GoldfishAvcDec : public SimpleC2Component {
 
     void getVuiParams(h264_image_t &img);
     void copyImageData(h264_image_t &img);
+    // Outputs mImg if the host returned an image. Returns false on error.
+    bool outputImage(const std::unique_ptr<C2Work> &work,
+                     const std::shared_ptr<C2BlockPool> &pool);
+    // Waits for the access unit submitted by the previous process() call and
+    // outputs its image. Returns false on error.
+    bool collectPendingDecode(const std::unique_ptr<C2Work> &work,
+                              const std::shared_ptr<C2BlockPool> &pool);
 
     h264_image_t mImg{};
     uint32_t mConsumedBytes{0};
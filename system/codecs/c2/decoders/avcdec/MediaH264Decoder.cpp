@@ -25,8 +25,88 @@
 
 #include "MediaH264Decoder.h"
 #include "goldfish_media_utils.h"
+#include <algorithm>
+#include <chrono>
+#include <iterator>
 #include <string.h>
 
+namespace {
+
+// The input region starts at this size and grows to the largest access unit.
+constexpr size_t kInitialInputSize = 512 * 1024;
+
+// Pooled decoders keep their memory slot and an input region, and their
+// host contexts hold decoder resources on the host, so only a few are kept
+// and only for a while.
+constexpr size_t kMaxPooledDecoders = 2;
+constexpr std::chrono::seconds kPooledDecoderTimeout(30);
+
+struct PooledDecoder {
+    std::unique_ptr<MediaH264Decoder> decoder;
+    std::chrono::steady_clock::time_point recycleTime;
+};
+
+std::mutex sPoolMutex;
+std::deque<PooledDecoder> sPool;
+// Whether the thread running evictPooledDecoders() is alive.
+bool sEvictorRunning = false;
+
+// Takes the decoders that have been pooled for too long, and the oldest
+// ones beyond |maxSize|, out of the pool.
+std::vector<std::unique_ptr<MediaH264Decoder>>
+takeStalePooledDecodersLocked(size_t maxSize) {
+    std::vector<std::unique_ptr<MediaH264Decoder>> stale;
+    auto now = std::chrono::steady_clock::now();
+    while (!sPool.empty() &&
+           (sPool.size() > maxSize ||
+            now - sPool.front().recycleTime > kPooledDecoderTimeout)) {
+        stale.push_back(std::move(sPool.front().decoder));
+        sPool.pop_front();
+    }
+    return stale;
+}
+
+// Runs while the pool is not empty, and destroys each pooled decoder once it
+// has been pooled for kPooledDecoderTimeout, so that the host contexts of
+// released components do not stay around until the next obtain() or
+// recycle().
+void evictPooledDecoders() {
+    std::unique_lock<std::mutex> lock(sPoolMutex);
+    while (!sPool.empty()) {
+        // The front is the oldest decoder; if obtain() takes it meanwhile,
+        // the next one is just checked again.
+        auto deadline = sPool.front().recycleTime + kPooledDecoderTimeout;
+        lock.unlock();
+        std::this_thread::sleep_until(deadline + std::chrono::milliseconds(1));
+        lock.lock();
+        auto stale = takeStalePooledDecodersLocked(kMaxPooledDecoders);
+        if (!stale.empty()) {
+            lock.unlock();
+            for (auto &staleDecoder : stale) {
+                staleDecoder->destroyH264Context();
+            }
+            lock.lock();
+        }
+    }
+    sEvictorRunning = false;
+}
+
+size_t imageSize(unsigned int width, unsigned int height,
+                 MediaH264Decoder::PixelFormat pixFmt) {
+    size_t pixels = static_cast<size_t>(width) * height;
+    switch (pixFmt) {
+    case MediaH264Decoder::PixelFormat::UYVY422:
+        return pixels * 2;
+    case MediaH264Decoder::PixelFormat::BGRA8888:
+        return pixels * 4;
+    case MediaH264Decoder::PixelFormat::YUV420P:
+    default:
+        return pixels * 3 / 2;
+    }
+}
+
+} // namespace
+
 MediaH264Decoder::MediaH264Decoder(RenderMode renderMode)
     : mRenderMode(renderMode) {
     if (renderMode == RenderMode::RENDER_BY_HOST_GPU) {
@@ -36,6 +116,8 @@ MediaH264Decoder::MediaH264Decoder(RenderMode renderMode)
     }
 }
 
+MediaH264Decoder::~MediaH264Decoder() { stopPipeline(); }
+
 void MediaH264Decoder::initH264Context(unsigned int width, unsigned int height,
                                        unsigned int outWidth,
                                        unsigned int outHeight,
@@ -50,8 +132,17 @@ void MediaH264Decoder::initH264Context(unsigned int width, unsigned int height,
         mSlot = slot;
         mAddressOffSet = static_cast<unsigned int>(mSlot) * (1 << 20);
         DDD("got memory lot %d addrr %x", mSlot, mAddressOffSet);
+        if (!ensureRegion(&mInputRing[0].addr, &mInputRing[0].size,
+                          kInitialInputSize)) {
+            ALOGE("ERROR: Failed to initH264Context: cannot get input memory");
+            transport->returnMemorySlot(mSlot);
+            return;
+        }
         mHasAddressSpaceMemory = true;
     }
+    mOutWidth = outWidth;
+    mOutHeight = outHeight;
+    mPixFmt = pixFmt;
     transport->writeParam(mVersion, 0, mAddressOffSet);
     transport->writeParam(width, 1, mAddressOffSet);
     transport->writeParam(height, 2, mAddressOffSet);
@@ -69,11 +160,15 @@ void MediaH264Decoder::resetH264Context(unsigned int width, unsigned int height,
                                         unsigned int outWidth,
                                         unsigned int outHeight,
                                         PixelFormat pixFmt) {
+    waitForPipelineIdle();
     auto transport = GoldfishMediaTransport::getInstance();
     if (!mHasAddressSpaceMemory) {
         ALOGE("%s no address space memory", __func__);
         return;
     }
+    mOutWidth = outWidth;
+    mOutHeight = outHeight;
+    mPixFmt = pixFmt;
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->writeParam(width, 1, mAddressOffSet);
     transport->writeParam(height, 2, mAddressOffSet);
@@ -86,6 +181,7 @@ void MediaH264Decoder::resetH264Context(unsigned int width, unsigned int height,
 }
 
 void MediaH264Decoder::destroyH264Context() {
+    stopPipeline();
 
     DDD("return memory lot %d addrr %x", (int)(mAddressOffSet >> 23),
         mAddressOffSet);
@@ -93,6 +189,7 @@ void MediaH264Decoder::destroyH264Context() {
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->sendOperation(MediaCodecType::H264Codec,
                              MediaOperation::DestroyContext, mAddressOffSet);
+    freeRegions();
     transport->returnMemorySlot(mSlot);
     mHasAddressSpaceMemory = false;
 }
@@ -100,16 +197,27 @@ void MediaH264Decoder::destroyH264Context() {
 h264_result_t MediaH264Decoder::decodeFrame(uint8_t *img, size_t szBytes,
                                             uint64_t pts) {
     DDD("decode frame: use handle to host %lld", mHostHandle);
+    waitForPipelineIdle();
     h264_result_t res = {0, 0};
     if (!mHasAddressSpaceMemory) {
         ALOGE("%s no address space memory", __func__);
         return res;
     }
-    auto transport = GoldfishMediaTransport::getInstance();
-    uint8_t *hostSrc = transport->getInputAddr(mAddressOffSet);
+    uint8_t *hostSrc = getInputBuffer(szBytes);
+    if (hostSrc == nullptr) {
+        return res;
+    }
     if (img != nullptr && szBytes > 0) {
         memcpy(hostSrc, img, szBytes);
     }
+    return decodeInputBuffer(hostSrc, szBytes, pts);
+}
+
+h264_result_t MediaH264Decoder::decodeInputBuffer(uint8_t *hostSrc,
+                                                  size_t szBytes,
+                                                  uint64_t pts) {
+    h264_result_t res = {0, 0};
+    auto transport = GoldfishMediaTransport::getInstance();
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->writeParam(transport->offsetOf((uint64_t)(hostSrc)) -
                               mAddressOffSet,
@@ -132,6 +240,12 @@ void MediaH264Decoder::flush() {
         return;
     }
     DDD("flush: use handle to host %lld", mHostHandle);
+    waitForPipelineIdle();
+    {
+        // images of uncollected submissions are flushed as well
+        std::lock_guard<std::mutex> g{mPipelineMutex};
+        mCompletions.clear();
+    }
     auto transport = GoldfishMediaTransport::getInstance();
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->sendOperation(MediaCodecType::H264Codec, MediaOperation::Flush,
@@ -140,14 +254,20 @@ void MediaH264Decoder::flush() {
 
 h264_image_t MediaH264Decoder::getImage() {
     DDD("getImage: use handle to host %lld", mHostHandle);
+    waitForPipelineIdle();
     h264_image_t res{};
     if (!mHasAddressSpaceMemory) {
         ALOGE("%s no address space memory", __func__);
         return res;
     }
+    if (!ensureRegion(&mOutputAddr, &mOutputSize,
+                      imageSize(mOutWidth, mOutHeight, mPixFmt))) {
+        ALOGE("%s cannot get output memory", __func__);
+        res.ret = static_cast<int>(Err::NoDecodedFrame);
+        return res;
+    }
     auto transport = GoldfishMediaTransport::getInstance();
-    uint8_t *dst = transport->getInputAddr(
-        mAddressOffSet); // Note: reuse the same addr for input and output
+    uint8_t *dst = mOutputAddr;
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->writeParam(transport->offsetOf((uint64_t)(dst)) - mAddressOffSet,
                           1, mAddressOffSet);
@@ -160,6 +280,17 @@ h264_image_t MediaH264Decoder::getImage() {
         res.data = dst;
         res.width = *(uint32_t *)(retptr + 8);
         res.height = *(uint32_t *)(retptr + 16);
+        if (imageSize(res.width, res.height, mPixFmt) > mOutputSize) {
+            // The stream grew beyond the size of the context; make room for
+            // the following images.
+            ALOGE("%s image %ux%u overflowed the output memory", __func__,
+                  res.width, res.height);
+            mOutWidth = std::max(mOutWidth, res.width);
+            mOutHeight = std::max(mOutHeight, res.height);
+            res.data = nullptr;
+            res.ret = static_cast<int>(Err::NoDecodedFrame);
+            return res;
+        }
         res.pts = *(uint64_t *)(retptr + 24);
         res.color_primaries = *(uint32_t *)(retptr + 32);
         res.color_range = *(uint32_t *)(retptr + 40);
@@ -181,13 +312,14 @@ MediaH264Decoder::renderOnHostAndReturnImageMetadata(int hostColorBufferId) {
         return res;
     }
     DDD("%s send color buffer id %d", __func__, hostColorBufferId);
+    waitForPipelineIdle();
     if (!mHasAddressSpaceMemory) {
         ALOGE("%s no address space memory", __func__);
         return res;
     }
     auto transport = GoldfishMediaTransport::getInstance();
-    uint8_t *dst = transport->getInputAddr(
-        mAddressOffSet); // Note: reuse the same addr for input and output
+    // The host renders to the color buffer and does not write here.
+    uint8_t *dst = mInputRing[0].addr;
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->writeParam(transport->offsetOf((uint64_t)(dst)) - mAddressOffSet,
                           1, mAddressOffSet);
@@ -211,3 +343,242 @@ MediaH264Decoder::renderOnHostAndReturnImageMetadata(int hostColorBufferId) {
     }
     return res;
 }
+
+uint8_t *MediaH264Decoder::getInputBuffer(size_t size) {
+    if (!mHasAddressSpaceMemory) {
+        ALOGE("%s no address space memory", __func__);
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> lock{mPipelineMutex};
+    InputBuffer &buffer = mInputRing[mNextInput];
+    mPipelineCv.wait(lock, [&buffer] { return !buffer.busy; });
+    // Grow geometrically so that a stream of growing access units does not
+    // reallocate every time, unless only the exact size fits.
+    if (size > buffer.size &&
+        !ensureRegion(&buffer.addr, &buffer.size,
+                      std::max({size, buffer.size * 2, kInitialInputSize})) &&
+        !ensureRegion(&buffer.addr, &buffer.size, size)) {
+        ALOGE("%s cannot get %zu bytes of input memory", __func__, size);
+        return nullptr;
+    }
+    mNextInput = (mNextInput + 1) % kInputRingSize;
+    return buffer.addr;
+}
+
+void MediaH264Decoder::submitDecodeFrame(uint8_t *input, size_t size,
+                                         uint64_t pts, int hostColorBufferId) {
+    std::lock_guard<std::mutex> g{mPipelineMutex};
+    int index = 0;
+    while (index < kInputRingSize && mInputRing[index].addr != input) {
+        ++index;
+    }
+    if (index == kInputRingSize) {
+        ALOGE("%s %p is not an input buffer", __func__, input);
+        return;
+    }
+    if (!mPipelineThread.joinable()) {
+        mPipelineExit = false;
+        mPipelineThread = std::thread([this] { pipelineLoop(); });
+    }
+    mInputRing[index].busy = true;
+    mSubmissions.push_back({index, size, pts, hostColorBufferId});
+    mPipelineCv.notify_all();
+}
+
+bool MediaH264Decoder::hasPendingDecode() {
+    std::lock_guard<std::mutex> g{mPipelineMutex};
+    return !mSubmissions.empty() || mDecodesRunning > 0 ||
+           !mCompletions.empty();
+}
+
+h264_decode_result_t MediaH264Decoder::waitForDecodedFrame() {
+    std::unique_lock<std::mutex> lock{mPipelineMutex};
+    mPipelineCv.wait(lock, [this] {
+        return !mCompletions.empty() ||
+               (mSubmissions.empty() && mDecodesRunning == 0);
+    });
+    if (mCompletions.empty()) {
+        ALOGE("%s no decode submitted", __func__);
+        h264_decode_result_t res{};
+        res.image.ret = static_cast<int>(Err::NoDecodedFrame);
+        return res;
+    }
+    h264_decode_result_t res = mCompletions.front();
+    mCompletions.pop_front();
+    return res;
+}
+
+void MediaH264Decoder::pipelineLoop() {
+    std::unique_lock<std::mutex> lock{mPipelineMutex};
+    while (true) {
+        mPipelineCv.wait(lock, [this] {
+            return mPipelineExit || !mSubmissions.empty();
+        });
+        if (mPipelineExit) {
+            return;
+        }
+        DecodeSubmission submission = std::move(mSubmissions.front());
+        mSubmissions.pop_front();
+        ++mDecodesRunning;
+        lock.unlock();
+
+        // Like the synchronous path, keep decoding until the host has
+        // consumed the whole access unit before asking for an image.
+        h264_decode_result_t res{};
+        uint8_t *input = mInputRing[submission.input].addr;
+        size_t consumed = 0;
+        while (consumed < submission.size) {
+            h264_result_t decodeRes =
+                decodeInputBuffer(input + consumed, submission.size - consumed,
+                                  submission.pts);
+            res.result.ret = decodeRes.ret;
+            if (decodeRes.bytesProcessed == 0) {
+                break;
+            }
+            consumed += decodeRes.bytesProcessed;
+        }
+        res.result.bytesProcessed = consumed;
+
+        lock.lock();
+        mInputRing[submission.input].busy = false;
+        mPipelineCv.notify_all();
+        lock.unlock();
+
+        if (submission.hostColorBufferId >= 0) {
+            res.image =
+                renderOnHostAndReturnImageMetadata(submission.hostColorBufferId);
+        } else {
+            res.image = getImage();
+        }
+
+        lock.lock();
+        --mDecodesRunning;
+        mCompletions.push_back(res);
+        mPipelineCv.notify_all();
+    }
+}
+
+void MediaH264Decoder::waitForPipelineIdle() {
+    std::unique_lock<std::mutex> lock{mPipelineMutex};
+    if (std::this_thread::get_id() == mPipelineThread.get_id()) {
+        return;
+    }
+    mPipelineCv.wait(lock, [this] {
+        return mSubmissions.empty() && mDecodesRunning == 0;
+    });
+}
+
+void MediaH264Decoder::stopPipeline() {
+    waitForPipelineIdle();
+    {
+        std::lock_guard<std::mutex> g{mPipelineMutex};
+        mPipelineExit = true;
+        mCompletions.clear();
+        mPipelineCv.notify_all();
+    }
+    if (mPipelineThread.joinable()) {
+        mPipelineThread.join();
+    }
+}
+
+bool MediaH264Decoder::ensureRegion(uint8_t **addr, size_t *regionSize,
+                                    size_t size) {
+    if (*addr != nullptr && *regionSize >= size) {
+        return true;
+    }
+    // Keep the old region if there is no room for the new one.
+    auto transport = GoldfishMediaTransport::getInstance();
+    uint8_t *newAddr = transport->allocateMemory(mSlot, size);
+    if (newAddr == nullptr) {
+        return false;
+    }
+    transport->freeMemory(*addr);
+    *addr = newAddr;
+    *regionSize = size;
+    return true;
+}
+
+void MediaH264Decoder::freeRegions() {
+    auto transport = GoldfishMediaTransport::getInstance();
+    for (InputBuffer &buffer : mInputRing) {
+        transport->freeMemory(buffer.addr);
+        buffer = InputBuffer{};
+    }
+    mNextInput = 0;
+    transport->freeMemory(mOutputAddr);
+    mOutputAddr = nullptr;
+    mOutputSize = 0;
+}
+
+// static
+std::unique_ptr<MediaH264Decoder>
+MediaH264Decoder::obtain(RenderMode renderMode, unsigned int width,
+                         unsigned int height, unsigned int outWidth,
+                         unsigned int outHeight, PixelFormat pixFmt) {
+    std::unique_ptr<MediaH264Decoder> decoder;
+    std::vector<std::unique_ptr<MediaH264Decoder>> stale;
+    {
+        std::lock_guard<std::mutex> g{sPoolMutex};
+        stale = takeStalePooledDecodersLocked(kMaxPooledDecoders);
+        // Any context can be reconfigured to the requested size, so take
+        // the most recently recycled one.
+        for (auto it = sPool.rbegin(); it != sPool.rend(); ++it) {
+            if (it->decoder->mRenderMode == renderMode) {
+                decoder = std::move(it->decoder);
+                sPool.erase(std::next(it).base());
+                break;
+            }
+        }
+    }
+    for (auto &staleDecoder : stale) {
+        staleDecoder->destroyH264Context();
+    }
+
+    if (decoder) {
+        DDD("reusing pooled host context %lld", decoder->mHostHandle);
+        decoder->resetH264Context(width, height, outWidth, outHeight, pixFmt);
+    } else {
+        decoder.reset(new MediaH264Decoder(renderMode));
+        decoder->initH264Context(width, height, outWidth, outHeight, pixFmt);
+    }
+    return decoder;
+}
+
+// static
+void MediaH264Decoder::recycle(std::unique_ptr<MediaH264Decoder> decoder) {
+    if (!decoder) {
+        return;
+    }
+    decoder->stopPipeline();
+    if (!decoder->mHasAddressSpaceMemory) {
+        // there is no host context to keep
+        return;
+    }
+
+    // Keep the first input region, which the context needs to be used at
+    // all; the rest is allocated again on demand.
+    auto transport = GoldfishMediaTransport::getInstance();
+    for (int i = 1; i < kInputRingSize; ++i) {
+        transport->freeMemory(decoder->mInputRing[i].addr);
+        decoder->mInputRing[i] = InputBuffer{};
+    }
+    decoder->mNextInput = 0;
+    transport->freeMemory(decoder->mOutputAddr);
+    decoder->mOutputAddr = nullptr;
+    decoder->mOutputSize = 0;
+
+    std::vector<std::unique_ptr<MediaH264Decoder>> stale;
+    {
+        std::lock_guard<std::mutex> g{sPoolMutex};
+        sPool.push_back(
+            {std::move(decoder), std::chrono::steady_clock::now()});
+        stale = takeStalePooledDecodersLocked(kMaxPooledDecoders);
+        if (!sEvictorRunning) {
+            sEvictorRunning = true;
+            std::thread(evictPooledDecoders).detach();
+        }
+    }
+    for (auto &staleDecoder : stale) {
+        staleDecoder->destroyH264Context();
+    }
+}
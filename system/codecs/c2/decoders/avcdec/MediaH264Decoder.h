@@ -17,6 +17,13 @@
 #ifndef GOLDFISH_MEDIA_H264_DEC_H_
 #define GOLDFISH_MEDIA_H264_DEC_H_
 
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 struct h264_init_result_t {
     uint64_t host_handle;
     int ret;
@@ -41,6 +48,12 @@ struct h264_image_t {
     int ret;
 };
 
+// The outcome of a decode submitted with MediaH264Decoder::submitDecodeFrame.
+struct h264_decode_result_t {
+    h264_result_t result;
+    h264_image_t image;
+};
+
 enum class RenderMode {
     RENDER_BY_HOST_GPU = 1,
     RENDER_BY_GUEST_CPU = 2,
@@ -55,9 +68,38 @@ class MediaH264Decoder {
     uint64_t mAddressOffSet = 0;
     int mSlot = -1;
 
+    struct DecodeSubmission {
+        // index into mInputRing
+        int input;
+        size_t size;
+        uint64_t pts;
+        int hostColorBufferId;
+    };
+
+    // Submitted decodes run in order on mPipelineThread, which is started by
+    // the first submission.
+    std::mutex mPipelineMutex;
+    std::condition_variable mPipelineCv;
+    std::thread mPipelineThread;
+    bool mPipelineExit = false;
+    std::deque<DecodeSubmission> mSubmissions;
+    // Submissions taken by mPipelineThread but not completed yet.
+    int mDecodesRunning = 0;
+    std::deque<h264_decode_result_t> mCompletions;
+
+    void pipelineLoop();
+    // Sends |szBytes| of bitstream, already in host-visible memory at
+    // |hostSrc|, to the host.
+    h264_result_t decodeInputBuffer(uint8_t *hostSrc, size_t szBytes,
+                                    uint64_t pts);
+    // Waits until mPipelineThread has run all submissions, so that the
+    // calling thread can use the memory slot.
+    void waitForPipelineIdle();
+    void stopPipeline();
+
   public:
     MediaH264Decoder(RenderMode renderMode);
-    virtual ~MediaH264Decoder() = default;
+    virtual ~MediaH264Decoder();
 
     enum class PixelFormat : uint8_t {
         YUV420P = 0,
@@ -81,6 +123,20 @@ class MediaH264Decoder {
                           unsigned int outWidth, unsigned int outHeight,
                           PixelFormat pixFmt);
     void destroyH264Context();
+
+    // Decoders with an initialized host context are kept in a process-wide
+    // pool when their component stops, flushes or is released, and are
+    // destroyed after a while unless obtain() takes them first. obtain()
+    // returns the most recently pooled one with |renderMode| and
+    // reconfigures it with resetH264Context(); it only creates a new context
+    // when there is none.
+    static std::unique_ptr<MediaH264Decoder>
+    obtain(RenderMode renderMode, unsigned int width, unsigned int height,
+           unsigned int outWidth, unsigned int outHeight, PixelFormat pixFmt);
+    // Puts |decoder| back into the pool, or destroys its host context when
+    // the pool is full.
+    static void recycle(std::unique_ptr<MediaH264Decoder> decoder);
+
     h264_result_t decodeFrame(uint8_t *img, size_t szBytes, uint64_t pts);
     void flush();
     // ask host to copy image data back to guest, with image metadata
@@ -89,5 +145,54 @@ class MediaH264Decoder {
     // ask host to render to hostColorBufferId, return only image metadata back
     // to guest
     h264_image_t renderOnHostAndReturnImageMetadata(int hostColorBufferId);
+
+    // Pipelined decoding. Each submission is decoded on a worker thread and
+    // then followed by getImage(), or by renderOnHostAndReturnImageMetadata()
+    // when |hostColorBufferId| is not negative. This lets the caller parse
+    // and copy the next access unit while the host decodes the current one.
+    // The synchronous calls above wait for all submissions to run first.
+    //
+    // Returns a host-visible buffer of at least |size| bytes for the next
+    // access unit, or nullptr if there is no memory for it. Write the access
+    // unit there and pass it to submitDecodeFrame(), so that it reaches the
+    // host without another copy.
+    uint8_t *getInputBuffer(size_t size);
+    void submitDecodeFrame(uint8_t *input, size_t size, uint64_t pts,
+                           int hostColorBufferId);
+    // Returns true if a submission has not been collected yet.
+    bool hasPendingDecode();
+    // Blocks until the oldest uncollected submission completes. The image
+    // data of a getImage() submission is only valid until the next
+    // submission.
+    h264_decode_result_t waitForDecodedFrame();
+
+  private:
+    // Regions allocated after mSlot for the bitstream and for the images
+    // copied back to the guest. They grow on demand; the output region is
+    // not allocated at all while the host renders to color buffers.
+    //
+    // The bitstream goes to a ring of input regions, so that the next access
+    // unit can be written while the host decodes the current one.
+    static constexpr int kInputRingSize = 2;
+    struct InputBuffer {
+        uint8_t *addr = nullptr;
+        size_t size = 0;
+        // Read by a submission that has not been decoded yet; guarded by
+        // mPipelineMutex.
+        bool busy = false;
+    };
+    InputBuffer mInputRing[kInputRingSize];
+    int mNextInput = 0;
+    uint8_t *mOutputAddr = nullptr;
+    size_t mOutputSize = 0;
+    PixelFormat mPixFmt = PixelFormat::YUV420P;
+    unsigned int mOutWidth = 0;
+    unsigned int mOutHeight = 0;
+
+    // Makes |*addr| a region of at least |size| bytes, reallocating it if it
+    // is smaller. The old contents are not kept; on failure the old region
+    // stays allocated.
+    bool ensureRegion(uint8_t **addr, size_t *regionSize, size_t size);
+    void freeRegions();
 };
 #endif
@@ -23,6 +23,8 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
+
 #include <C2Config.h>
 #include <C2Debug.h>
 #include <C2PlatformSupport.h>
@@ -37,6 +39,21 @@
 
 namespace android {
 
+namespace {
+
+// Works processed per looper wakeup unless overridden by the property below;
+// 1 processes one work per wakeup.
+constexpr int32_t kDefaultMaxBatchedWorks = 4;
+constexpr int32_t kMaxMaxBatchedWorks = 16;
+
+uint32_t getMaxBatchedWorks() {
+    int32_t n = property_get_int32("debug.stagefright.c2.goldfish.batch",
+                                   kDefaultMaxBatchedWorks);
+    return std::min(std::max(n, 1), kMaxMaxBatchedWorks);
+}
+
+} // namespace
+
 std::unique_ptr<C2Work> SimpleC2Component::WorkQueue::pop_front() {
     std::unique_ptr<C2Work> work = std::move(mQueue.front().work);
     mQueue.pop_front();
@@ -44,19 +61,23 @@ std::unique_ptr<C2Work> SimpleC2Component::WorkQueue::pop_front() {
 }
 
 void SimpleC2Component::WorkQueue::push_back(std::unique_ptr<C2Work> work) {
-    mQueue.push_back({std::move(work), NO_DRAIN});
+    mQueue.push_back({std::move(work), NO_DRAIN, ALooper::GetNowUs()});
 }
 
 bool SimpleC2Component::WorkQueue::empty() const { return mQueue.empty(); }
 
 void SimpleC2Component::WorkQueue::clear() { mQueue.clear(); }
 
+int64_t SimpleC2Component::WorkQueue::frontQueuedAtUs() const {
+    return mQueue.front().queuedAtUs;
+}
+
 uint32_t SimpleC2Component::WorkQueue::drainMode() const {
     return mQueue.front().drainMode;
 }
 
 void SimpleC2Component::WorkQueue::markDrain(uint32_t drainMode) {
-    mQueue.push_back({nullptr, drainMode});
+    mQueue.push_back({nullptr, drainMode, ALooper::GetNowUs()});
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -197,7 +218,9 @@ struct DummyReadView : public C2ReadView {
 SimpleC2Component::SimpleC2Component(
     const std::shared_ptr<C2ComponentInterface> &intf)
     : mDummyReadView(DummyReadView()), mIntf(intf), mLooper(new ALooper),
-      mHandler(new WorkHandler) {
+      mHandler(new WorkHandler), mMaxBatchedWorks(getMaxBatchedWorks()),
+      mBatching(false) {
+    *mQueueStats.lock() = {};
     mLooper->setName(intf->getName().c_str());
     (void)mLooper->registerHandler(mHandler);
     mLooper->start(false, false, ANDROID_PRIORITY_VIDEO);
@@ -349,6 +372,15 @@ c2_status_t SimpleC2Component::stop() {
     sp<AMessage> reply;
     (new AMessage(WorkHandler::kWhatStop, mHandler))
         ->postAndAwaitResponse(&reply);
+    QueueStats stats = getQueueStats();
+    if (stats.works > 0) {
+        ALOGD("processed %" PRIu64 " works in %" PRIu64
+              " wakeups (batch %u); queue depth avg %" PRIu64 " max %" PRIu64
+              "; latency avg %" PRId64 "us max %" PRId64 "us",
+              stats.works, stats.wakeups, mMaxBatchedWorks,
+              stats.totalDepth / stats.works, stats.maxDepth,
+              stats.totalLatencyUs / (int64_t)stats.works, stats.maxLatencyUs);
+    }
     int32_t err;
     CHECK(reply->findInt32("err", &err));
     if (err != C2_OK) {
@@ -368,6 +400,7 @@ c2_status_t SimpleC2Component::reset() {
         queue->clear();
         queue->pending().clear();
     }
+    *mQueueStats.lock() = {};
     sp<AMessage> reply;
     (new AMessage(WorkHandler::kWhatReset, mHandler))
         ->postAndAwaitResponse(&reply);
@@ -386,6 +419,10 @@ std::shared_ptr<C2ComponentInterface> SimpleC2Component::intf() {
     return mIntf;
 }
 
+SimpleC2Component::QueueStats SimpleC2Component::getQueueStats() {
+    return *mQueueStats.lock();
+}
+
 namespace {
 
 std::list<std::unique_ptr<C2Work>> vec(std::unique_ptr<C2Work> &work) {
@@ -411,9 +448,7 @@ void SimpleC2Component::finish(
     }
     if (work) {
         fillWork(work);
-        std::shared_ptr<C2Component::Listener> listener =
-            mExecState.lock()->mListener;
-        listener->onWorkDone_nb(shared_from_this(), vec(work));
+        returnWork(std::move(work));
         DDD("returning pending work");
     }
 }
@@ -437,31 +472,91 @@ void SimpleC2Component::cloneAndSend(
     work->worklets.emplace_back(new C2Worklet);
     if (work) {
         fillWork(work);
-        std::shared_ptr<C2Component::Listener> listener =
-            mExecState.lock()->mListener;
-        listener->onWorkDone_nb(shared_from_this(), vec(work));
+        returnWork(std::move(work));
         DDD("cloned and sending work");
     }
 }
 
+void SimpleC2Component::returnWork(std::unique_ptr<C2Work> work) {
+    if (mBatching) {
+        mBatchedWork.push_back(std::move(work));
+        return;
+    }
+    std::shared_ptr<C2Component::Listener> listener =
+        mExecState.lock()->mListener;
+    listener->onWorkDone_nb(shared_from_this(), vec(work));
+}
+
+void SimpleC2Component::sendBatchedWork() {
+    if (mBatchedWork.empty()) {
+        return;
+    }
+    DDD("returning %zu works", mBatchedWork.size());
+    std::list<std::unique_ptr<C2Work>> works;
+    works.swap(mBatchedWork);
+    std::shared_ptr<C2Component::Listener> listener =
+        mExecState.lock()->mListener;
+    listener->onWorkDone_nb(shared_from_this(), std::move(works));
+}
+
+void SimpleC2Component::reportError(c2_status_t err) {
+    // Keep the error behind the works that were done before it.
+    sendBatchedWork();
+    Mutexed<ExecState>::Locked state(mExecState);
+    std::shared_ptr<C2Component::Listener> listener = state->mListener;
+    state.unlock();
+    listener->onError_nb(shared_from_this(), err);
+}
+
 bool SimpleC2Component::processQueue() {
+    bool hasQueuedWork = false;
+    bool keepBatching = true;
+    uint32_t processed = 0;
+    mBatching = true;
+    do {
+        hasQueuedWork = processOneWork(processed == 0, &keepBatching);
+        ++processed;
+    } while (hasQueuedWork && keepBatching && processed < mMaxBatchedWorks);
+    mBatching = false;
+    sendBatchedWork();
+    return hasQueuedWork;
+}
+
+bool SimpleC2Component::processOneWork(bool firstInBatch,
+                                       bool *keepBatching) {
     std::unique_ptr<C2Work> work;
     uint64_t generation;
     int32_t drainMode;
+    int64_t queuedAtUs;
     bool isFlushPending = false;
     bool hasQueuedWork = false;
     {
         Mutexed<WorkQueue>::Locked queue(mWorkQueue);
         if (queue->empty()) {
+            *keepBatching = false;
             return false;
         }
 
         generation = queue->generation();
         drainMode = queue->drainMode();
+        queuedAtUs = queue->frontQueuedAtUs();
         isFlushPending = queue->popPendingFlush();
         work = queue->pop_front();
         hasQueuedWork = !queue->empty();
-    }
+
+        Mutexed<QueueStats>::Locked stats(mQueueStats);
+        stats->wakeups += firstInBatch ? 1 : 0;
+        ++stats->works;
+        stats->totalDepth += queue->size() + 1;
+        stats->maxDepth =
+            std::max(stats->maxDepth, (uint64_t)queue->size() + 1);
+    }
+    auto recordLatency = [this, queuedAtUs] {
+        int64_t latencyUs = ALooper::GetNowUs() - queuedAtUs;
+        Mutexed<QueueStats>::Locked stats(mQueueStats);
+        stats->totalLatencyUs += latencyUs;
+        stats->maxLatencyUs = std::max(stats->maxLatencyUs, latencyUs);
+    };
     if (isFlushPending) {
         DDD("processing pending flush");
         c2_status_t err = onFlush_sm();
@@ -509,22 +604,20 @@ bool SimpleC2Component::processQueue() {
             return err;
         }();
         if (err != C2_OK) {
-            Mutexed<ExecState>::Locked state(mExecState);
-            std::shared_ptr<C2Component::Listener> listener = state->mListener;
-            state.unlock();
-            listener->onError_nb(shared_from_this(), err);
+            reportError(err);
+            *keepBatching = false;
             return hasQueuedWork;
         }
     }
 
     if (!work) {
         c2_status_t err = drain(drainMode, mOutputBlockPool);
+        recordLatency();
         if (err != C2_OK) {
-            Mutexed<ExecState>::Locked state(mExecState);
-            std::shared_ptr<C2Component::Listener> listener = state->mListener;
-            state.unlock();
-            listener->onError_nb(shared_from_this(), err);
+            reportError(err);
         }
+        // Let the drained output go out before anything queued behind it.
+        *keepBatching = false;
         return hasQueuedWork;
     }
 
@@ -555,6 +648,7 @@ bool SimpleC2Component::processQueue() {
     }
     process(work, mOutputBlockPool);
     DDD("processed frame #%" PRIu64, work->input.ordinal.frameIndex.peeku());
+    recordLatency();
     Mutexed<WorkQueue>::Locked queue(mWorkQueue);
     if (queue->generation() != generation) {
         ALOGD("work form old generation: was %" PRIu64 " now %" PRIu64,
@@ -562,19 +656,15 @@ bool SimpleC2Component::processQueue() {
         work->result = C2_NOT_FOUND;
         queue.unlock();
 
-        Mutexed<ExecState>::Locked state(mExecState);
-        std::shared_ptr<C2Component::Listener> listener = state->mListener;
-        state.unlock();
-        listener->onWorkDone_nb(shared_from_this(), vec(work));
+        returnWork(std::move(work));
+        // The pending flush is handled on the next wakeup.
+        *keepBatching = false;
         return hasQueuedWork;
     }
     if (work->workletsProcessed != 0u) {
         queue.unlock();
-        Mutexed<ExecState>::Locked state(mExecState);
         DDD("returning this work");
-        std::shared_ptr<C2Component::Listener> listener = state->mListener;
-        state.unlock();
-        listener->onWorkDone_nb(shared_from_this(), vec(work));
+        returnWork(std::move(work));
     } else {
         work->input.buffers.clear();
         std::unique_ptr<C2Work> unexpected;
@@ -591,10 +681,7 @@ bool SimpleC2Component::processQueue() {
         if (unexpected) {
             ALOGD("unexpected pending work");
             unexpected->result = C2_CORRUPTED;
-            Mutexed<ExecState>::Locked state(mExecState);
-            std::shared_ptr<C2Component::Listener> listener = state->mListener;
-            state.unlock();
-            listener->onWorkDone_nb(shared_from_this(), vec(unexpected));
+            returnWork(std::move(unexpected));
         }
     }
     return hasQueuedWork;
@@ -25,6 +25,9 @@
 #define DDD(...) ((void)0)
 #endif
 
+#include <algorithm>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -48,47 +51,21 @@ class GoldfishMediaTransportImpl : public GoldfishMediaTransport {
     virtual __u64 offsetOf(uint64_t addr) const override;
 
   public:
-    // each lot has 2 M
-    virtual int getMemorySlot() override {
-        std::lock_guard<std::mutex> g{mMemoryMutex};
-        // when there are just 1 decoder, it can pretty
-        // much use all the memory starting from 0;
-        // when there are two, each can use at least half
-        // the total memory, etc.
-        constexpr size_t search_order[] = {
-            0,                              // use 32M
-            16,                             // use 16M
-            8,  24,                         // use 8M
-            4,  12, 20, 28,                 // use 4M
-            2,  6,  10, 12, 18, 22, 26, 30, // use 2M
-            1,  3,  5,  7,  9,  11, 13, 15,
-            17, 19, 21, 23, 25, 27, 29, 31 // use 1M
-        };
-        for (size_t i = 0; i < sizeof(search_order) / sizeof(search_order[0]);
-             ++i) {
-            int slot = search_order[i];
-            if (mMemoryLotsAvailable[slot]) {
-                mMemoryLotsAvailable[slot] = false;
-                return slot;
-            }
-        }
-        return -1;
-    }
-    virtual void returnMemorySlot(int lot) override {
-        if (lot < 0 || lot >= mMemoryLotsAvailable.size()) {
-            return;
-        }
-        std::lock_guard<std::mutex> g{mMemoryMutex};
-        if (mMemoryLotsAvailable[lot] == false) {
-            mMemoryLotsAvailable[lot] = true;
-        } else {
-            ALOGE("Error, cannot twice");
-        }
-    }
+    virtual int getMemorySlot() override;
+    virtual void returnMemorySlot(int lot) override;
+    virtual uint8_t *allocateMemory(int slot, size_t size) override;
+    virtual void freeMemory(uint8_t *addr) override;
 
   private:
+    // Returns the end of the first slot or region overlapping
+    // [offset, offset + size), or 0 if there is none.
+    uint64_t findOverlapLocked(uint64_t offset, uint64_t size) const;
+
     std::mutex mMemoryMutex;
-    std::vector<bool> mMemoryLotsAvailable = std::vector<bool>(32, true);
+    std::vector<bool> mMemoryLotsAvailable =
+        std::vector<bool>(kMaxSlots, true);
+    // Allocated regions, offset from the start of the block to size.
+    std::map<uint64_t, uint64_t> mRegions;
 
     address_space_handle_t mHandle;
     uint64_t mOffset;
@@ -112,6 +89,12 @@ class GoldfishMediaTransportImpl : public GoldfishMediaTransport {
     // Offset from the memory region for return data (8 is size of
     // a parameter in bytes)
     static constexpr size_t kReturnOffset = 8 * kMaxParams;
+    // The host finds the parameters from the slot number, which has to fit
+    // in 5 bits of the metadata.
+    static constexpr size_t kMaxSlots = 32;
+    static constexpr uint64_t kSlotStride = 1 << 20; // 1M
+    // Regions are allocated in whole pages.
+    static constexpr uint64_t kRegionAlignment = 4096;
 };
 
 GoldfishMediaTransportImpl::~GoldfishMediaTransportImpl() {
@@ -127,6 +110,9 @@ GoldfishMediaTransportImpl::GoldfishMediaTransportImpl() {
     // ========================================================
     // | kParamSizeBytes | kInputSizeBytes | kOutputSizeBytes |
     // ========================================================
+    // The split only applies to getInputAddr() and getOutputAddr(); decoders
+    // allocate their input and output regions from the whole block with
+    // allocateMemory().
     mHandle = goldfish_address_space_open();
     if (mHandle < 0) {
         ALOGE("Failed to ping host to allocate memory");
@@ -225,3 +211,88 @@ bool GoldfishMediaTransportImpl::sendOperation(MediaCodecType type,
 
     return true;
 }
+
+uint64_t GoldfishMediaTransportImpl::findOverlapLocked(uint64_t offset,
+                                                      uint64_t size) const {
+    for (size_t slot = 0; slot < kMaxSlots; ++slot) {
+        uint64_t slotStart = slot * kSlotStride;
+        if (mMemoryLotsAvailable[slot] || slotStart >= offset + size) {
+            continue;
+        }
+        if (slotStart + kParamSizeBytes > offset) {
+            return slotStart + kParamSizeBytes;
+        }
+    }
+    // Only the region starting right before |offset| and the ones starting
+    // inside [offset, offset + size) can overlap.
+    auto it = mRegions.upper_bound(offset);
+    if (it != mRegions.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second > offset) {
+            return prev->first + prev->second;
+        }
+    }
+    if (it != mRegions.end() && it->first < offset + size) {
+        return it->first + it->second;
+    }
+    return 0;
+}
+
+int GoldfishMediaTransportImpl::getMemorySlot() {
+    std::lock_guard<std::mutex> g{mMemoryMutex};
+    // Regions of a slot are allocated after it, so lower slots leave their
+    // owners more room.
+    for (size_t slot = 0; slot < kMaxSlots; ++slot) {
+        if (mMemoryLotsAvailable[slot] &&
+            findOverlapLocked(slot * kSlotStride, kParamSizeBytes) == 0) {
+            mMemoryLotsAvailable[slot] = false;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void GoldfishMediaTransportImpl::returnMemorySlot(int lot) {
+    if (lot < 0 || lot >= mMemoryLotsAvailable.size()) {
+        return;
+    }
+    std::lock_guard<std::mutex> g{mMemoryMutex};
+    if (mMemoryLotsAvailable[lot] == false) {
+        mMemoryLotsAvailable[lot] = true;
+    } else {
+        ALOGE("Error, cannot twice");
+    }
+}
+
+uint8_t *GoldfishMediaTransportImpl::allocateMemory(int slot, size_t size) {
+    if (slot < 0 || slot >= static_cast<int>(kMaxSlots)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> g{mMemoryMutex};
+    size = (std::max<uint64_t>(size, 1) + kRegionAlignment - 1) &
+           ~(kRegionAlignment - 1);
+    // First fit, starting right after the slot.
+    uint64_t offset = slot * kSlotStride + kParamSizeBytes;
+    while (offset + size <= mSize) {
+        uint64_t overlapEnd = findOverlapLocked(offset, size);
+        if (overlapEnd == 0) {
+            mRegions[offset] = size;
+            DDD("slot %d allocated %d bytes at 0x%x", slot, (int)size,
+                (int)offset);
+            return (uint8_t *)mStartPtr + offset;
+        }
+        offset = (overlapEnd + kRegionAlignment - 1) & ~(kRegionAlignment - 1);
+    }
+    ALOGE("%s: no room for %d bytes after slot %d", __func__, (int)size, slot);
+    return nullptr;
+}
+
+void GoldfishMediaTransportImpl::freeMemory(uint8_t *addr) {
+    if (addr == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> g{mMemoryMutex};
+    if (mRegions.erase(offsetOf((uint64_t)addr)) == 0) {
+        ALOGE("%s: %p was not allocated", __func__, addr);
+    }
+}
@@ -58,6 +58,18 @@ class SimpleC2Component
     // for handler
     bool processQueue();
 
+    // Work queue counters, for tuning the batch size. The latency of a work
+    // is the time from queue_nb() until process() returns for it.
+    struct QueueStats {
+        uint64_t works;          // works and drains processed
+        uint64_t wakeups;        // processQueue() calls that processed any
+        uint64_t totalDepth;     // sum of the queue depth seen by each work
+        uint64_t maxDepth;
+        int64_t totalLatencyUs;
+        int64_t maxLatencyUs;
+    };
+    QueueStats getQueueStats();
+
   protected:
     /**
      * Initialize internal states of the component according to the config set
@@ -161,6 +173,18 @@ class SimpleC2Component
     C2ReadView mDummyReadView;
 
   private:
+    // Processes the work at the head of the queue, the first one of this
+    // wakeup if |firstInBatch|. Returns whether there is more queued work;
+    // |keepBatching| is cleared when the caller should return to the looper
+    // before taking the next one.
+    bool processOneWork(bool firstInBatch, bool *keepBatching);
+
+    // Returns |work| to the client, or holds it until the end of the current
+    // batch. Only called on the looper thread.
+    void returnWork(std::unique_ptr<C2Work> work);
+    void sendBatchedWork();
+    void reportError(c2_status_t err);
+
     const std::shared_ptr<C2ComponentInterface> mIntf;
 
     class WorkHandler : public AHandler {
@@ -220,6 +244,8 @@ class SimpleC2Component
         std::unique_ptr<C2Work> pop_front();
         void push_back(std::unique_ptr<C2Work> work);
         bool empty() const;
+        size_t size() const { return mQueue.size(); }
+        int64_t frontQueuedAtUs() const;
         uint32_t drainMode() const;
         void markDrain(uint32_t drainMode);
         inline bool popPendingFlush() {
@@ -234,6 +260,7 @@ class SimpleC2Component
         struct Entry {
             std::unique_ptr<C2Work> work;
             uint32_t drainMode;
+            int64_t queuedAtUs;
         };
 
         bool mFlush;
@@ -246,6 +273,13 @@ class SimpleC2Component
     class BlockingBlockPool;
     std::shared_ptr<BlockingBlockPool> mOutputBlockPool;
 
+    // Maximum number of works processed per looper wakeup; their results go
+    // back to the listener in a single onWorkDone_nb() call.
+    const uint32_t mMaxBatchedWorks;
+    bool mBatching;
+    std::list<std::unique_ptr<C2Work>> mBatchedWork;
+    Mutexed<QueueStats> mQueueStats;
+
     SimpleC2Component() = delete;
 };
 
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <linux/types.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef GOLDFISH_COMMON_GOLDFISH_DEFS_H
@@ -79,20 +80,31 @@ class GoldfishMediaTransport {
     // only value of significance.
     virtual __u64 offsetOf(uint64_t addr) const = 0;
 
-    // Get a slot of memory (8 M per slot) for use by a decoder instance.
+    // The address space block is shared by all decoder instances of the
+    // process. Each instance reserves a slot, where it passes parameters to
+    // the host and reads the return data:
+    // ith slot: [base+1M*i, base+1M*i+4K)
+    // and allocates separate regions for its input and output data from the
+    // space that is not used by the other instances.
+    //
+    // Get a free slot for use by a decoder instance.
     // returns -1 for failure; or a slot >=0 on success.
-    // as of now, there are only 4 slots for use, each has 8 M, it is up
-    // to client on how to use it.
-    // 0th slot: [base, base+8M)
-    // ...
-    // ith slot: [base+8M*i, base+8M*(i+1))
     virtual int getMemorySlot() = 0;
 
     // Return a slot back to pool. the slot should be valid >=0 and less
-    // than the total size of slots. If nobody returns slot timely, the
-    // new client could get -1 from getMemorySlot()
+    // than the total size of slots. Regions allocated for the slot should
+    // be freed first.
     virtual void returnMemorySlot(int slot) = 0;
 
+    // Allocate a region of at least |size| bytes for the decoder instance
+    // owning |slot|. The region always starts after the slot, so the offset
+    // passed to the host, offsetOf(addr) - 1M*slot, is never negative.
+    // returns nullptr when there is no room left in the block.
+    virtual uint8_t *allocateMemory(int slot, size_t size) = 0;
+
+    // Free a region returned by allocateMemory().
+    virtual void freeMemory(uint8_t *addr) = 0;
+
     static GoldfishMediaTransport *getInstance();
 };
 
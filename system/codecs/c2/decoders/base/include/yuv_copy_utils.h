@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GOLDFISH_C2_YUV_COPY_UTILS_H
+#define GOLDFISH_C2_YUV_COPY_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Destination planes of a YUV 4:2:0 image, as given by the C2PlanarLayout of
+// a mapped C2GraphicView. The chroma planes are either separate (I420 and
+// YV12, |uvColInc| 1) or interleaved (NV12 and NV21, |uvColInc| 2).
+struct YuvPlanes {
+    uint8_t *y;
+    uint8_t *u;
+    uint8_t *v;
+    size_t yRowInc;
+    size_t uvRowInc;
+    size_t uvColInc;
+};
+
+// Copies a |width| x |height| I420 image, whose planes are at |srcY|, |srcU|
+// and |srcV| with strides |srcYStride| and |srcUVStride|, into |dst|.
+// The destination is written with streaming stores where the compiler
+// supports them, and large frames are split across a small pool of worker
+// threads shared by all decoders of the process.
+void copyI420ToYuvPlanes(const uint8_t *srcY, const uint8_t *srcU,
+                         const uint8_t *srcV, size_t srcYStride,
+                         size_t srcUVStride, const YuvPlanes &dst,
+                         uint32_t width, uint32_t height);
+
+#endif
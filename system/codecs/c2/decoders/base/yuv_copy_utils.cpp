@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "yuv_copy_utils.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef __has_builtin
+#define __has_builtin(x) 0
+#endif
+
+namespace {
+
+// Smaller frames are copied on the calling thread; waking up the workers
+// costs more than it saves.
+constexpr size_t kMinPixelsToSplit = 1280 * 720;
+// Workers in addition to the calling thread.
+constexpr size_t kMaxWorkers = 3;
+
+typedef uint8_t Vec16 __attribute__((vector_size(16)));
+typedef uint8_t Vec32 __attribute__((vector_size(32)));
+
+// The destination is a graphic buffer that the CPU does not read back, so
+// there is no point in pulling it into the cache.
+inline void streamStore(uint8_t *dst, const void *src, size_t size) {
+#if __has_builtin(__builtin_nontemporal_store)
+    if (size == sizeof(Vec16) &&
+        (reinterpret_cast<uintptr_t>(dst) & (sizeof(Vec16) - 1)) == 0) {
+        Vec16 v;
+        memcpy(&v, src, sizeof(v));
+        __builtin_nontemporal_store(v, reinterpret_cast<Vec16 *>(dst));
+        return;
+    }
+#endif
+    memcpy(dst, src, size);
+}
+
+// Streaming stores are weakly ordered on x86; make them visible before the
+// buffer is handed on.
+inline void streamFence() {
+#if __has_builtin(__builtin_nontemporal_store) && \
+    (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_sfence();
+#endif
+}
+
+void copyRow(uint8_t *dst, const uint8_t *src, size_t size) {
+    // Align the destination so that the rest can be streamed.
+    size_t head = std::min(size, (sizeof(Vec16) -
+                                  (reinterpret_cast<uintptr_t>(dst) &
+                                   (sizeof(Vec16) - 1))) &
+                                     (sizeof(Vec16) - 1));
+    memcpy(dst, src, head);
+    size_t i = head;
+    for (; i + sizeof(Vec16) <= size; i += sizeof(Vec16)) {
+        streamStore(dst + i, src + i, sizeof(Vec16));
+    }
+    memcpy(dst + i, src + i, size - i);
+}
+
+// Writes |count| pairs of |first[x]|, |second[x]|.
+void interleaveRow(uint8_t *dst, const uint8_t *first, const uint8_t *second,
+                   size_t count) {
+    size_t i = 0;
+#if __has_builtin(__builtin_shufflevector)
+    for (; i + sizeof(Vec16) <= count; i += sizeof(Vec16)) {
+        Vec16 a, b;
+        memcpy(&a, first + i, sizeof(a));
+        memcpy(&b, second + i, sizeof(b));
+        Vec32 ab = __builtin_shufflevector(a, b, 0, 16, 1, 17, 2, 18, 3, 19, 4,
+                                           20, 5, 21, 6, 22, 7, 23, 8, 24, 9,
+                                           25, 10, 26, 11, 27, 12, 28, 13, 29,
+                                           14, 30, 15, 31);
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&ab);
+        streamStore(dst + 2 * i, bytes, sizeof(Vec16));
+        streamStore(dst + 2 * i + sizeof(Vec16), bytes + sizeof(Vec16),
+                    sizeof(Vec16));
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[2 * i] = first[i];
+        dst[2 * i + 1] = second[i];
+    }
+}
+
+void scatterRow(uint8_t *dst, size_t colInc, const uint8_t *src,
+                size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i * colInc] = src[i];
+    }
+}
+
+struct CopyParams {
+    const uint8_t *srcY;
+    const uint8_t *srcU;
+    const uint8_t *srcV;
+    size_t srcYStride;
+    size_t srcUVStride;
+    YuvPlanes dst;
+    size_t width;
+    size_t height;
+};
+
+// Copies the luma rows [2 * uvBegin, yEnd) and the chroma rows
+// [uvBegin, uvEnd).
+void copyRows(const CopyParams &p, size_t uvBegin, size_t uvEnd,
+              size_t yEnd) {
+    for (size_t row = 2 * uvBegin; row < yEnd; ++row) {
+        copyRow(p.dst.y + row * p.dst.yRowInc, p.srcY + row * p.srcYStride,
+                p.width);
+    }
+
+    const size_t uvWidth = p.width / 2;
+    for (size_t row = uvBegin; row < uvEnd; ++row) {
+        const uint8_t *srcU = p.srcU + row * p.srcUVStride;
+        const uint8_t *srcV = p.srcV + row * p.srcUVStride;
+        uint8_t *dstU = p.dst.u + row * p.dst.uvRowInc;
+        uint8_t *dstV = p.dst.v + row * p.dst.uvRowInc;
+        if (p.dst.uvColInc == 1) {
+            copyRow(dstU, srcU, uvWidth);
+            copyRow(dstV, srcV, uvWidth);
+        } else if (p.dst.uvColInc == 2 && dstV == dstU + 1) {
+            interleaveRow(dstU, srcU, srcV, uvWidth); // NV12
+        } else if (p.dst.uvColInc == 2 && dstU == dstV + 1) {
+            interleaveRow(dstV, srcV, srcU, uvWidth); // NV21
+        } else {
+            scatterRow(dstU, p.dst.uvColInc, srcU, uvWidth);
+            scatterRow(dstV, p.dst.uvColInc, srcV, uvWidth);
+        }
+    }
+    streamFence();
+}
+
+// Runs the parts of a job on the calling thread and on up to kMaxWorkers
+// threads that live as long as the process.
+class CopyWorkerPool {
+  public:
+    static CopyWorkerPool *get() {
+        static CopyWorkerPool *sPool = new CopyWorkerPool;
+        return sPool;
+    }
+
+    size_t numThreads() const { return mThreads.size() + 1; }
+
+    // Calls |job| for each part in [0, numParts) and returns once all of
+    // them are done.
+    void run(size_t numParts, const std::function<void(size_t)> &job) {
+        std::lock_guard<std::mutex> runGuard{mRunMutex};
+        std::unique_lock<std::mutex> lock{mMutex};
+        mJob = &job;
+        mNumParts = numParts;
+        mNextPart = 0;
+        mPartsDone = 0;
+        mCv.notify_all();
+        runParts(lock);
+        mDoneCv.wait(lock, [this] { return mPartsDone == mNumParts; });
+        mJob = nullptr;
+    }
+
+  private:
+    CopyWorkerPool() {
+        size_t cpus = std::thread::hardware_concurrency();
+        size_t workers = std::min(cpus > 1 ? cpus - 1 : 0, kMaxWorkers);
+        for (size_t i = 0; i < workers; ++i) {
+            mThreads.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock{mMutex};
+        while (true) {
+            mCv.wait(lock, [this] {
+                return mJob != nullptr && mNextPart < mNumParts;
+            });
+            runParts(lock);
+        }
+    }
+
+    // Takes parts of the current job until there are none left.
+    void runParts(std::unique_lock<std::mutex> &lock) {
+        while (mJob != nullptr && mNextPart < mNumParts) {
+            size_t part = mNextPart++;
+            const std::function<void(size_t)> *job = mJob;
+            lock.unlock();
+            (*job)(part);
+            lock.lock();
+            if (++mPartsDone == mNumParts) {
+                mDoneCv.notify_all();
+            }
+        }
+    }
+
+    // Serializes decoders copying at the same time.
+    std::mutex mRunMutex;
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::condition_variable mDoneCv;
+    std::vector<std::thread> mThreads;
+    const std::function<void(size_t)> *mJob = nullptr;
+    size_t mNumParts = 0;
+    size_t mNextPart = 0;
+    size_t mPartsDone = 0;
+};
+
+} // namespace
+
+void copyI420ToYuvPlanes(const uint8_t *srcY, const uint8_t *srcU,
+                         const uint8_t *srcV, size_t srcYStride,
+                         size_t srcUVStride, const YuvPlanes &dst,
+                         uint32_t width, uint32_t height) {
+    const CopyParams params = {srcY,        srcU, srcV,  srcYStride,
+                               srcUVStride, dst,  width, height};
+    const size_t uvHeight = params.height / 2;
+
+    CopyWorkerPool *pool = CopyWorkerPool::get();
+    size_t numParts = pool->numThreads();
+    if (params.width * params.height < kMinPixelsToSplit || numParts == 1 ||
+        uvHeight < numParts) {
+        copyRows(params, 0, uvHeight, params.height);
+        return;
+    }
+
+    // Split at chroma rows, so that each part also owns the two luma rows
+    // of each of its chroma rows; the last one takes an odd luma row.
+    pool->run(numParts, [&params, uvHeight, numParts](size_t part) {
+        size_t uvBegin = uvHeight * part / numParts;
+        size_t uvEnd = uvHeight * (part + 1) / numParts;
+        size_t yEnd = part + 1 == numParts ? params.height : 2 * uvEnd;
+        copyRows(params, uvBegin, uvEnd, yEnd);
+    });
+}
@@ -39,6 +39,7 @@
 #include <gralloc_cb_bp.h>
 
 #include <color_buffer_utils.h>
+#include <yuv_copy_utils.h>
 
 #include "C2GoldfishVpxDec.h"
 
@@ -505,7 +506,10 @@ void C2GoldfishVpxDec::checkContext(const std::shared_ptr<C2BlockPool> &pool) {
 
 status_t C2GoldfishVpxDec::destroyDecoder() {
     if (mCtx) {
-        ALOGI("calling destroying GoldfishVPX ctx %p", mCtx);
+        ALOGI("calling destroying GoldfishVPX ctx %p: %llu frames, %llu bytes "
+              "copied through guest memory",
+              mCtx, (unsigned long long)mOutputFrames,
+              (unsigned long long)mTotalGuestCopyBytes);
         vpx_codec_destroy(mCtx);
         delete mCtx;
         mCtx = NULL;
@@ -528,9 +532,8 @@ void fillEmptyWork(const std::unique_ptr<C2Work> &work) {
 
 void C2GoldfishVpxDec::finishWork(
     uint64_t index, const std::unique_ptr<C2Work> &work,
-    const std::shared_ptr<C2GraphicBlock> &block) {
-    std::shared_ptr<C2Buffer> buffer =
-        createGraphicBuffer(block, C2Rect(mWidth, mHeight));
+    const std::shared_ptr<C2GraphicBlock> &block, const C2Rect &crop) {
+    std::shared_ptr<C2Buffer> buffer = createGraphicBuffer(block, crop);
     auto fillWork = [buffer, index,
                      intf = this->mIntf](const std::unique_ptr<C2Work> &work) {
         uint32_t flags = 0;
@@ -663,33 +666,6 @@ void C2GoldfishVpxDec::process(const std::unique_ptr<C2Work> &work,
     }
 }
 
-static void copyOutputBufferToYuvPlanarFrame(
-    uint8_t *dst, const uint8_t *srcY, const uint8_t *srcU, const uint8_t *srcV,
-    size_t srcYStride, size_t srcUStride, size_t srcVStride, size_t dstYStride,
-    size_t dstUVStride, uint32_t width, uint32_t height) {
-    uint8_t *dstStart = dst;
-
-    for (size_t i = 0; i < height; ++i) {
-        memcpy(dst, srcY, width);
-        srcY += srcYStride;
-        dst += dstYStride;
-    }
-
-    dst = dstStart + dstYStride * height;
-    for (size_t i = 0; i < height / 2; ++i) {
-        memcpy(dst, srcV, width / 2);
-        srcV += srcVStride;
-        dst += dstUVStride;
-    }
-
-    dst = dstStart + (dstYStride * height) + (dstUVStride * height / 2);
-    for (size_t i = 0; i < height / 2; ++i) {
-        memcpy(dst, srcU, width / 2);
-        srcU += srcUStride;
-        dst += dstUVStride;
-    }
-}
-
 void C2GoldfishVpxDec::setup_ctx_parameters(vpx_codec_ctx_t *ctx,
                                             int hostColorBufferId) {
     ctx->width = mWidth;
@@ -727,7 +703,9 @@ C2GoldfishVpxDec::outputBuffer(const std::shared_ptr<C2BlockPool> &pool,
         native_handle_t *grallocHandle =
             UnwrapNativeCodec2GrallocHandle(c2Handle);
         int hostColorBufferId = getColorBufferHandle(grallocHandle);
-        if (hostColorBufferId > 0) {
+        // a context created for guest byte buffers (version 100) always
+        // returns the image to the guest, whatever the block
+        if (hostColorBufferId > 0 && mEnableAndroidNativeBuffers) {
             DDD("found handle %d", hostColorBufferId);
         } else {
             decodingToByteBuffer = true;
@@ -745,15 +723,19 @@ C2GoldfishVpxDec::outputBuffer(const std::shared_ptr<C2BlockPool> &pool,
     if (!img)
         return NOT_ENOUGH_DATA;
 
+    // the host has rendered the image into the block's color buffer at the
+    // size it was given, so such a block is output as is even when the
+    // stream size changes
+    C2Rect crop(mWidth, mHeight);
     if (img->d_w != mWidth || img->d_h != mHeight) {
         DDD("updating w %d h %d to w %d h %d", mWidth, mHeight, img->d_w,
             img->d_h);
         mWidth = img->d_w;
         mHeight = img->d_h;
 
-        // need to re-allocate since size changed, especially for byte buffer
-        // mode
-        if (true) {
+        // byte buffer mode needs a block of the new size to copy into
+        if (decodingToByteBuffer) {
+            crop = C2Rect(mWidth, mHeight);
             c2_status_t err = pool->fetchGraphicBlock(align(mWidth, 2), mHeight,
                                                       format, usage, &block);
             if (err != C2_OK) {
@@ -811,34 +793,46 @@ C2GoldfishVpxDec::outputBuffer(const std::shared_ptr<C2BlockPool> &pool,
             block->width(), block->height(), mWidth, mHeight,
             ((c2_cntr64_t *)img->user_priv)->peekll());
 
-        uint8_t *dst =
-            const_cast<uint8_t *>(wView.data()[C2PlanarLayout::PLANE_Y]);
-        size_t srcYStride = mWidth;
-        size_t srcUStride = mWidth / 2;
-        size_t srcVStride = mWidth / 2;
-        C2PlanarLayout layout = wView.layout();
-        size_t dstYStride = layout.planes[C2PlanarLayout::PLANE_Y].rowInc;
-        size_t dstUVStride = layout.planes[C2PlanarLayout::PLANE_U].rowInc;
+        const C2PlanarLayout &layout = wView.layout();
+        YuvPlanes dst;
+        dst.y = const_cast<uint8_t *>(wView.data()[C2PlanarLayout::PLANE_Y]);
+        dst.u = const_cast<uint8_t *>(wView.data()[C2PlanarLayout::PLANE_U]);
+        dst.v = const_cast<uint8_t *>(wView.data()[C2PlanarLayout::PLANE_V]);
+        dst.yRowInc = layout.planes[C2PlanarLayout::PLANE_Y].rowInc;
+        dst.uvRowInc = layout.planes[C2PlanarLayout::PLANE_U].rowInc;
+        dst.uvColInc = layout.planes[C2PlanarLayout::PLANE_U].colInc;
 
         if (img->fmt == VPX_IMG_FMT_I42016) {
             ALOGW("WARNING: not I42016 is not supported !!!");
         } else if (1) {
+            // The chroma planes follow Y in the order of the host image's
+            // format: V first only for YV12. libvpx decodes 8-bit streams
+            // to I420, whose first chroma plane lands in U, as it did when
+            // the planes were copied in order into the YCbCr_420_888 block.
             const uint8_t *srcY = (const uint8_t *)mCtx->dst;
-            const uint8_t *srcV = srcY + mWidth * mHeight;
-            const uint8_t *srcU = srcV + mWidth * mHeight / 4;
-            // TODO: the following crashes
-            copyOutputBufferToYuvPlanarFrame(dst, srcY, srcU, srcV, srcYStride,
-                                             srcUStride, srcVStride, dstYStride,
-                                             dstUVStride, mWidth, mHeight);
-            // memcpy(dst, srcY, mWidth * mHeight / 2);
+            const uint8_t *srcChroma1 = srcY + mWidth * mHeight;
+            const uint8_t *srcChroma2 = srcChroma1 + mWidth * mHeight / 4;
+            const bool uvFlipped = img->fmt == VPX_IMG_FMT_YV12;
+            const uint8_t *srcU = uvFlipped ? srcChroma2 : srcChroma1;
+            const uint8_t *srcV = uvFlipped ? srcChroma1 : srcChroma2;
+            copyI420ToYuvPlanes(srcY, srcU, srcV, mWidth, mWidth / 2, dst,
+                                mWidth, mHeight);
         }
+        mGuestCopyBytes = (uint64_t)mWidth * mHeight * 3 / 2;
+    } else {
+        mGuestCopyBytes = 0;
     }
+    mTotalGuestCopyBytes += mGuestCopyBytes;
+    ++mOutputFrames;
+    DDD("frame %llu copied %llu bytes through guest memory",
+        (unsigned long long)mOutputFrames,
+        (unsigned long long)mGuestCopyBytes);
     DDD("provided (%dx%d) required (%dx%d), out frameindex %lld",
         block->width(), block->height(), mWidth, mHeight,
         ((c2_cntr64_t *)img->user_priv)->peekll());
 
     finishWork(((c2_cntr64_t *)img->user_priv)->peekull(), work,
-               std::move(block));
+               std::move(block), crop);
     return OK;
 }
 
@@ -74,6 +74,12 @@ struct C2GoldfishVpxDec : public SimpleC2Component {
 
     uint32_t mWidth;
     uint32_t mHeight;
+    // Pixel bytes that went through guest memory for the last frame and in
+    // total, and the frames output; zero bytes means the frame was rendered
+    // straight into a host color buffer.
+    uint64_t mGuestCopyBytes{0u};
+    uint64_t mTotalGuestCopyBytes{0u};
+    uint64_t mOutputFrames{0u};
     bool mSignalledOutputEos;
     bool mSignalledError;
 
@@ -88,7 +94,8 @@ struct C2GoldfishVpxDec : public SimpleC2Component {
     status_t initDecoder();
     status_t destroyDecoder();
     void finishWork(uint64_t index, const std::unique_ptr<C2Work> &work,
-                    const std::shared_ptr<C2GraphicBlock> &block);
+                    const std::shared_ptr<C2GraphicBlock> &block,
+                    const C2Rect &crop);
     status_t outputBuffer(const std::shared_ptr<C2BlockPool> &pool,
                           const std::unique_ptr<C2Work> &work);
     c2_status_t drainInternal(uint32_t drainMode,
@@ -25,8 +25,30 @@
 
 #include "MediaH264Decoder.h"
 #include "goldfish_media_utils.h"
+#include <algorithm>
 #include <string.h>
 
+namespace {
+
+// The input region starts at this size and grows to the largest access unit.
+constexpr size_t kInitialInputSize = 512 * 1024;
+
+size_t imageSize(unsigned int width, unsigned int height,
+                 MediaH264Decoder::PixelFormat pixFmt) {
+    size_t pixels = static_cast<size_t>(width) * height;
+    switch (pixFmt) {
+    case MediaH264Decoder::PixelFormat::UYVY422:
+        return pixels * 2;
+    case MediaH264Decoder::PixelFormat::BGRA8888:
+        return pixels * 4;
+    case MediaH264Decoder::PixelFormat::YUV420P:
+    default:
+        return pixels * 3 / 2;
+    }
+}
+
+}  // namespace
+
 MediaH264Decoder::MediaH264Decoder(RenderMode renderMode) :mRenderMode(renderMode) {
   if (renderMode == RenderMode::RENDER_BY_HOST_GPU) {
       mVersion = 200;
@@ -50,8 +72,16 @@ void MediaH264Decoder::initH264Context(unsigned int width,
         mSlot = slot;
         mAddressOffSet = static_cast<unsigned int>(mSlot) * (1 << 20);
         DDD("got memory lot %d addrr %x", mSlot, mAddressOffSet);
+        if (!ensureRegion(&mInputAddr, &mInputSize, kInitialInputSize)) {
+            ALOGE("ERROR: Failed to initH264Context: cannot get input memory");
+            transport->returnMemorySlot(mSlot);
+            return;
+        }
         mHasAddressSpaceMemory = true;
     }
+    mOutWidth = outWidth;
+    mOutHeight = outHeight;
+    mPixFmt = pixFmt;
     transport->writeParam(mVersion, 0, mAddressOffSet);
     transport->writeParam(width, 1, mAddressOffSet);
     transport->writeParam(height, 2, mAddressOffSet);
@@ -76,6 +106,9 @@ void MediaH264Decoder::resetH264Context(unsigned int width,
         ALOGE("%s no address space memory", __func__);
         return;
     }
+    mOutWidth = outWidth;
+    mOutHeight = outHeight;
+    mPixFmt = pixFmt;
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->writeParam(width, 1, mAddressOffSet);
     transport->writeParam(height, 2, mAddressOffSet);
@@ -95,6 +128,7 @@ void MediaH264Decoder::destroyH264Context() {
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->sendOperation(MediaCodecType::H264Codec,
                              MediaOperation::DestroyContext, mAddressOffSet);
+    freeRegions();
     transport->returnMemorySlot(mSlot);
     mHasAddressSpaceMemory = false;
 }
@@ -106,8 +140,16 @@ h264_result_t MediaH264Decoder::decodeFrame(uint8_t* img, size_t szBytes, uint64
         ALOGE("%s no address space memory", __func__);
         return res;
     }
+    // Grow geometrically so that a stream of growing access units does not
+    // reallocate every time, unless only the exact size fits.
+    if (szBytes > mInputSize &&
+        !ensureRegion(&mInputAddr, &mInputSize, std::max(szBytes, mInputSize * 2)) &&
+        !ensureRegion(&mInputAddr, &mInputSize, szBytes)) {
+        ALOGE("%s cannot get %zu bytes of input memory", __func__, szBytes);
+        return res;
+    }
     auto transport = GoldfishMediaTransport::getInstance();
-    uint8_t* hostSrc = transport->getInputAddr(mAddressOffSet);
+    uint8_t* hostSrc = mInputAddr;
     if (img != nullptr && szBytes > 0) {
         memcpy(hostSrc, img, szBytes);
     }
@@ -145,8 +187,14 @@ h264_image_t MediaH264Decoder::getImage() {
         ALOGE("%s no address space memory", __func__);
         return res;
     }
+    if (!ensureRegion(&mOutputAddr, &mOutputSize,
+                      imageSize(mOutWidth, mOutHeight, mPixFmt))) {
+        ALOGE("%s cannot get output memory", __func__);
+        res.ret = static_cast<int>(Err::NoDecodedFrame);
+        return res;
+    }
     auto transport = GoldfishMediaTransport::getInstance();
-    uint8_t* dst = transport->getInputAddr(mAddressOffSet); // Note: reuse the same addr for input and output
+    uint8_t* dst = mOutputAddr;
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->writeParam(transport->offsetOf((uint64_t)(dst)) - mAddressOffSet, 1, mAddressOffSet);
     transport->writeParam(-1, 2, mAddressOffSet);
@@ -158,6 +206,17 @@ h264_image_t MediaH264Decoder::getImage() {
         res.data = dst;
         res.width = *(uint32_t*)(retptr + 8);
         res.height = *(uint32_t*)(retptr + 16);
+        if (imageSize(res.width, res.height, mPixFmt) > mOutputSize) {
+            // The stream grew beyond the size of the context; make room for
+            // the following images.
+            ALOGE("%s image %ux%u overflowed the output memory", __func__,
+                  res.width, res.height);
+            mOutWidth = std::max(mOutWidth, res.width);
+            mOutHeight = std::max(mOutHeight, res.height);
+            res.data = nullptr;
+            res.ret = static_cast<int>(Err::NoDecodedFrame);
+            return res;
+        }
         res.pts = *(uint64_t*)(retptr + 24);
         res.color_primaries = *(uint32_t*)(retptr + 32);
         res.color_range = *(uint32_t*)(retptr + 40);
@@ -184,7 +243,8 @@ h264_image_t MediaH264Decoder::renderOnHostAndReturnImageMetadata(int hostColorB
         return res;
     }
     auto transport = GoldfishMediaTransport::getInstance();
-    uint8_t* dst = transport->getInputAddr(mAddressOffSet); // Note: reuse the same addr for input and output
+    // The host renders to the color buffer and does not write here.
+    uint8_t* dst = mInputAddr;
     transport->writeParam((uint64_t)mHostHandle, 0, mAddressOffSet);
     transport->writeParam(transport->offsetOf((uint64_t)(dst)) - mAddressOffSet, 1, mAddressOffSet);
     transport->writeParam((uint64_t)hostColorBufferId, 2, mAddressOffSet);
@@ -207,3 +267,29 @@ h264_image_t MediaH264Decoder::renderOnHostAndReturnImageMetadata(int hostColorB
     }
     return res;
 }
+
+bool MediaH264Decoder::ensureRegion(uint8_t** addr, size_t* regionSize, size_t size) {
+    if (*addr != nullptr && *regionSize >= size) {
+        return true;
+    }
+    // Keep the old region if there is no room for the new one.
+    auto transport = GoldfishMediaTransport::getInstance();
+    uint8_t* newAddr = transport->allocateMemory(mSlot, size);
+    if (newAddr == nullptr) {
+        return false;
+    }
+    transport->freeMemory(*addr);
+    *addr = newAddr;
+    *regionSize = size;
+    return true;
+}
+
+void MediaH264Decoder::freeRegions() {
+    auto transport = GoldfishMediaTransport::getInstance();
+    transport->freeMemory(mInputAddr);
+    mInputAddr = nullptr;
+    mInputSize = 0;
+    transport->freeMemory(mOutputAddr);
+    mOutputAddr = nullptr;
+    mOutputSize = 0;
+}
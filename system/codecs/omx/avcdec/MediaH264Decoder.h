@@ -93,5 +93,24 @@ public:
     // ask host to render to hostColorBufferId, return only image metadata back to
     // guest
     h264_image_t renderOnHostAndReturnImageMetadata(int hostColorBufferId);
+
+private:
+    // Regions allocated after mSlot for the bitstream and for the images
+    // copied back to the guest, so that concurrent decoders never share
+    // memory. They grow on demand; the output region is not allocated at
+    // all while the host renders to color buffers.
+    uint8_t* mInputAddr = nullptr;
+    size_t mInputSize = 0;
+    uint8_t* mOutputAddr = nullptr;
+    size_t mOutputSize = 0;
+    PixelFormat mPixFmt = PixelFormat::YUV420P;
+    unsigned int mOutWidth = 0;
+    unsigned int mOutHeight = 0;
+
+    // Makes |*addr| a region of at least |size| bytes, reallocating it if it
+    // is smaller. The old contents are not kept; on failure the old region
+    // stays allocated.
+    bool ensureRegion(uint8_t** addr, size_t* regionSize, size_t size);
+    void freeRegions();
 };
 #endif
@@ -49,8 +49,12 @@ struct vpx_codec_ctx_t {
     size_t width;
     size_t height;
     size_t bpp;
+    // regions allocated after memory_slot for the bitstream and the
+    // decoded image; dst is only allocated when the image is copied back
     uint8_t *data;
+    size_t data_size;
     uint8_t *dst;
+    size_t dst_size;
     vpx_image_t myImg;
 };
 
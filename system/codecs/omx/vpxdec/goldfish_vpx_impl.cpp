@@ -14,6 +14,7 @@
 #include "goldfish_vpx_defs.h"
 #include "goldfish_media_utils.h"
 
+#include <algorithm>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -36,6 +37,27 @@ static uint64_t applyForOneId() {
     return s_CtxId;
 }
 
+// The input region starts at this size and grows to the largest frame.
+static constexpr size_t kInitialInputSize = 512 * 1024;
+
+// Makes |*addr| a region of at least |size| bytes; the old contents are not
+// kept. On failure the old region stays allocated.
+static bool ensureRegion(vpx_codec_ctx_t* ctx, uint8_t** addr,
+                         size_t* regionSize, size_t size) {
+    if (*addr != nullptr && *regionSize >= size) {
+        return true;
+    }
+    auto transport = GoldfishMediaTransport::getInstance();
+    uint8_t* newAddr = transport->allocateMemory(ctx->memory_slot, size);
+    if (newAddr == nullptr) {
+        return false;
+    }
+    transport->freeMemory(*addr);
+    *addr = newAddr;
+    *regionSize = size;
+    return true;
+}
+
 static void sendVpxOperation(vpx_codec_ctx_t* ctx, MediaOperation op) {
     DDD("%s %d", __func__, __LINE__);
     if (ctx->memory_slot < 0) {
@@ -57,6 +79,10 @@ int vpx_codec_destroy(vpx_codec_ctx_t* ctx) {
     auto transport = GoldfishMediaTransport::getInstance();
     transport->writeParam(ctx->id, 0, ctx->address_offset);
     sendVpxOperation(ctx, MediaOperation::DestroyContext);
+    transport->freeMemory(ctx->data);
+    transport->freeMemory(ctx->dst);
+    ctx->data = nullptr;
+    ctx->dst = nullptr;
     transport->returnMemorySlot(ctx->memory_slot);
     ctx->memory_slot = -1;
     return 0;
@@ -80,9 +106,17 @@ int vpx_codec_dec_init(vpx_codec_ctx_t* ctx) {
         ctx->version);
 
     // data and dst are on the host side actually
-    ctx->data = transport->getInputAddr(ctx->address_offset);
-    ctx->dst = transport->getInputAddr(
-            ctx->address_offset);  // re-use input address
+    ctx->data = nullptr;
+    ctx->data_size = 0;
+    ctx->dst = nullptr;
+    ctx->dst_size = 0;
+    if (!ensureRegion(ctx, &ctx->data, &ctx->data_size, kInitialInputSize)) {
+        ALOGE("ERROR: Failed %s %d: cannot get input memory", __func__,
+              __LINE__);
+        transport->returnMemorySlot(ctx->memory_slot);
+        ctx->memory_slot = -1;
+        return -1;
+    }
     transport->writeParam(ctx->id, 0, ctx->address_offset);
     transport->writeParam(ctx->version, 1, ctx->address_offset);
     sendVpxOperation(ctx, MediaOperation::InitContext);
@@ -116,6 +150,19 @@ vpx_image_t* vpx_codec_get_frame(vpx_codec_ctx_t* ctx, int hostColorBufferId) {
       ALOGE("ERROR: Failed %s %d: ctx is nullptr", __func__, __LINE__);
       return nullptr;
     }
+    // when rendering to a host color buffer, the host does not write the
+    // image back and dst only needs to be a valid offset
+    uint8_t* dst = ctx->data;
+    if (ctx->hostColorBufferId < 0) {
+        size_t imageSize =
+            ctx->outputBufferWidth * ctx->outputBufferHeight * 3 / 2 * ctx->bpp;
+        if (!ensureRegion(ctx, &ctx->dst, &ctx->dst_size, imageSize)) {
+            ALOGE("ERROR: Failed %s %d: cannot get output memory", __func__,
+                  __LINE__);
+            return nullptr;
+        }
+        dst = ctx->dst;
+    }
     auto transport = GoldfishMediaTransport::getInstance();
 
     transport->writeParam(ctx->id, 0, ctx->address_offset);
@@ -126,7 +173,7 @@ vpx_image_t* vpx_codec_get_frame(vpx_codec_ctx_t* ctx, int hostColorBufferId) {
     transport->writeParam(ctx->bpp, 5, ctx->address_offset);
     transport->writeParam(ctx->hostColorBufferId, 6, ctx->address_offset);
     transport->writeParam(
-            transport->offsetOf((uint64_t)(ctx->dst)) - ctx->address_offset, 7,
+            transport->offsetOf((uint64_t)(dst)) - ctx->address_offset, 7,
             ctx->address_offset);
 
     sendVpxOperation(ctx, MediaOperation::GetImage);
@@ -163,6 +210,16 @@ int vpx_codec_decode(vpx_codec_ctx_t *ctx,
     }
     DDD("%s %d data size %d userpriv %p", __func__, __LINE__, (int)data_sz,
         user_priv);
+    // grow geometrically so that growing frames do not reallocate every
+    // time, unless only the exact size fits
+    if (data_sz > ctx->data_size &&
+        !ensureRegion(ctx, &ctx->data, &ctx->data_size,
+                      std::max<size_t>(data_sz, ctx->data_size * 2)) &&
+        !ensureRegion(ctx, &ctx->data, &ctx->data_size, data_sz)) {
+        ALOGE("ERROR: Failed %s %d: cannot get %d bytes of input memory",
+              __func__, __LINE__, (int)data_sz);
+        return -1;
+    }
     auto transport = GoldfishMediaTransport::getInstance();
     memcpy(ctx->data, data, data_sz);
 
@@ -44,6 +44,7 @@
 
 #include "GLEncoder.h"
 #include "GL2Encoder.h"
+#include "ProgramBinaryCache.h"
 
 #include <GLES3/gl31.h>
 
@@ -1085,6 +1086,24 @@ static const char *getGLString(int glEnum)
     return hostStr;
 }
 
+// Program binaries are only valid for the host renderer that produced them.
+static void initProgramBinaryCacheDeviceKey()
+{
+    static std::atomic<bool> sInitialized(false);
+    if (sInitialized.load()) return;
+
+#define GL_RENDERER                       0x1F01
+#define GL_VERSION                        0x1F02
+
+    const char* renderer = getGLString(GL_RENDERER);
+    const char* version = getGLString(GL_VERSION);
+    if (!renderer || !version) return;
+
+    ProgramBinaryCache::get()->setDeviceKey(
+        std::string(renderer) + "\n" + version);
+    sInitialized.store(true);
+}
+
 // ----------------------------------------------------------------------------
 
 // Note: C99 syntax was tried here but does not work for all compilers.
@@ -2044,6 +2063,7 @@ EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw, EGLSurface read, EGLC
             if (exts) {
                 hostCon->gl2Encoder()->setExtensions(exts, getExtStringArray());
             }
+            initProgramBinaryCacheDeviceKey();
         }
         else {
             if (!hostCon->glEncoder()->isInitialized()) {
@@ -2569,3 +2589,16 @@ EGLint eglWaitSyncKHR(EGLDisplay dpy, EGLSyncKHR eglsync, EGLint flags) {
 
     return EGL_TRUE;
 }
+
+void eglSetBlobCacheFuncsANDROID(EGLDisplay dpy, EGLSetBlobFuncANDROID set, EGLGetBlobFuncANDROID get) {
+    (void)dpy;
+
+    DPRINT("call");
+
+    if (!set || !get) {
+        getEGLThreadInfo()->eglError = EGL_BAD_PARAMETER;
+        return;
+    }
+
+    ProgramBinaryCache::get()->setBlobFuncs(set, get);
+}
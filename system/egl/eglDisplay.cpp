@@ -24,6 +24,7 @@
 
 #include <string>
 #include <dlfcn.h>
+#include <cutils/properties.h>
 #include <GLES3/gl31.h>
 
 #include <system/graphics.h>
@@ -43,6 +44,14 @@ static const char systemStaticEGLExtensions[] =
 // extensions to add dynamically depending on host-side support
 static const char kDynamicEGLExtNativeSync[] = "EGL_ANDROID_native_fence_sync ";
 static const char kDynamicEGLExtWaitSync[] = "EGL_KHR_wait_sync ";
+static const char kDynamicEGLExtBlobCache[] = "EGL_ANDROID_blob_cache ";
+
+// The persistent program binary cache is opt-in.
+static bool isProgramBinaryCacheEnabled() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.boot.qemu.gles.program_cache", value, "0");
+    return !strcmp(value, "1");
+}
 
 static void *s_gles_lib = NULL;
 static void *s_gles2_lib = NULL;
@@ -365,6 +374,11 @@ static char *buildExtensionString()
             }
         }
 
+        if (isProgramBinaryCacheEnabled() &&
+            !strstr(initialEGLExts, kDynamicEGLExtBlobCache)) {
+            dynamicEGLExtensions += kDynamicEGLExtBlobCache;
+        }
+
         asprintf(&finalEGLExts, "%s%s", initialEGLExts, dynamicEGLExtensions.c_str());
 
         free((char*)hostExt);
@@ -25,6 +25,8 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <memory>
+#include <mutex>
 
 #include <log/log.h>
 #include <sys/mman.h>
@@ -134,6 +136,11 @@ public:
 
     virtual uint64_t getMmapedPhysAddr(uint64_t offset) const = 0;
 
+    // Returns staging memory of at least |size| bytes for the parts of a
+    // lock of |h| that cannot be done in place in the buffer. It stays with
+    // the buffer and is released by free_buffer and unregister_buffer.
+    virtual char* getScratch(buffer_handle_t h, size_t size, uint64_t* pPhysAddr) = 0;
+
     virtual int alloc_buffer(int usage,
                              int width, int height, int format,
                              EmulatorFrameworkFormat emulatorFrameworkFormat,
@@ -214,7 +221,8 @@ public:
         if (!bufferBits) { RETURN_ERROR_CODE(-EINVAL); }
 
         if (handle.hostHandle) {
-            unlock_impl(handle, bufferBits);
+            const int res = unlock_impl(handle, bufferBits);
+            if (res) { return res; }
         }
 
         return 0;
@@ -295,6 +303,16 @@ private:
         const bool usageHwCamera = usage & GRALLOC_USAGE_HW_CAMERA_MASK;
         const bool usageHwCameraWrite = usage & GRALLOC_USAGE_HW_CAMERA_WRITE;
 
+        // Only the locked rectangle is read back; an empty or out of range
+        // rectangle falls back to the whole buffer.
+        const bool rectValid = left >= 0 && top >= 0 && width > 0 && height > 0 &&
+                               left + width <= handle.width &&
+                               top + height <= handle.height;
+        const int readLeft = rectValid ? left : 0;
+        const int readTop = rectValid ? top : 0;
+        const int readWidth = rectValid ? width : handle.width;
+        const int readHeight = rectValid ? height : handle.height;
+
         const HostConnectionSession conn = getHostConnectionSession();
         ExtendedRCEncoderContext *const rcEnc = conn.getRcEncoder();
 
@@ -330,24 +348,26 @@ private:
                         bufferBits, bufferSize);
                 } else {
                     // We are using RGB888
-                    std::vector<char> tmpBuf(handle.width * handle.height * 3);
+                    char* const tmpBuf = m_bufferManager->getScratch(
+                        &handle, readWidth * readHeight * 3, nullptr);
+                    if (!tmpBuf) { RETURN_ERROR_CODE(-ENOMEM); }
                     rcEnc->rcReadColorBuffer(rcEnc, handle.hostHandle,
-                                             0, 0, handle.width, handle.height,
+                                             readLeft, readTop, readWidth, readHeight,
                                              handle.glFormat, handle.glType,
-                                             tmpBuf.data());
+                                             tmpBuf);
 
                     switch (handle.format) {
                     case HAL_PIXEL_FORMAT_YV12:
-                        rgb888_to_yv12(bufferBits, tmpBuf.data(),
+                        rgb888_to_yv12(bufferBits, tmpBuf,
                                        handle.width, handle.height,
-                                       left, top,
-                                       left + width - 1, top + height - 1);
+                                       readLeft, readTop,
+                                       readLeft + readWidth - 1, readTop + readHeight - 1);
                         break;
                     case HAL_PIXEL_FORMAT_YCbCr_420_888:
-                        rgb888_to_yuv420p(bufferBits, tmpBuf.data(),
+                        rgb888_to_yuv420p(bufferBits, tmpBuf,
                                           handle.width, handle.height,
-                                          left, top,
-                                          left + width - 1, top + height - 1);
+                                          readLeft, readTop,
+                                          readLeft + readWidth - 1, readTop + readHeight - 1);
                         break;
                     default:
                         CRASH("Unexpected format, switch is out of sync with gralloc_is_yuv_format");
@@ -355,11 +375,14 @@ private:
                     }
                 }
             } else {
+                // Whole rows land in place without staging, so the band of
+                // rows covering the rectangle is read.
+                const int bpp = glUtilsPixelBitSize(handle.glFormat, handle.glType) >> 3;
                 rcEnc->rcReadColorBuffer(rcEnc,
                                          handle.hostHandle,
-                                         0, 0, handle.width, handle.height,
+                                         0, readTop, handle.width, readHeight,
                                          handle.glFormat, handle.glType,
-                                         bufferBits);
+                                         bufferBits + readTop * handle.width * bpp);
             }
         }
 
@@ -378,7 +401,7 @@ private:
         return 0;
     }
 
-    void unlock_impl(cb_handle_t& handle, char* const bufferBits) {
+    int unlock_impl(cb_handle_t& handle, char* const bufferBits) {
         const int bpp = glUtilsPixelBitSize(handle.glFormat, handle.glType) >> 3;
         const int left = handle.lockedLeft;
         const int top = handle.lockedTop;
@@ -386,11 +409,11 @@ private:
         const int height = handle.lockedHeight;
         const uint32_t rgbSize = width * height * bpp;
 
-        std::vector<char> convertedBuf;
-        const char* bitsToSend;
-        uint32_t sizeToSend;
+        const HostConnectionSession conn = getHostConnectionSession();
+        ExtendedRCEncoderContext *const rcEnc = conn.getRcEncoder();
+
         if (gralloc_is_yuv_format(handle.format)) {
-            bitsToSend = bufferBits;
+            uint32_t sizeToSend;
             switch (handle.format) {
             case HAL_PIXEL_FORMAT_YV12:
                 get_yv12_offsets(width, height, nullptr, nullptr, &sizeToSend);
@@ -404,32 +427,46 @@ private:
                 CRASH("Unexpected format, switch is out of sync with gralloc_is_yuv_format");
                 break;
             }
+
+            rcEnc->bindDmaDirectly(bufferBits,
+                                   m_bufferManager->getMmapedPhysAddr(handle.getMmapedOffset()));
+            rcEnc->rcUpdateColorBufferDMA(rcEnc, handle.hostHandle,
+                    left, top, width, height,
+                    handle.glFormat, handle.glType,
+                    bufferBits, sizeToSend);
+        } else if (left == 0 && width == handle.width) {
+            // The locked rows are contiguous in the buffer, the host reads
+            // them in place.
+            const uint32_t offset = top * handle.width * bpp;
+            rcEnc->bindDmaDirectly(bufferBits + offset,
+                                   m_bufferManager->getMmapedPhysAddr(handle.getMmapedOffset() + offset));
+            rcEnc->rcUpdateColorBufferDMA(rcEnc, handle.hostHandle,
+                    left, top, width, height,
+                    handle.glFormat, handle.glType,
+                    bufferBits + offset, rgbSize);
         } else {
-            convertedBuf.resize(rgbSize);
+            // A narrower rectangle is compacted into the scratch block
+            // first, the host reads it from there.
+            uint64_t scratchPhysAddr;
+            char* const convertedBuf =
+                m_bufferManager->getScratch(&handle, rgbSize, &scratchPhysAddr);
+            if (!convertedBuf) { RETURN_ERROR_CODE(-ENOMEM); }
             copy_rgb_buffer_from_unlocked(
-                convertedBuf.data(), bufferBits,
+                convertedBuf, bufferBits,
                 handle.width,
                 width, height, top, left, bpp);
-            bitsToSend = convertedBuf.data();
-            sizeToSend = rgbSize;
-        }
-
-        {
-            const HostConnectionSession conn = getHostConnectionSession();
-            ExtendedRCEncoderContext *const rcEnc = conn.getRcEncoder();
-
-            rcEnc->bindDmaDirectly(bufferBits,
-                                   m_bufferManager->getMmapedPhysAddr(handle.getMmapedOffset()));
+            rcEnc->bindDmaDirectly(convertedBuf, scratchPhysAddr);
             rcEnc->rcUpdateColorBufferDMA(rcEnc, handle.hostHandle,
                     left, top, width, height,
                     handle.glFormat, handle.glType,
-                    const_cast<char*>(bitsToSend), sizeToSend);
+                    convertedBuf, rgbSize);
         }
 
         handle.lockedLeft = 0;
         handle.lockedTop = 0;
         handle.lockedWidth = 0;
         handle.lockedHeight = 0;
+        return 0;
     }
 
     //std::unique_ptr<HostConnection> m_hostConn;  // b/142677230
@@ -784,7 +821,8 @@ struct cb_handle_30_t : public cb_handle_t {
 // on the guest by qemu_pipe_open("refcount").
 class goldfish_address_space_host_malloc_buffer_manager_t : public buffer_manager_t {
 public:
-    goldfish_address_space_host_malloc_buffer_manager_t(goldfish_gralloc30_module_t* gr): m_gr(gr) {
+    goldfish_address_space_host_malloc_buffer_manager_t(goldfish_gralloc30_module_t* gr)
+            : m_gr(gr), m_scratchAllocator(false) {
         GoldfishAddressSpaceHostMemoryAllocator host_memory_allocator(false);
         CRASH_IF(!host_memory_allocator.is_opened(),
                  "GoldfishAddressSpaceHostMemoryAllocator failed to open");
@@ -800,6 +838,30 @@ public:
         return m_physAddrToOffset + offset;
     }
 
+    // Scratch is host memory too, so that uploads from it go through DMA
+    // like uploads from the buffer itself. It only grows, up to the largest
+    // rectangle locked.
+    char* getScratch(buffer_handle_t h, size_t size, uint64_t* pPhysAddr) override {
+        std::lock_guard<std::mutex> lock(m_scratchMutex);
+
+        std::unique_ptr<GoldfishAddressSpaceBlock>& scratch = m_scratch[h];
+        if (!scratch) {
+            scratch = std::make_unique<GoldfishAddressSpaceBlock>();
+        }
+        if (scratch->size() < size) {
+            m_scratchAllocator.hostFree(scratch.get());
+            if (m_scratchAllocator.hostMalloc(scratch.get(), size)) {
+                m_scratch.erase(h);
+                RETURN_ERROR(nullptr);
+            }
+        }
+
+        if (pPhysAddr) {
+            *pPhysAddr = scratch->physAddr();
+        }
+        return static_cast<char*>(scratch->guestPtr());
+    }
+
     int alloc_buffer(int usage,
                      int width, int height, int format,
                      EmulatorFrameworkFormat emulatorFrameworkFormat,
@@ -863,6 +925,8 @@ public:
         if (handle->bufferPtrPid != getpid()) { RETURN_ERROR_CODE(-EACCES); }
         if (handle->bufferFd != handle->bufferFdAsInt) { RETURN_ERROR_CODE(-EACCES); }
 
+        freeScratch(h);
+
         if (qemu_pipe_valid(handle->hostHandleRefCountFd)) {
             qemu_pipe_close(handle->hostHandleRefCountFd);
         }
@@ -917,6 +981,8 @@ public:
         if (handle->bufferPtrPid != getpid()) { RETURN_ERROR_CODE(-EACCES); }
         if (handle->bufferFd != handle->bufferFdAsInt) { RETURN_ERROR_CODE(-EACCES); }
 
+        freeScratch(h);
+
         if (handle->hostHandle) {
             const HostConnectionSession conn = m_gr->getHostConnectionSession();
             ExtendedRCEncoderContext *const rcEnc = conn.getRcEncoder();
@@ -947,8 +1013,21 @@ public:
     }
 
 private:
+    void freeScratch(buffer_handle_t h) {
+        std::lock_guard<std::mutex> lock(m_scratchMutex);
+
+        const auto i = m_scratch.find(h);
+        if (i != m_scratch.end()) {
+            m_scratchAllocator.hostFree(i->second.get());
+            m_scratch.erase(i);
+        }
+    }
+
     goldfish_gralloc30_module_t* m_gr;
     uint64_t m_physAddrToOffset;
+    GoldfishAddressSpaceHostMemoryAllocator m_scratchAllocator;
+    std::mutex m_scratchMutex;
+    std::map<buffer_handle_t, std::unique_ptr<GoldfishAddressSpaceBlock>> m_scratch;
 };
 
 std::unique_ptr<buffer_manager_t> create_buffer_manager(goldfish_gralloc30_module_t* gr) {
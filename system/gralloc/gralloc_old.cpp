@@ -216,9 +216,23 @@ struct gralloc_dmaregion_t {
     uint32_t bigbufCount;
 };
 
+// Staging for the RGB888 readback of YUV buffers, kept per buffer so that
+// repeated locks do not allocate.
+struct gralloc_scratch_t {
+    typedef std::map<const cb_handle_old_t*, std::vector<char> > ScratchMap;
+
+    gralloc_scratch_t() {
+        pthread_mutex_init(&lock, NULL);
+    }
+
+    ScratchMap buffers;
+    pthread_mutex_t lock;
+};
+
 // global device instance
 static gralloc_memregions_t* s_memregions = NULL;
 static gralloc_dmaregion_t* s_grdma = NULL;
+static gralloc_scratch_t* s_scratch = NULL;
 
 static gralloc_memregions_t* init_gralloc_memregions() {
     if (!s_memregions) {
@@ -227,6 +241,13 @@ static gralloc_memregions_t* init_gralloc_memregions() {
     return s_memregions;
 }
 
+static gralloc_scratch_t* init_gralloc_scratch() {
+    if (!s_scratch) {
+        s_scratch = new gralloc_scratch_t;
+    }
+    return s_scratch;
+}
+
 static bool has_DMA_support(const ExtendedRCEncoderContext *rcEnc) {
     return rcEnc->getDmaVersion() > 0 || rcEnc->hasDirectMem();
 }
@@ -378,6 +399,28 @@ static bool put_mem_region(ExtendedRCEncoderContext *, void* ashmemBase) {
     return shouldRemove;
 }
 
+static char* get_scratch(const cb_handle_old_t* cb, size_t sz) {
+    gralloc_scratch_t* scratch = init_gralloc_scratch();
+
+    pthread_mutex_lock(&scratch->lock);
+    std::vector<char>& buf = scratch->buffers[cb];
+    if (buf.size() < sz) {
+        buf.resize(sz);
+    }
+    char* const data = buf.data();
+    pthread_mutex_unlock(&scratch->lock);
+
+    return data;
+}
+
+static void put_scratch(const cb_handle_old_t* cb) {
+    gralloc_scratch_t* scratch = init_gralloc_scratch();
+
+    pthread_mutex_lock(&scratch->lock);
+    scratch->buffers.erase(cb);
+    pthread_mutex_unlock(&scratch->lock);
+}
+
 #if DEBUG
 static void dump_regions(ExtendedRCEncoderContext *) {
     gralloc_memregions_t* memregions = init_gralloc_memregions();
@@ -981,6 +1024,7 @@ static int gralloc_free(alloc_device_t* dev,
     grdev->allocated.erase(cb);
     pthread_mutex_unlock(&grdev->lock);
 
+    put_scratch(cb);
     delete cb;
 
     D("%s: exit", __FUNCTION__);
@@ -1087,6 +1131,7 @@ static int gralloc_unregister_buffer(gralloc_module_t const* module,
         return -EINVAL;
     }
 
+    put_scratch(cb);
 
     if (cb->hostHandle && !cb->hasRefcountPipe()) {
         D("Closing host ColorBuffer 0x%x\n", cb->hostHandle);
@@ -1237,7 +1282,15 @@ static int gralloc_lock(gralloc_module_t const* module,
             D("gralloc_lock read back color buffer %d %d ashmem base %p sz %d\n",
               cb->width, cb->height, cb->ashmemBase, cb->ashmemSize);
             void* rgb_addr = cpu_addr;
-            char* tmpBuf = 0;
+
+            // Only the locked rectangle is read back; an empty or out of
+            // range rectangle falls back to the whole buffer.
+            const bool rectValid = l >= 0 && t >= 0 && w > 0 && h > 0 &&
+                                   l + w <= cb->width && t + h <= cb->height;
+            const int readLeft = rectValid ? l : 0;
+            const int readTop = rectValid ? t : 0;
+            const int readWidth = rectValid ? w : cb->width;
+            const int readHeight = rectValid ? h : cb->height;
             if (cb->format == HAL_PIXEL_FORMAT_YV12 ||
                 cb->format == HAL_PIXEL_FORMAT_YCbCr_420_888) {
                 if (rcEnc->hasYUVCache()) {
@@ -1255,21 +1308,29 @@ static int gralloc_lock(gralloc_module_t const* module,
                                             rgb_addr, buffer_size);
                 } else {
                     // We are using RGB888
-                    tmpBuf = new char[cb->width * cb->height * 3];
+                    char* const tmpBuf = get_scratch(cb, readWidth * readHeight * 3);
                     rcEnc->rcReadColorBuffer(rcEnc, cb->hostHandle,
-                                              0, 0, cb->width, cb->height, cb->glFormat, cb->glType, tmpBuf);
+                                              readLeft, readTop, readWidth, readHeight,
+                                              cb->glFormat, cb->glType, tmpBuf);
                     if (cb->format == HAL_PIXEL_FORMAT_YV12) {
                         D("convert rgb888 to yv12 here");
-                        rgb888_to_yv12((char*)cpu_addr, tmpBuf, cb->width, cb->height, l, t, l+w-1, t+h-1);
+                        rgb888_to_yv12((char*)cpu_addr, tmpBuf, cb->width, cb->height,
+                                       readLeft, readTop,
+                                       readLeft + readWidth - 1, readTop + readHeight - 1);
                     } else if (cb->format == HAL_PIXEL_FORMAT_YCbCr_420_888) {
                         D("convert rgb888 to yuv420p here");
-                        rgb888_to_yuv420p((char*)cpu_addr, tmpBuf, cb->width, cb->height, l, t, l+w-1, t+h-1);
+                        rgb888_to_yuv420p((char*)cpu_addr, tmpBuf, cb->width, cb->height,
+                                          readLeft, readTop,
+                                          readLeft + readWidth - 1, readTop + readHeight - 1);
                     }
-                    delete [] tmpBuf;
                 }
             } else {
+                // Whole rows land in place without staging, so the band of
+                // rows covering the rectangle is read.
+                const int bpp = glUtilsPixelBitSize(cb->glFormat, cb->glType) >> 3;
                 rcEnc->rcReadColorBuffer(rcEnc, cb->hostHandle,
-                        0, 0, cb->width, cb->height, cb->glFormat, cb->glType, rgb_addr);
+                        0, readTop, cb->width, readHeight, cb->glFormat, cb->glType,
+                        (char*)rgb_addr + readTop * cb->width * bpp);
             }
         }
 
@@ -16,9 +16,20 @@
 
 #include <android/hardware/graphics/allocator/3.0/IAllocator.h>
 #include <android/hardware/graphics/mapper/3.0/IMapper.h>
+#include <cutils/properties.h>
 #include <hidl/LegacySupport.h>
 #include <qemu_pipe_bp.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+
 #include "glUtils.h"
 #include "cb_handle_30.h"
 #include "host_connection_session.h"
@@ -27,6 +38,11 @@
 
 const int kOMX_COLOR_FormatYUV420Planar = 19;
 
+// Warm spares kept per recently allocated buffer shape, and how long
+// after its last allocation a shape keeps its spares.
+const size_t kMaxSparesPerShape = 2;
+const std::chrono::seconds kSpareIdleTimeout(10);
+
 using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_vec;
 using ::android::hardware::hidl_bitfield;
@@ -46,7 +62,38 @@ using BufferDescriptorInfo = IMapper3::BufferDescriptorInfo;
 
 class GoldfishAllocator : public IAllocator3 {
 public:
-    GoldfishAllocator() : m_hostConn(HostConnection::createUnique()) {}
+    GoldfishAllocator() : m_hostConn(HostConnection::createUnique()) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("ro.boot.qemu.gralloc.pool_mb", value, "0");
+        m_poolBudget = size_t(atoi(value)) << 20;
+        if (m_poolBudget) {
+            m_poolThread = std::thread([this]{ poolThreadLoop(); });
+        }
+    }
+
+    ~GoldfishAllocator() {
+        if (m_poolThread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_poolMutex);
+                m_poolExiting = true;
+            }
+            m_poolCv.notify_one();
+            m_poolThread.join();
+        }
+
+        std::map<CbShape, std::deque<cb_handle_30_t*>> spares;
+        {
+            std::lock_guard<std::mutex> lock(m_poolMutex);
+            spares.swap(m_spares);
+            m_spareBytes = 0;
+        }
+
+        for (auto& kv : spares) {
+            for (cb_handle_30_t* cb : kv.second) {
+                freeCb(std::unique_ptr<cb_handle_30_t>(cb));
+            }
+        }
+    }
 
     Return<void> dumpDebugInfo(dumpDebugInfo_cb hidl_cb) {
         hidl_cb("GoldfishAllocator::dumpDebugInfo is not implemented");
@@ -253,8 +300,18 @@ private:
                          const uint32_t stride,
                          const uint32_t count,
                          std::vector<cb_handle_30_t*>* cbs) {
+        const CbShape shape = {
+            usage, width, height, format, emulatorFrameworkFormat,
+            glFormat, glType, bufferSize, bytesPerPixel, stride
+        };
+
         for (uint32_t i = 0; i < count; ++i) {
-            cb_handle_30_t* cb;
+            cb_handle_30_t* cb = takeSpare(shape);
+            if (cb) {
+                cbs->push_back(cb);
+                continue;
+            }
+
             Error3 e = allocateCb(usage,
                                   width, height,
                                   format, emulatorFrameworkFormat,
@@ -269,6 +326,7 @@ private:
             }
         }
 
+        requestSpares(shape);
         RETURN(Error3::NONE);
     }
 
@@ -437,7 +495,169 @@ private:
         return HostConnectionSession(m_hostConn.get());
     }
 
+    // Buffer pool. The allocator does not learn when clients release a
+    // buffer (the kernel and the refcount pipe take care of that), so
+    // freed buffers cannot be taken back. Instead, after a shape is
+    // allocated, the pool thread creates a few spares of that shape off
+    // the binder thread, so that churn (BufferQueue resizes, rotation,
+    // video start/stop) is served without the address space and host
+    // color buffer round trips. Spares are bounded by
+    // ro.boot.qemu.gralloc.pool_mb (0 disables the pool) and are released
+    // once their shape has not been allocated for kSpareIdleTimeout.
+    struct CbShape {
+        uint32_t usage;
+        uint32_t width;
+        uint32_t height;
+        PixelFormat format;
+        EmulatorFrameworkFormat emulatorFrameworkFormat;
+        int glFormat;
+        int glType;
+        size_t bufferSize;
+        uint32_t bytesPerPixel;
+        uint32_t stride;
+
+        bool operator<(const CbShape& rhs) const {
+            return std::tie(usage, width, height, format, emulatorFrameworkFormat,
+                            glFormat, glType, bufferSize, bytesPerPixel, stride) <
+                   std::tie(rhs.usage, rhs.width, rhs.height, rhs.format,
+                            rhs.emulatorFrameworkFormat, rhs.glFormat, rhs.glType,
+                            rhs.bufferSize, rhs.bytesPerPixel, rhs.stride);
+        }
+    };
+
+    cb_handle_30_t* takeSpare(const CbShape& shape) {
+        if (!m_poolBudget) { return nullptr; }
+
+        std::lock_guard<std::mutex> lock(m_poolMutex);
+        auto i = m_spares.find(shape);
+        if (i == m_spares.end() || i->second.empty()) {
+            ++m_poolMisses;
+            return nullptr;
+        }
+
+        cb_handle_30_t* cb = i->second.front();
+        i->second.pop_front();
+        m_spareBytes -= shape.bufferSize;
+        ++m_poolHits;
+        return cb;
+    }
+
+    void requestSpares(const CbShape& shape) {
+        if (!m_poolBudget) { return; }
+
+        {
+            std::lock_guard<std::mutex> lock(m_poolMutex);
+            m_wantedShapes[shape] = std::chrono::steady_clock::now();
+        }
+        m_poolCv.notify_one();
+    }
+
+    void poolThreadLoop() {
+        std::unique_lock<std::mutex> lock(m_poolMutex);
+        while (!m_poolExiting) {
+            std::vector<cb_handle_30_t*> expired;
+            trimSparesLocked(std::chrono::steady_clock::now(), &expired);
+            if (!expired.empty()) {
+                // Freeing talks to the host and the address space device,
+                // keep takeSpare callers off that path.
+                lock.unlock();
+                for (cb_handle_30_t* cb : expired) {
+                    freeCb(std::unique_ptr<cb_handle_30_t>(cb));
+                }
+                lock.lock();
+            }
+
+            while (!m_poolExiting) {
+                const CbShape* shape = nullptr;
+                for (const auto& kv : m_wantedShapes) {
+                    if (m_spares[kv.first].size() < kMaxSparesPerShape &&
+                            m_spareBytes + kv.first.bufferSize <= m_poolBudget) {
+                        shape = &kv.first;
+                        break;
+                    }
+                }
+                if (!shape) { break; }
+
+                const CbShape wanted = *shape;
+                m_spareBytes += wanted.bufferSize;
+                lock.unlock();
+
+                cb_handle_30_t* cb = nullptr;
+                const Error3 e = allocateCb(wanted.usage,
+                                            wanted.width, wanted.height,
+                                            wanted.format, wanted.emulatorFrameworkFormat,
+                                            wanted.glFormat, wanted.glType,
+                                            wanted.bufferSize,
+                                            wanted.bytesPerPixel, wanted.stride,
+                                            &cb);
+
+                lock.lock();
+                if (e == Error3::NONE) {
+                    m_spares[wanted].push_back(cb);
+                } else {
+                    m_spareBytes -= wanted.bufferSize;
+                    m_wantedShapes.erase(wanted);
+                }
+            }
+            if (m_poolExiting) { break; }
+
+            // Spares are only kept for wanted shapes, so with none there is
+            // nothing to expire until the next request.
+            if (m_wantedShapes.empty()) {
+                m_poolCv.wait(lock);
+            } else {
+                m_poolCv.wait_until(lock, nextSpareExpiryLocked());
+            }
+        }
+    }
+
+    std::chrono::steady_clock::time_point nextSpareExpiryLocked() const {
+        auto requested = m_wantedShapes.begin()->second;
+        for (const auto& kv : m_wantedShapes) {
+            requested = std::min(requested, kv.second);
+        }
+        return requested + kSpareIdleTimeout;
+    }
+
+    // Moves the spares of shapes that expired to |expired|, the caller
+    // frees them once m_poolMutex is released.
+    void trimSparesLocked(const std::chrono::steady_clock::time_point now,
+                          std::vector<cb_handle_30_t*>* expired) {
+        for (auto i = m_wantedShapes.begin(); i != m_wantedShapes.end(); ) {
+            if (now - i->second >= kSpareIdleTimeout) {
+                i = m_wantedShapes.erase(i);
+            } else {
+                ++i;
+            }
+        }
+
+        for (auto i = m_spares.begin(); i != m_spares.end(); ) {
+            if (m_wantedShapes.count(i->first)) {
+                ++i;
+                continue;
+            }
+            expired->insert(expired->end(), i->second.begin(), i->second.end());
+            m_spareBytes -= i->first.bufferSize * i->second.size();
+            i = m_spares.erase(i);
+        }
+
+        ALOGV("%s: %zu bytes in spares, %llu hits, %llu misses", __func__,
+              m_spareBytes, (unsigned long long)m_poolHits,
+              (unsigned long long)m_poolMisses);
+    }
+
     std::unique_ptr<HostConnection> m_hostConn;
+
+    size_t m_poolBudget = 0;
+    std::mutex m_poolMutex;
+    std::condition_variable m_poolCv;
+    std::thread m_poolThread;
+    bool m_poolExiting = false;
+    std::map<CbShape, std::chrono::steady_clock::time_point> m_wantedShapes;
+    std::map<CbShape, std::deque<cb_handle_30_t*>> m_spares;
+    size_t m_spareBytes = 0;
+    uint64_t m_poolHits = 0;
+    uint64_t m_poolMisses = 0;
 };
 
 int main(int, char**) {
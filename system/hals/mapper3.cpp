@@ -16,8 +16,15 @@
 
 #include <android/hardware/graphics/mapper/3.0/IMapper.h>
 #include <cutils/native_handle.h>
+#include <cutils/properties.h>
 #include <sync/sync.h>
 
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "cb_handle_30.h"
 #include "host_connection_session.h"
 #include "FormatConversions.h"
@@ -28,6 +35,7 @@
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
 
 const int kOMX_COLOR_FormatYUV420Planar = 19;
+const int kWriteTrackingBandRows = 16;
 
 using ::android::hardware::hidl_handle;
 using ::android::hardware::hidl_vec;
@@ -83,6 +91,10 @@ int waitHidlFence(const hidl_handle& hidlHandle, const char* logname) {
 class GoldfishMapper : public IMapper3 {
 public:
     GoldfishMapper() : m_hostConn(HostConnection::createUnique()) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("ro.boot.qemu.gralloc.write_tracking", value, "0");
+        m_writeTracking = atoi(value) > 0;
+
         GoldfishAddressSpaceHostMemoryAllocator host_memory_allocator(false);
         CRASH_IF(!host_memory_allocator.is_opened(),
                  "GoldfishAddressSpaceHostMemoryAllocator failed to open");
@@ -123,6 +135,17 @@ public:
             rcEnc->rcCloseColorBuffer(rcEnc, cb->hostHandle);
         }
 
+        if (m_writeTracking) {
+            std::lock_guard<std::mutex> lock(m_writeTrackingMutex);
+            m_lockedBands.erase(cb);
+            m_syncedBuffers.erase(cb);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_scratchMutex);
+            m_scratch.erase(cb);
+        }
+
         if (cb->mmapedSize > 0) {
             GoldfishAddressSpaceBlock::memoryUnmap(cb->getBufferPtr(), cb->mmapedSize);
         }
@@ -386,6 +409,17 @@ private:  // **** impl ****
         const bool usageHwCamera = usage & (BufferUsage::CAMERA_INPUT | BufferUsage::CAMERA_OUTPUT);
         const bool usageHwCameraWrite = usage & BufferUsage::CAMERA_OUTPUT;
 
+        // Only the locked rectangle is read back; an empty or out of range
+        // rectangle falls back to the whole buffer.
+        const bool rectValid = accessRegion.left >= 0 && accessRegion.top >= 0 &&
+                               accessRegion.width > 0 && accessRegion.height > 0 &&
+                               accessRegion.left + accessRegion.width <= cb.width &&
+                               accessRegion.top + accessRegion.height <= cb.height;
+        const int readLeft = rectValid ? accessRegion.left : 0;
+        const int readTop = rectValid ? accessRegion.top : 0;
+        const int readWidth = rectValid ? accessRegion.width : cb.width;
+        const int readHeight = rectValid ? accessRegion.height : cb.height;
+
         const HostConnectionSession conn = getHostConnectionSession();
         ExtendedRCEncoderContext *const rcEnc = conn.getRcEncoder();
 
@@ -421,27 +455,27 @@ private:  // **** impl ****
                         bufferBits, bufferSize);
                 } else {
                     // We are using RGB888
-                    std::vector<char> tmpBuf(cb.width * cb.height * 3);
+                    char* const tmpBuf = getScratch(cb, readWidth * readHeight * 3);
                     rcEnc->rcReadColorBuffer(rcEnc, cb.hostHandle,
-                                             0, 0, cb.width, cb.height,
+                                             readLeft, readTop, readWidth, readHeight,
                                              cb.glFormat, cb.glType,
-                                             tmpBuf.data());
+                                             tmpBuf);
                     switch (static_cast<PixelFormat>(cb.format)) {
                     case PixelFormat::YV12:
-                        rgb888_to_yv12(bufferBits, tmpBuf.data(),
+                        rgb888_to_yv12(bufferBits, tmpBuf,
                                        cb.width, cb.height,
-                                       accessRegion.left,
-                                       accessRegion.top,
-                                       accessRegion.left + accessRegion.width - 1,
-                                       accessRegion.top + accessRegion.height - 1);
+                                       readLeft,
+                                       readTop,
+                                       readLeft + readWidth - 1,
+                                       readTop + readHeight - 1);
                         break;
                     case PixelFormat::YCBCR_420_888:
-                        rgb888_to_yuv420p(bufferBits, tmpBuf.data(),
+                        rgb888_to_yuv420p(bufferBits, tmpBuf,
                                           cb.width, cb.height,
-                                          accessRegion.left,
-                                          accessRegion.top,
-                                          accessRegion.left + accessRegion.width - 1,
-                                          accessRegion.top + accessRegion.height - 1);
+                                          readLeft,
+                                          readTop,
+                                          readLeft + readWidth - 1,
+                                          readTop + readHeight - 1);
                         break;
                     default:
                         CRASH("Unexpected format, switch is out of sync with gralloc_is_yuv_format");
@@ -449,23 +483,27 @@ private:  // **** impl ****
                     }
                 }
             } else {
+                // Whole rows land in place without staging, so the band of
+                // rows covering the rectangle is read.
+                const size_t bandOffset = size_t(readTop) * cb.width * cb.bytesPerPixel;
+                char* const bandBits = bufferBits + bandOffset;
                 if (rcEnc->featureInfo()->hasReadColorBufferDma) {
                     {
                         AEMU_SCOPED_TRACE("bindDmaDirectly");
-                        rcEnc->bindDmaDirectly(bufferBits,
-                                getMmapedPhysAddr(cb.getMmapedOffset()));
+                        rcEnc->bindDmaDirectly(bandBits,
+                                getMmapedPhysAddr(cb.getMmapedOffset() + bandOffset));
                     }
                     rcEnc->rcReadColorBufferDMA(rcEnc,
                         cb.hostHandle,
-                        0, 0, cb.width, cb.height,
+                        0, readTop, cb.width, readHeight,
                         cb.glFormat, cb.glType,
-                        bufferBits, cb.width * cb.height * cb.bytesPerPixel);
+                        bandBits, cb.width * readHeight * cb.bytesPerPixel);
                 } else {
                     rcEnc->rcReadColorBuffer(rcEnc,
                         cb.hostHandle,
-                        0, 0, cb.width, cb.height,
+                        0, readTop, cb.width, readHeight,
                         cb.glFormat, cb.glType,
-                        bufferBits);
+                        bandBits);
                 }
             }
         }
@@ -485,6 +523,18 @@ private:  // **** impl ****
         cb.locked = 1;
         cb.lockedUsage = usage;
 
+        // Unchanged rows may only be skipped if the guest copy matches the
+        // host: either it was just read back, or nothing but CPU unlocks
+        // ever writes this buffer.
+        const bool hostWritable = cb.usage & (BufferUsage::GPU_RENDER_TARGET |
+                                              BufferUsage::CAMERA_OUTPUT);
+        const bool guestMatchesHost = (usageSwRead && !usageHwCamera && cbReadable) ||
+                                      !hostWritable;
+        if (m_writeTracking && usageSwWrite && guestMatchesHost &&
+                !gralloc_is_yuv_format(cb.format)) {
+            saveLockedBand(cb, bufferBits);
+        }
+
         RETURN(Error3::NONE);
     }
 
@@ -516,9 +566,10 @@ private:  // **** impl ****
         AEMU_SCOPED_TRACE("unlockHostImpl body");
         const int bpp = glUtilsPixelBitSize(cb.glFormat, cb.glType) >> 3;
         const uint32_t lockedUsage = cb.lockedUsage;
-        const uint32_t rgbSize = cb.width * cb.height * bpp;
         const char* bitsToSend;
         uint32_t sizeToSend;
+        int updateTop = 0;
+        int updateHeight = cb.height;
 
         const uint32_t usageSwWrite = (uint32_t)BufferUsage::CPU_WRITE_MASK;
         uint32_t readOnly = (!(lockedUsage & usageSwWrite));
@@ -538,26 +589,34 @@ private:  // **** impl ****
                         break;
                 }
             } else {
-                bitsToSend = bufferBits;
-                sizeToSend = rgbSize;
+                // Only the rows covering the locked rectangle can have
+                // changed. They are contiguous in the buffer, so the host
+                // reads them in place.
+                getLockedBand(cb, &updateTop, &updateHeight);
+                if (m_writeTracking &&
+                    !narrowToWrittenBand(cb, bufferBits, &updateTop, &updateHeight)) {
+                    readOnly = true;
+                }
+                bitsToSend = bufferBits + size_t(updateTop) * cb.width * bpp;
+                sizeToSend = cb.width * updateHeight * bpp;
             }
+        }
 
+        if (!readOnly) {
+            const HostConnectionSession conn = getHostConnectionSession();
+            ExtendedRCEncoderContext *const rcEnc = conn.getRcEncoder();
             {
-                const HostConnectionSession conn = getHostConnectionSession();
-                ExtendedRCEncoderContext *const rcEnc = conn.getRcEncoder();
-                {
-                    AEMU_SCOPED_TRACE("bindDmaDirectly");
-                    rcEnc->bindDmaDirectly(bufferBits,
-                            getMmapedPhysAddr(cb.getMmapedOffset()));
-                }
-                {
-                    AEMU_SCOPED_TRACE("updateColorBuffer");
-                    rcEnc->rcUpdateColorBufferDMA(rcEnc, cb.hostHandle,
-                            0, 0, cb.width, cb.height,
-                            cb.glFormat, cb.glType,
-                            const_cast<char*>(bitsToSend),
-                            sizeToSend);
-                }
+                AEMU_SCOPED_TRACE("bindDmaDirectly");
+                rcEnc->bindDmaDirectly(const_cast<char*>(bitsToSend),
+                        getMmapedPhysAddr(cb.getMmapedOffset() + (bitsToSend - bufferBits)));
+            }
+            {
+                AEMU_SCOPED_TRACE("updateColorBuffer");
+                rcEnc->rcUpdateColorBufferDMA(rcEnc, cb.hostHandle,
+                        0, updateTop, cb.width, updateHeight,
+                        cb.glFormat, cb.glType,
+                        const_cast<char*>(bitsToSend),
+                        sizeToSend);
             }
         }
 
@@ -646,8 +705,140 @@ private:  // **** impl ****
         return m_physAddrToOffset + offset;
     }
 
+    static void getLockedBand(const cb_handle_30_t& cb, int* top, int* height) {
+        if (cb.lockedHeight > 0 && cb.lockedTop >= 0 &&
+            cb.lockedTop + cb.lockedHeight <= cb.height) {
+            *top = cb.lockedTop;
+            *height = cb.lockedHeight;
+        } else {
+            *top = 0;
+            *height = cb.height;
+        }
+    }
+
+    static void hashBand(const cb_handle_30_t& cb, const char* bufferBits,
+                         int top, int height, std::vector<uint64_t>* hashes) {
+        const int bpp = glUtilsPixelBitSize(cb.glFormat, cb.glType) >> 3;
+        hashes->resize((height + kWriteTrackingBandRows - 1) / kWriteTrackingBandRows);
+        hash_rgb_bands_from_unlocked(hashes->data(), bufferBits, cb.width,
+                                     cb.width, height, top, 0,
+                                     bpp, kWriteTrackingBandRows);
+    }
+
+    // Write tracking: the rows a CPU write lock covers are hashed in bands
+    // at lock time and again at unlock, and only the span of bands that
+    // changed is sent to the host.
+    void saveLockedBand(const cb_handle_30_t& cb, const char* bufferBits) {
+        AEMU_SCOPED_TRACE("saveLockedBand");
+        LockedBand band;
+        getLockedBand(cb, &band.top, &band.height);
+        hashBand(cb, bufferBits, band.top, band.height, &band.hashes);
+
+        std::lock_guard<std::mutex> lock(m_writeTrackingMutex);
+        m_lockedBands[&cb] = std::move(band);
+    }
+
+    // Returns false if nothing was written, otherwise narrows [top, top +
+    // height) to the rows that changed. The first unlock of each imported
+    // buffer sends all of it instead, because the host copy of a new buffer
+    // is undefined even where the CPU wrote what the guest memory held.
+    bool narrowToWrittenBand(const cb_handle_30_t& cb, const char* bufferBits,
+                             int* top, int* height) {
+        AEMU_SCOPED_TRACE("narrowToWrittenBand");
+        const int bpp = glUtilsPixelBitSize(cb.glFormat, cb.glType) >> 3;
+        const uint64_t bandBytes = uint64_t(cb.width) * (*height) * bpp;
+
+        LockedBand saved;
+        {
+            std::lock_guard<std::mutex> lock(m_writeTrackingMutex);
+            if (m_syncedBuffers.insert(&cb).second) {
+                m_lockedBands.erase(&cb);
+                *top = 0;
+                *height = cb.height;
+                m_bytesSent += uint64_t(cb.width) * cb.height * bpp;
+                return true;
+            }
+
+            auto i = m_lockedBands.find(&cb);
+            if (i == m_lockedBands.end()) {
+                m_bytesSent += bandBytes;
+                return true;
+            }
+            saved = std::move(i->second);
+            m_lockedBands.erase(i);
+        }
+
+        if (saved.top != *top || saved.height != *height) {
+            std::lock_guard<std::mutex> lock(m_writeTrackingMutex);
+            m_bytesSent += bandBytes;
+            return true;
+        }
+
+        std::vector<uint64_t> current;
+        hashBand(cb, bufferBits, *top, *height, &current);
+
+        size_t first = 0;
+        while (first < current.size() && current[first] == saved.hashes[first]) {
+            ++first;
+        }
+        size_t last = current.size();
+        while (last > first && current[last - 1] == saved.hashes[last - 1]) {
+            --last;
+        }
+
+        const int changedTop = *top + int(first) * kWriteTrackingBandRows;
+        const int changedBottom =
+            std::min(*top + *height, *top + int(last) * kWriteTrackingBandRows);
+        const int changedHeight = changedBottom > changedTop ? changedBottom - changedTop : 0;
+        const uint64_t changedBytes = uint64_t(cb.width) * changedHeight * bpp;
+
+        {
+            std::lock_guard<std::mutex> lock(m_writeTrackingMutex);
+            m_bytesSent += changedBytes;
+            m_bytesSkipped += bandBytes - changedBytes;
+            ALOGV("%s: sent %" PRIu64 " bytes, skipped %" PRIu64 " bytes so far",
+                  __func__, m_bytesSent, m_bytesSkipped);
+        }
+
+        if (!changedHeight) {
+            return false;
+        }
+
+        *top = changedTop;
+        *height = changedHeight;
+        return true;
+    }
+
+    // Returns the staging buffer of |cb| for the RGB888 readback of YUV
+    // buffers, grown to |size| bytes. It is kept until freeBuffer.
+    char* getScratch(const cb_handle_30_t& cb, size_t size) {
+        std::lock_guard<std::mutex> lock(m_scratchMutex);
+        std::vector<char>& scratch = m_scratch[&cb];
+        if (scratch.size() < size) {
+            scratch.resize(size);
+        }
+        return scratch.data();
+    }
+
+    struct LockedBand {
+        int top = 0;
+        int height = 0;
+        std::vector<uint64_t> hashes;
+    };
+
     std::unique_ptr<HostConnection> m_hostConn;
     uint64_t m_physAddrToOffset;
+
+    bool m_writeTracking = false;
+    std::mutex m_writeTrackingMutex;
+    std::unordered_map<const cb_handle_30_t*, LockedBand> m_lockedBands;
+    // Buffers that had all of their rows sent to the host at least once.
+    std::unordered_set<const cb_handle_30_t*> m_syncedBuffers;
+    uint64_t m_bytesSent = 0;
+    uint64_t m_bytesSkipped = 0;
+
+    std::mutex m_scratchMutex;
+    std::unordered_map<const cb_handle_30_t*, std::vector<char>> m_scratch;
 };
 }  // namespace
 
@@ -53,7 +53,9 @@ class Composer {
                             outLayerCompositionChanges) = 0;
 
   // Performs the actual composition of layers and presents the composed result
-  // to the display.
+  // to the display. Called with the display's state lock held, on the
+  // display's present thread when it has one, so that different displays
+  // may be presented at the same time.
   virtual std::tuple<HWC2::Error, base::unique_fd> presentDisplay(
       Display* display) = 0;
   virtual HWC2::Error onActiveConfigChange(Display* display) = 0;
@@ -18,6 +18,9 @@
 
 #include <android-base/properties.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "DisplayFinder.h"
 #include "GuestComposer.h"
 #include "HostComposer.h"
@@ -162,7 +165,9 @@ HWC2::Error Device::destroyDisplays() {
   }
 
   for (auto& [displayId, displayPtr] : mDisplays) {
+    displayPtr->lock();
     HWC2::Error error = mComposer->onDisplayDestroy(displayPtr.get());
+    displayPtr->unlock();
     if (error != HWC2::Error::None) {
       ALOGE("%s composer failed to destroy displays", __FUNCTION__);
       return error;
@@ -468,10 +473,23 @@ HWC2::Error Device::destroyVirtualDisplay(hwc2_display_t /*displayId*/) {
   return HWC2::Error::None;
 }
 
-void Device::dump(uint32_t* /*outSize*/, char* /*outBuffer*/) {
+void Device::dump(uint32_t* outSize, char* outBuffer) {
   DEBUG_LOG("%s", __FUNCTION__);
-  // TODO:
-  return;
+
+  std::unique_lock<std::mutex> lock(mStateMutex);
+
+  if (outBuffer == nullptr) {
+    mDumpString.clear();
+    for (const auto& [displayId, display] : mDisplays) {
+      mDumpString += display->dump();
+    }
+    *outSize = static_cast<uint32_t>(mDumpString.size());
+    return;
+  }
+
+  const std::size_t size = std::min<std::size_t>(*outSize, mDumpString.size());
+  std::memcpy(outBuffer, mDumpString.data(), size);
+  *outSize = static_cast<uint32_t>(size);
 }
 
 uint32_t Device::getMaxVirtualDisplayCount() {
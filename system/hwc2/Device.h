@@ -22,6 +22,7 @@
 #include <memory>
 #include <mutex>
 #include <set>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -146,6 +147,9 @@ class Device : public hwc2_device_t {
   std::unordered_map<HWC2::Callback, CallbackInfo> mCallbacks;
 
   std::map<hwc2_display_t, std::unique_ptr<Display>> mDisplays;
+
+  // Built by the size query of dump() and returned by the following call.
+  std::string mDumpString;
 };
 
 }  // namespace android
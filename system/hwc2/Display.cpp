@@ -16,9 +16,12 @@
 
 #include "Display.h"
 
+#include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
+#include <sw_sync.h>
 #include <sync/sync.h>
 
+#include <algorithm>
 #include <atomic>
 #include <numeric>
 #include <sstream>
@@ -29,8 +32,13 @@
 namespace android {
 namespace {
 
+using android::base::StringPrintf;
 using android::hardware::graphics::common::V1_0::ColorTransform;
 
+// How long the present thread waits for the composer's fences before it
+// signals the present anyway.
+constexpr const int kPresentFenceTimeoutMs = 3000;
+
 bool IsValidColorMode(android_color_mode_t mode) {
   switch (mode) {
     case HAL_COLOR_MODE_NATIVE:                         // Fall-through
@@ -66,7 +74,16 @@ bool isValidPowerMode(HWC2::PowerMode mode) {
 Display::Display(Composer* composer, hwc2_display_t id)
     : mComposer(composer), mId(id), mVsyncThread(new VsyncThread(id)) {}
 
-Display::~Display() {}
+Display::~Display() {
+  if (mPresentThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> presentLock(mPresentMutex);
+      mPresentThreadExiting = true;
+    }
+    mPresentCv.notify_all();
+    mPresentThread.join();
+  }
+}
 
 HWC2::Error Display::init(const std::vector<DisplayConfig>& configs,
                           hwc2_config_t activeConfigId,
@@ -94,6 +111,14 @@ HWC2::Error Display::init(const std::vector<DisplayConfig>& configs,
 
   mVsyncThread->start(activeConfig.getVsyncPeriod());
 
+  mPresentTimeline.reset(sw_sync_timeline_create());
+  if (mPresentTimeline.ok()) {
+    mPresentThread = std::thread([this] { presentThreadLoop(); });
+  } else {
+    ALOGW("%s: display:%" PRIu64 " has no sw_sync, presenting on the caller's"
+          " thread", __FUNCTION__, mId);
+  }
+
   return HWC2::Error::None;
 }
 
@@ -381,17 +406,25 @@ HWC2::Error Display::addReleaseFenceLocked(hwc2_layer_t layerId,
   return HWC2::Error::None;
 }
 
+void Display::setPresentSkippedLocked() {
+  DEBUG_LOG("%s: display:%" PRIu64, __FUNCTION__, mId);
+
+  mPresentSkipped = true;
+}
+
 HWC2::Error Display::getReleaseFences(uint32_t* outNumElements,
                                       hwc2_layer_t* outLayers,
                                       int32_t* outFences) {
   DEBUG_LOG("%s: display:%" PRIu64, __FUNCTION__, mId);
 
-  std::unique_lock<std::recursive_mutex> lock(mStateMutex);
+  // Does not wait for the present thread, SurfaceFlinger asks right after
+  // present().
+  std::unique_lock<std::mutex> lock(mPresentedReleaseFencesMutex);
 
   uint32_t outArraySize = *outNumElements;
 
   *outNumElements = 0;
-  for (const auto& [_, releaseFence] : mReleaseFences) {
+  for (const auto& [_, releaseFence] : mPresentedReleaseFences) {
     if (releaseFence.ok()) {
       (*outNumElements)++;
     }
@@ -404,7 +437,7 @@ HWC2::Error Display::getReleaseFences(uint32_t* outNumElements,
   DEBUG_LOG("%s export release fences", __FUNCTION__);
 
   uint32_t index = 0;
-  for (const auto& [layer_id, releaseFence] : mReleaseFences) {
+  for (const auto& [layer_id, releaseFence] : mPresentedReleaseFences) {
     if (index >= outArraySize) {
       break;
     }
@@ -502,17 +535,126 @@ HWC2::Error Display::present(int32_t* outRetireFencePtr) {
     return HWC2::Error::NoResources;
   }
 
+  base::unique_fd presentFence;
+  if (mPresentThread.joinable()) {
+    presentFence.reset(sw_sync_fence_create(
+        mPresentTimeline.get(), "hwc2_present", mPresentTimelineValue + 1));
+    if (!presentFence.ok()) {
+      ALOGE("%s: display:%" PRIu64 " failed to create present fence",
+            __FUNCTION__, mId);
+    }
+  }
+
+  if (!presentFence.ok()) {
+    HWC2::Error error;
+    base::unique_fd outRetireFence;
+    std::tie(error, outRetireFence) = presentLocked();
+    {
+      std::lock_guard<std::mutex> fencesLock(mPresentedReleaseFencesMutex);
+      mPresentedReleaseFences = std::move(mReleaseFences);
+      mReleaseFences.clear();
+    }
+    if (error != HWC2::Error::None) {
+      ALOGE("%s: display:%" PRIu64 " failed to present", __FUNCTION__, mId);
+      return error;
+    }
+
+    DEBUG_LOG("%s: display:%" PRIu64 " present done!", __FUNCTION__, mId);
+    *outRetireFencePtr = outRetireFence.release();
+    return HWC2::Error::None;
+  }
+  mPresentTimelineValue++;
+
+  // Until the present thread is done, any layer's buffer may still be read.
+  {
+    std::lock_guard<std::mutex> fencesLock(mPresentedReleaseFencesMutex);
+    mPresentedReleaseFences.clear();
+    for (Layer* layer : mOrderedLayers) {
+      mPresentedReleaseFences.emplace(
+          layer->getId(), base::unique_fd(dup(presentFence.get())));
+    }
+  }
+
+  // Hand the display over to the present thread. It holds mStateMutex while
+  // it presents, so the next call into this display waits for it, while
+  // SurfaceFlinger goes on with the other displays.
+  lock.unlock();
+  {
+    std::unique_lock<std::mutex> presentLock(mPresentMutex);
+    mPresentQueued = true;
+    mPresentCv.notify_all();
+    mPresentCv.wait(presentLock, [this] { return !mPresentQueued; });
+  }
+
+  DEBUG_LOG("%s: display:%" PRIu64 " present queued", __FUNCTION__, mId);
+  *outRetireFencePtr = presentFence.release();
+  return HWC2::Error::None;
+}
+
+std::tuple<HWC2::Error, base::unique_fd> Display::presentLocked() {
   HWC2::Error error;
   base::unique_fd outRetireFence;
+  mPresentSkipped = false;
+  const auto presentStart = std::chrono::steady_clock::now();
   std::tie(error, outRetireFence) = mComposer->presentDisplay(this);
+  const auto presentTime = std::chrono::steady_clock::now() - presentStart;
+  mPresentCallTiming.presents++;
+  mPresentCallTiming.total += presentTime;
+  mPresentCallTiming.max = std::max<std::chrono::nanoseconds>(
+      mPresentCallTiming.max, presentTime);
+  mPresentCallTiming.last = presentTime;
   if (error != HWC2::Error::None) {
-    ALOGE("%s: display:%" PRIu64 " failed to present", __FUNCTION__, mId);
-    return error;
+    return std::make_tuple(error, std::move(outRetireFence));
   }
 
-  DEBUG_LOG("%s: display:%" PRIu64 " present done!", __FUNCTION__, mId);
-  *outRetireFencePtr = outRetireFence.release();
-  return HWC2::Error::None;
+  // Skipped presents would teach the vsync model the latency of a frame
+  // that was never composed.
+  if (outRetireFence.ok() && !mPresentSkipped) {
+    mVsyncThread->trackPresentFence(
+        base::unique_fd(dup(outRetireFence.get())));
+  }
+
+  return std::make_tuple(error, std::move(outRetireFence));
+}
+
+void Display::presentThreadLoop() {
+  std::unique_lock<std::mutex> presentLock(mPresentMutex);
+  while (true) {
+    mPresentCv.wait(presentLock, [this] {
+      return mPresentQueued || mPresentThreadExiting;
+    });
+    if (!mPresentQueued) {
+      break;
+    }
+
+    std::unique_lock<std::recursive_mutex> stateLock(mStateMutex);
+    mPresentQueued = false;
+    presentLock.unlock();
+    mPresentCv.notify_all();
+
+    auto [error, retireFence] = presentLocked();
+    if (error != HWC2::Error::None) {
+      ALOGE("%s: display:%" PRIu64 " failed to present", __FUNCTION__, mId);
+    }
+    std::vector<base::unique_fd> fences;
+    fences.push_back(std::move(retireFence));
+    for (auto& [_, releaseFence] : mReleaseFences) {
+      fences.push_back(std::move(releaseFence));
+    }
+    mReleaseFences.clear();
+    stateLock.unlock();
+
+    // The fences returned by present() stand for all of these.
+    for (const base::unique_fd& fence : fences) {
+      if (fence.ok() && sync_wait(fence.get(), kPresentFenceTimeoutMs) < 0) {
+        ALOGE("%s: display:%" PRIu64 " waited on fence %d for %d ms",
+              __FUNCTION__, mId, fence.get(), kPresentFenceTimeoutMs);
+      }
+    }
+    sw_sync_timeline_inc(mPresentTimeline.get(), 1);
+
+    presentLock.lock();
+  }
 }
 
 HWC2::Error Display::setActiveConfig(hwc2_config_t configId) {
@@ -529,12 +671,14 @@ HWC2::Error Display::setActiveConfig(hwc2_config_t configId) {
 HWC2::Error Display::setClientTarget(buffer_handle_t target,
                                      int32_t acquireFence,
                                      int32_t /*dataspace*/,
-                                     hwc_region_t /*damage*/) {
+                                     hwc_region_t damage) {
   DEBUG_LOG("%s: display:%" PRIu64, __FUNCTION__, mId);
 
   std::unique_lock<std::recursive_mutex> lock(mStateMutex);
   mClientTarget.setBuffer(target);
   mClientTarget.setFence(base::unique_fd(acquireFence));
+  mClientTargetDamage.resize(damage.numRects);
+  std::copy_n(damage.rects, damage.numRects, mClientTargetDamage.data());
   mComposer->onDisplayClientTargetSet(this);
   return HWC2::Error::None;
 }
@@ -1045,4 +1189,26 @@ HWC2::Error Display::setContentType(int32_t contentTypeRaw) {
   return HWC2::Error::None;
 }
 
+std::string Display::dump() {
+  std::unique_lock<std::recursive_mutex> lock(mStateMutex);
+
+  const PresentCallTiming& timing = mPresentCallTiming;
+  const auto asMillis = [](std::chrono::nanoseconds nanos) {
+    return nanos.count() / 1000000.0;
+  };
+  const std::chrono::nanoseconds mean =
+      timing.presents == 0
+          ? std::chrono::nanoseconds(0)
+          : timing.total / static_cast<int64_t>(timing.presents);
+
+  return "Display " + std::to_string(mId) + " (" + mName + "):\n" +
+         StringPrintf("  present calls: %" PRIu64
+                      ", mean: %.3f ms, max: %.3f ms, last: %.3f ms, on %s\n",
+                      timing.presents, asMillis(mean), asMillis(timing.max),
+                      asMillis(timing.last),
+                      mPresentThread.joinable() ? "present thread"
+                                                : "caller thread") +
+         mVsyncThread->dump();
+}
+
 }  // namespace android
@@ -21,10 +21,14 @@
 #include <android/hardware/graphics/common/1.0/types.h>
 
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <optional>
 #include <set>
+#include <string>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
@@ -72,6 +76,10 @@ class Display {
 
   FencedBuffer& getClientTarget() { return mClientTarget; }
   buffer_handle_t waitAndGetClientTargetBuffer();
+  // Damaged rects of the client target. Empty means the whole target.
+  const std::vector<hwc_rect_t>& getClientTargetDamage() const {
+    return mClientTargetDamage;
+  }
 
   const std::vector<Layer*>& getOrderedLayers() { return mOrderedLayers; }
 
@@ -100,6 +108,10 @@ class Display {
   HWC2::Error getReleaseFences(uint32_t* outNumElements,
                                hwc2_layer_t* outLayers, int32_t* outFences);
   HWC2::Error clearReleaseFencesAndIdsLocked();
+  // Called by the composer when the current present shows the previous
+  // frame again without composing it. Its retire fence then says nothing
+  // about how long a composition takes to reach the screen.
+  void setPresentSkippedLocked();
   HWC2::Error getRequests(int32_t* outDisplayRequests, uint32_t* outNumElements,
                           hwc2_layer_t* outLayers, int32_t* outLayerRequests);
   HWC2::Error getType(int32_t* outType);
@@ -148,6 +160,7 @@ class Display {
       uint32_t* outNumSupportedContentTypes,
       const uint32_t* outSupportedContentTypes);
   HWC2::Error setContentType(int32_t contentType);
+  std::string dump();
   void lock() { mStateMutex.lock(); }
   void unlock() { mStateMutex.unlock(); }
 
@@ -191,6 +204,10 @@ class Display {
     std::unordered_map<hwc2_layer_t, HWC2::LayerRequest> mLayerRequests;
   };
 
+  // Runs the composer's present of this display and records its timing.
+  std::tuple<HWC2::Error, base::unique_fd> presentLocked();
+  void presentThreadLoop();
+
  private:
   // The state of this display should only be modified from
   // SurfaceFlinger's main loop, with the exception of when dump is
@@ -205,6 +222,7 @@ class Display {
   HWC2::PowerMode mPowerMode = HWC2::PowerMode::Off;
   sp<VsyncThread> mVsyncThread;
   FencedBuffer mClientTarget;
+  std::vector<hwc_rect_t> mClientTargetDamage;
   // Will only be non-null after the Display has been validated and
   // before it has been presented
   std::unique_ptr<Changes> mChanges;
@@ -213,13 +231,43 @@ class Display {
   // Ordered layers available after validate().
   std::vector<Layer*> mOrderedLayers;
 
+  // Release fences added by the composer during a present.
   std::unordered_map<hwc2_layer_t, base::unique_fd> mReleaseFences;
+  // Release fences of the last present, as returned by getReleaseFences().
+  std::mutex mPresentedReleaseFencesMutex;
+  std::unordered_map<hwc2_layer_t, base::unique_fd> mPresentedReleaseFences;
   std::optional<hwc2_config_t> mActiveConfigId;
   std::unordered_map<hwc2_config_t, DisplayConfig> mConfigs;
   std::set<android_color_mode_t> mColorModes = {HAL_COLOR_MODE_NATIVE};
   android_color_mode_t mActiveColorMode = HAL_COLOR_MODE_NATIVE;
   std::optional<ColorTransformWithMatrix> mColorTransform;
   std::optional<std::vector<uint8_t>> mEdid;
+
+  // How long the composer takes to present this display.
+  struct PresentCallTiming {
+    uint64_t presents = 0;
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds max{0};
+    std::chrono::nanoseconds last{0};
+  };
+  PresentCallTiming mPresentCallTiming;
+  // Set by setPresentSkippedLocked() during the current present.
+  bool mPresentSkipped = false;
+
+  // With sw_sync, presents run on a thread per display, so that
+  // SurfaceFlinger does not wait for one display's composition before it
+  // goes on to the next. present() returns fences on mPresentTimeline, which
+  // the present thread advances once the composer's retire and release
+  // fences have signaled. Without sw_sync, presents run on the caller's
+  // thread.
+  base::unique_fd mPresentTimeline;
+  // The last point handed out by present().
+  uint32_t mPresentTimelineValue = 0;
+  std::thread mPresentThread;
+  std::mutex mPresentMutex;
+  std::condition_variable mPresentCv;
+  bool mPresentQueued = false;
+  bool mPresentThreadExiting = false;
 };
 
 }  // namespace android
@@ -20,6 +20,9 @@
 #include <linux/netlink.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <utility>
+
 using android::base::guest::AutoReadLock;
 using android::base::guest::AutoWriteLock;
 using android::base::guest::ReadWriteLock;
@@ -126,6 +129,8 @@ bool DrmPresenter::initDrmElementsLocked() {
 
     drmModePlanePtr p = drmModeGetPlane(mFd.get(), planeRes->planes[i]);
     plane.mId = p->plane_id;
+    plane.mPossibleCrtcsMask = p->possible_crtcs;
+    plane.mFormats.assign(p->formats, p->formats + p->count_formats);
 
     ALOGD(
         "%s: plane id: %u crtcid %u fbid %u crtc xy %d %d xy %d %d "
@@ -163,9 +168,12 @@ bool DrmPresenter::initDrmElementsLocked() {
         plane.mSrcWPropertyId = planeProp->prop_id;
       } else if (!strcmp(planeProp->name, "SRC_H")) {
         plane.mSrcHPropertyId = planeProp->prop_id;
+      } else if (!strcmp(planeProp->name, "zpos")) {
+        plane.mZposPropertyId = planeProp->prop_id;
+        plane.mZpos = planeProps->prop_values[planePropIndex];
       } else if (!strcmp(planeProp->name, "type")) {
         plane.mTypePropertyId = planeProp->prop_id;
-        uint64_t type = planeProp->values[0];
+        uint64_t type = planeProps->prop_values[planePropIndex];
         switch (type) {
           case DRM_PLANE_TYPE_OVERLAY:
             plane.mType = type;
@@ -177,6 +185,11 @@ bool DrmPresenter::initDrmElementsLocked() {
             ALOGD("%s: plane %" PRIu32 " is DRM_PLANE_TYPE_PRIMARY",
                   __FUNCTION__, plane.mId);
             break;
+          case DRM_PLANE_TYPE_CURSOR:
+            plane.mType = type;
+            ALOGD("%s: plane %" PRIu32 " is DRM_PLANE_TYPE_CURSOR",
+                  __FUNCTION__, plane.mId);
+            break;
           default:
             break;
         }
@@ -292,11 +305,14 @@ void DrmPresenter::resetDrmElementsLocked() {
 }
 
 int DrmPresenter::getDrmFB(hwc_drm_bo_t& bo) {
-  int ret = drmPrimeFDToHandle(mFd.get(), bo.prime_fds[0], &bo.gem_handles[0]);
-  if (ret) {
-    ALOGE("%s: drmPrimeFDToHandle failed: %s (errno %d)", __FUNCTION__,
-          strerror(errno), errno);
-    return -1;
+  int ret = 0;
+  for (uint32_t i = 0; i < HWC_DRM_BO_MAX_PLANES && bo.pitches[i]; i++) {
+    ret = drmPrimeFDToHandle(mFd.get(), bo.prime_fds[i], &bo.gem_handles[i]);
+    if (ret) {
+      ALOGE("%s: drmPrimeFDToHandle failed: %s (errno %d)", __FUNCTION__,
+            strerror(errno), errno);
+      return -1;
+    }
   }
   ret = drmModeAddFB2(mFd.get(), bo.width, bo.height, bo.format, bo.gem_handles,
                       bo.pitches, bo.offsets, &bo.fb_id, 0);
@@ -317,9 +333,17 @@ int DrmPresenter::clearDrmFB(hwc_drm_bo_t& bo) {
     }
     ret = -1;
   }
-  if (bo.gem_handles[0]) {
+  for (uint32_t i = 0; i < HWC_DRM_BO_MAX_PLANES; i++) {
+    if (!bo.gem_handles[i]) {
+      continue;
+    }
+    // Planes that share a dma-buf share its gem handle.
+    if (std::find(bo.gem_handles, bo.gem_handles + i, bo.gem_handles[i]) !=
+        bo.gem_handles + i) {
+      continue;
+    }
     struct drm_gem_close gem_close = {};
-    gem_close.handle = bo.gem_handles[0];
+    gem_close.handle = bo.gem_handles[i];
     if (drmIoctl(mFd.get(), DRM_IOCTL_GEM_CLOSE, &gem_close)) {
       ALOGE("%s: DRM_IOCTL_GEM_CLOSE failed: %s (errno %d)", __FUNCTION__,
             strerror(errno), errno);
@@ -379,11 +403,124 @@ bool DrmPresenter::handleHotplug() {
 }
 
 std::tuple<HWC2::Error, base::unique_fd> DrmPresenter::flushToDisplay(
-    int display, hwc_drm_bo_t& bo, base::borrowed_fd inSyncFd) {
+    int display, hwc_drm_bo_t& bo, base::borrowed_fd inSyncFd,
+    const std::vector<DrmPlaneLayer>& planeLayers) {
   ATRACE_CALL();
 
   AutoReadLock lock(mStateMutex);
+  std::lock_guard<std::mutex> commitLock(mCommitMutex);
+  return commitLocked(display, bo, inSyncFd, planeLayers, /*testOnly=*/false);
+}
+
+bool DrmPresenter::testPlaneLayers(
+    int display, hwc_drm_bo_t& bo,
+    const std::vector<DrmPlaneLayer>& planeLayers) {
+  ATRACE_CALL();
+
+  AutoReadLock lock(mStateMutex);
+  std::lock_guard<std::mutex> commitLock(mCommitMutex);
+  auto [error, _] =
+      commitLocked(display, bo, -1, planeLayers, /*testOnly=*/true);
+  return error == HWC2::Error::None;
+}
 
+bool DrmPresenter::addPlaneLayersLocked(
+    drmModeAtomicReqPtr pset, uint32_t crtcIndex,
+    const std::vector<DrmPlaneLayer>& planeLayers,
+    std::vector<uint32_t>* outPlaneIds) {
+  const DrmCrtc& crtc = mCrtcs[crtcIndex];
+
+  // Planes this crtc can use above its primary plane, bottom to top.
+  const uint64_t primaryZpos = mPlanes[crtc.mPlaneId].mZpos;
+  std::vector<const DrmPlane*> freePlanes;
+  for (const auto& [planeId, plane] : mPlanes) {
+    if (planeId == crtc.mPlaneId || plane.mZpos < primaryZpos ||
+        !((0x1 << crtcIndex) & plane.mPossibleCrtcsMask)) {
+      continue;
+    }
+    bool isOverlayOrCursor = plane.mType == DRM_PLANE_TYPE_OVERLAY ||
+                             plane.mType == DRM_PLANE_TYPE_CURSOR;
+    bool isOtherCrtcsPlane = std::any_of(
+        mCrtcs.begin(), mCrtcs.end(), [&](const DrmCrtc& c) {
+          return c.mPlaneId == planeId ||
+                 (&c != &crtc &&
+                  std::find(c.mPlaneLayerPlaneIds.begin(),
+                            c.mPlaneLayerPlaneIds.end(),
+                            planeId) != c.mPlaneLayerPlaneIds.end());
+        });
+    if (isOverlayOrCursor && !isOtherCrtcsPlane) {
+      freePlanes.push_back(&plane);
+    }
+  }
+  std::stable_sort(freePlanes.begin(), freePlanes.end(),
+                   [](const DrmPlane* a, const DrmPlane* b) {
+                     return a->mZpos < b->mZpos;
+                   });
+
+  // Each layer takes the lowest remaining plane that supports its format so
+  // that planes stack in the same order as the layers.
+  auto planeIt = freePlanes.begin();
+  for (const DrmPlaneLayer& layer : planeLayers) {
+    const hwc_drm_bo_t& bo = layer.buffer->mBo;
+    planeIt = std::find_if(planeIt, freePlanes.end(), [&](const DrmPlane* p) {
+      return std::find(p->mFormats.begin(), p->mFormats.end(), bo.format) !=
+             p->mFormats.end();
+    });
+    if (planeIt == freePlanes.end()) {
+      return false;
+    }
+    const DrmPlane& plane = **planeIt;
+    ++planeIt;
+
+    const std::pair<uint32_t, uint64_t> properties[] = {
+        {plane.mCrtcPropertyId, crtc.mId},
+        {plane.mInFenceFdPropertyId, layer.inSyncFd.get()},
+        {plane.mFbPropertyId, bo.fb_id},
+        {plane.mCrtcXPropertyId, layer.displayFrame.left},
+        {plane.mCrtcYPropertyId, layer.displayFrame.top},
+        {plane.mCrtcWPropertyId,
+         layer.displayFrame.right - layer.displayFrame.left},
+        {plane.mCrtcHPropertyId,
+         layer.displayFrame.bottom - layer.displayFrame.top},
+        {plane.mSrcXPropertyId,
+         static_cast<uint64_t>(layer.sourceCrop.left) << 16},
+        {plane.mSrcYPropertyId,
+         static_cast<uint64_t>(layer.sourceCrop.top) << 16},
+        {plane.mSrcWPropertyId,
+         static_cast<uint64_t>(layer.sourceCrop.right - layer.sourceCrop.left)
+             << 16},
+        {plane.mSrcHPropertyId,
+         static_cast<uint64_t>(layer.sourceCrop.bottom - layer.sourceCrop.top)
+             << 16},
+    };
+    for (const auto& [propertyId, value] : properties) {
+      int ret = drmModeAtomicAddProperty(pset, plane.mId, propertyId, value);
+      if (ret < 0) {
+        ALOGE("%s:%d: failed %d errno %d\n", __FUNCTION__, __LINE__, ret,
+              errno);
+        return false;
+      }
+    }
+    outPlaneIds->push_back(plane.mId);
+  }
+
+  for (uint32_t planeId : crtc.mPlaneLayerPlaneIds) {
+    bool stillUsed = std::find(outPlaneIds->begin(), outPlaneIds->end(),
+                               planeId) != outPlaneIds->end();
+    if (stillUsed) {
+      continue;
+    }
+    const DrmPlane& plane = mPlanes[planeId];
+    drmModeAtomicAddProperty(pset, plane.mId, plane.mCrtcPropertyId, 0);
+    drmModeAtomicAddProperty(pset, plane.mId, plane.mFbPropertyId, 0);
+  }
+
+  return true;
+}
+
+std::tuple<HWC2::Error, base::unique_fd> DrmPresenter::commitLocked(
+    int display, hwc_drm_bo_t& bo, base::borrowed_fd inSyncFd,
+    const std::vector<DrmPlaneLayer>& planeLayers, bool testOnly) {
   DrmConnector& connector = mConnectors[display];
   DrmCrtc& crtc = mCrtcs[display];
 
@@ -410,20 +547,24 @@ std::tuple<HWC2::Error, base::unique_fd> DrmPresenter::flushToDisplay(
       ALOGE("%s:%d: failed %d errno %d\n", __FUNCTION__, __LINE__, ret, errno);
     }
 
-    crtc.mDidSetCrtc = true;
+    if (!testOnly) {
+      crtc.mDidSetCrtc = true;
+    }
   } else {
     DEBUG_LOG("%s: Already set crtc\n", __FUNCTION__);
   }
 
-  int rawOutSyncFd;
+  int rawOutSyncFd = -1;
   uint64_t outSyncFdUint =
       static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&rawOutSyncFd));
 
-  ret = drmModeAtomicAddProperty(pset, crtc.mId, crtc.mOutFencePtrPropertyId,
-                                 outSyncFdUint);
-  if (ret < 0) {
-    ALOGE("%s:%d: set OUT_FENCE_PTR failed %d errno %d\n", __FUNCTION__,
-          __LINE__, ret, errno);
+  if (!testOnly) {
+    ret = drmModeAtomicAddProperty(pset, crtc.mId,
+                                   crtc.mOutFencePtrPropertyId, outSyncFdUint);
+    if (ret < 0) {
+      ALOGE("%s:%d: set OUT_FENCE_PTR failed %d errno %d\n", __FUNCTION__,
+            __LINE__, ret, errno);
+    }
   }
 
   if (crtc.mPlaneId == -1) {
@@ -490,12 +631,25 @@ std::tuple<HWC2::Error, base::unique_fd> DrmPresenter::flushToDisplay(
     ALOGE("%s:%d: failed %d errno %d\n", __FUNCTION__, __LINE__, ret, errno);
   }
 
+  std::vector<uint32_t> planeLayerPlaneIds;
+  if (!addPlaneLayersLocked(pset, display, planeLayers, &planeLayerPlaneIds)) {
+    drmModeAtomicFree(pset);
+    return std::make_tuple(HWC2::Error::NoResources, base::unique_fd());
+  }
+
   uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+  if (testOnly) {
+    flags |= DRM_MODE_ATOMIC_TEST_ONLY;
+  }
   ret = drmModeAtomicCommit(mFd.get(), pset, flags, 0);
 
   if (ret) {
-    ALOGE("%s: Atomic commit failed with %d %d\n", __FUNCTION__, ret, errno);
+    if (!testOnly) {
+      ALOGE("%s: Atomic commit failed with %d %d\n", __FUNCTION__, ret, errno);
+    }
     error = HWC2::Error::NoResources;
+  } else if (!testOnly) {
+    crtc.mPlaneLayerPlaneIds = std::move(planeLayerPlaneIds);
   }
   base::unique_fd outSyncFd(rawOutSyncFd);
 
@@ -550,14 +704,27 @@ int DrmBuffer::convertBoInfo(const native_handle_t* handle) {
   mBo.hal_format = gr_handle->droid_format;
   mBo.format = gr_handle->format;
   mBo.usage = gr_handle->usage;
-  mBo.prime_fds[0] = gr_handle->fds[0];
-  mBo.pitches[0] = gr_handle->strides[0];
+  // Multi-planar (YUV) buffers are imported with all of their planes so that
+  // they can be scanned out on planes that support their format.
+  const uint32_t numPlanes =
+      std::min<uint32_t>(gr_handle->num_planes, HWC_DRM_BO_MAX_PLANES);
+  for (uint32_t i = 0; i < std::max<uint32_t>(numPlanes, 1); i++) {
+    mBo.prime_fds[i] = gr_handle->fds[i];
+    mBo.pitches[i] = gr_handle->strides[i];
+    mBo.offsets[i] = gr_handle->offsets[i];
+  }
   return 0;
 }
 
 std::tuple<HWC2::Error, base::unique_fd> DrmBuffer::flushToDisplay(
-    int display, base::borrowed_fd inWaitSyncFd) {
-  return mDrmPresenter.flushToDisplay(display, mBo, inWaitSyncFd);
+    int display, base::borrowed_fd inWaitSyncFd,
+    const std::vector<DrmPlaneLayer>& planeLayers) {
+  return mDrmPresenter.flushToDisplay(display, mBo, inWaitSyncFd, planeLayers);
+}
+
+bool DrmBuffer::testPlaneLayers(int display,
+                                const std::vector<DrmPlaneLayer>& planeLayers) {
+  return mDrmPresenter.testPlaneLayers(display, mBo, planeLayers);
 }
 
 DrmPresenter::DrmEventListener::DrmEventListener(DrmPresenter& presenter)
@@ -25,6 +25,7 @@
 #include <android-base/unique_fd.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <tuple>
 #include <vector>
 
@@ -37,6 +38,15 @@ namespace android {
 class DrmBuffer;
 class DrmPresenter;
 
+// A layer buffer that is scanned out directly on an overlay or cursor plane
+// above the display's primary plane.
+struct DrmPlaneLayer {
+  const DrmBuffer* buffer;
+  hwc_rect_t displayFrame;
+  hwc_rect_t sourceCrop;
+  base::borrowed_fd inSyncFd;
+};
+
 // A RAII object that will clear a drm framebuffer upon destruction.
 class DrmBuffer {
  public:
@@ -49,10 +59,20 @@ class DrmBuffer {
   DrmBuffer(DrmBuffer&&) = delete;
   DrmBuffer& operator=(DrmBuffer&&) = delete;
 
+  // See DrmPresenter::flushToDisplay() and DrmPresenter::testPlaneLayers().
   std::tuple<HWC2::Error, base::unique_fd> flushToDisplay(
-      int display, base::borrowed_fd inWaitSyncFd);
+      int display, base::borrowed_fd inWaitSyncFd,
+      const std::vector<DrmPlaneLayer>& planeLayers = {});
+  bool testPlaneLayers(int display,
+                       const std::vector<DrmPlaneLayer>& planeLayers);
+
+  // Returns false if the buffer could not be imported as a drm framebuffer.
+  bool hasFramebuffer() const { return mBo.fb_id != 0; }
 
  private:
+  // Grant visibility for mBo to DrmPresenter when scanning out plane layers.
+  friend class DrmPresenter;
+
   int convertBoInfo(const native_handle_t* handle);
 
   DrmPresenter& mDrmPresenter;
@@ -79,12 +99,24 @@ class DrmPresenter {
 
   uint32_t refreshRate() const { return mConnectors[0].mRefreshRateAsInteger; }
 
+  // Puts |fb| on the display's primary plane and |planeLayers|, ordered from
+  // bottom to top, on the planes above it.
   std::tuple<HWC2::Error, base::unique_fd> flushToDisplay(
-      int display, hwc_drm_bo_t& fb, base::borrowed_fd inWaitSyncFd);
+      int display, hwc_drm_bo_t& fb, base::borrowed_fd inWaitSyncFd,
+      const std::vector<DrmPlaneLayer>& planeLayers = {});
+
+  // Checks with a DRM_MODE_ATOMIC_TEST_ONLY commit whether flushToDisplay()
+  // would succeed with the given plane layers.
+  bool testPlaneLayers(int display, hwc_drm_bo_t& fb,
+                       const std::vector<DrmPlaneLayer>& planeLayers);
 
   std::optional<std::vector<uint8_t>> getEdid(uint32_t id);
 
  private:
+  std::tuple<HWC2::Error, base::unique_fd> commitLocked(
+      int display, hwc_drm_bo_t& fb, base::borrowed_fd inWaitSyncFd,
+      const std::vector<DrmPlaneLayer>& planeLayers, bool testOnly);
+
   // Grant visibility for getDrmFB and clearDrmFB to DrmBuffer.
   friend class DrmBuffer;
   int getDrmFB(hwc_drm_bo_t& bo);
@@ -104,6 +136,12 @@ class DrmPresenter {
   // Protects access to the below drm structs.
   android::base::guest::ReadWriteLock mStateMutex;
 
+  // Taken with the read lock of mStateMutex around commitLocked().
+  // addPlaneLayersLocked() picks free planes by reading the planes other
+  // crtcs hold, and a commit updates its crtc's, so plane assignment and
+  // commits are serialized across displays.
+  std::mutex mCommitMutex;
+
   struct DrmPlane {
     uint32_t mId = -1;
     uint32_t mCrtcPropertyId = -1;
@@ -119,15 +157,28 @@ class DrmPresenter {
     uint32_t mSrcHPropertyId = -1;
     uint32_t mTypePropertyId = -1;
     uint64_t mType = -1;
+    uint32_t mZposPropertyId = -1;
+    uint64_t mZpos = 0;
+    uint32_t mPossibleCrtcsMask = 0;
+    std::vector<uint32_t> mFormats;
   };
   std::map<uint32_t, DrmPlane> mPlanes;
 
+  // Picks planes for |planeLayers| and adds them to |pset|, disabling the
+  // planes used by the crtc's previous commit that are no longer needed.
+  // Returns false if the layers do not fit the crtc's free planes.
+  bool addPlaneLayersLocked(drmModeAtomicReqPtr pset, uint32_t crtcIndex,
+                            const std::vector<DrmPlaneLayer>& planeLayers,
+                            std::vector<uint32_t>* outPlaneIds);
+
   struct DrmCrtc {
     uint32_t mId = -1;
     uint32_t mActivePropertyId = -1;
     uint32_t mModePropertyId = -1;
     uint32_t mOutFencePtrPropertyId = -1;
     uint32_t mPlaneId = -1;
+    // Planes other than mPlaneId that the last commit scanned out layers on.
+    std::vector<uint32_t> mPlaneLayerPlaneIds;
 
     bool mDidSetCrtc = false;
   };
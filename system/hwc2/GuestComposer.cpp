@@ -28,6 +28,10 @@
 #include <ui/GraphicBufferAllocator.h>
 #include <ui/GraphicBufferMapper.h>
 
+#include <deque>
+#include <thread>
+#include <unordered_set>
+
 #include "Device.h"
 #include "Display.h"
 #include "Drm.h"
@@ -68,6 +72,137 @@ bool LayerNeedsAttenuation(const Layer& layer) {
   return layer.getBlendMode() == HWC2::BlendMode::Coverage;
 }
 
+// Beyond this many damaged rects the whole bounding box is recomposed, which
+// is cheaper than running the layer stack once per tiny rect.
+static constexpr const std::size_t kMaxDamagedRects = 8;
+
+bool IsEmptyRect(const hwc_rect_t& rect) {
+  return rect.right <= rect.left || rect.bottom <= rect.top;
+}
+
+bool SameRect(const hwc_rect_t& a, const hwc_rect_t& b) {
+  return a.left == b.left && a.top == b.top && a.right == b.right &&
+         a.bottom == b.bottom;
+}
+
+hwc_rect_t IntersectRects(const hwc_rect_t& a, const hwc_rect_t& b) {
+  return {
+      .left = std::max(a.left, b.left),
+      .top = std::max(a.top, b.top),
+      .right = std::min(a.right, b.right),
+      .bottom = std::min(a.bottom, b.bottom),
+  };
+}
+
+hwc_rect_t UnionRects(const hwc_rect_t& a, const hwc_rect_t& b) {
+  return {
+      .left = std::min(a.left, b.left),
+      .top = std::min(a.top, b.top),
+      .right = std::max(a.right, b.right),
+      .bottom = std::max(a.bottom, b.bottom),
+  };
+}
+
+bool RectContains(const hwc_rect_t& outer, const hwc_rect_t& inner) {
+  return outer.left <= inner.left && outer.top <= inner.top &&
+         outer.right >= inner.right && outer.bottom >= inner.bottom;
+}
+
+// Adds |rect|, clipped to |bounds|, to |rects| while keeping the rects
+// disjoint so that no pixel is composed twice.
+void AddDamagedRect(std::vector<hwc_rect_t>* rects, hwc_rect_t rect,
+                    const hwc_rect_t& bounds) {
+  rect = IntersectRects(rect, bounds);
+  if (IsEmptyRect(rect)) {
+    return;
+  }
+
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (auto it = rects->begin(); it != rects->end(); ++it) {
+      if (!IsEmptyRect(IntersectRects(*it, rect))) {
+        rect = UnionRects(*it, rect);
+        rects->erase(it);
+        merged = true;
+        break;
+      }
+    }
+  }
+  rects->push_back(rect);
+
+  if (rects->size() > kMaxDamagedRects) {
+    hwc_rect_t boundingRect = rects->front();
+    for (const hwc_rect_t& r : *rects) {
+      boundingRect = UnionRects(boundingRect, r);
+    }
+    rects->assign(1, boundingRect);
+  }
+}
+
+// Maps a damaged rect in the layer's buffer coordinates to the display.
+hwc_rect_t GetLayerDamageOnDisplay(const Layer& layer,
+                                   const hwc_rect_t& damage) {
+  const hwc_rect_t frame = layer.getDisplayFrame();
+  const hwc_rect_t crop = layer.getSourceCropInt();
+
+  if (layer.getTransform() != 0 || IsEmptyRect(crop)) {
+    return frame;
+  }
+
+  const hwc_rect_t src = IntersectRects(damage, crop);
+  if (IsEmptyRect(src)) {
+    return {0, 0, 0, 0};
+  }
+
+  const int64_t cropW = crop.right - crop.left;
+  const int64_t cropH = crop.bottom - crop.top;
+  const int64_t frameW = frame.right - frame.left;
+  const int64_t frameH = frame.bottom - frame.top;
+
+  hwc_rect_t dst = {
+      .left = frame.left +
+              static_cast<int>((src.left - crop.left) * frameW / cropW),
+      .top = frame.top +
+             static_cast<int>((src.top - crop.top) * frameH / cropH),
+      .right = frame.left + static_cast<int>(((src.right - crop.left) * frameW +
+                                              cropW - 1) /
+                                             cropW),
+      .bottom = frame.top + static_cast<int>(((src.bottom - crop.top) * frameH +
+                                              cropH - 1) /
+                                             cropH),
+  };
+
+  // Bilinear filtering reaches one source pixel past the damage.
+  if (LayerNeedsScaling(layer)) {
+    dst.left -= 1;
+    dst.top -= 1;
+    dst.right += 1;
+    dst.bottom += 1;
+  }
+
+  return IntersectRects(dst, frame);
+}
+
+bool SameColorTransform(const std::optional<ColorTransformWithMatrix>& a,
+                        const std::optional<ColorTransformWithMatrix>& b) {
+  if (!a || !b) {
+    return !a && !b;
+  }
+  return a->transformType == b->transformType &&
+         a->transformMatrixOpt == b->transformMatrixOpt;
+}
+
+DrmPlaneLayer MakeDrmPlaneLayer(const Layer& layer, const DrmBuffer* buffer,
+                                base::borrowed_fd inSyncFd) {
+  return DrmPlaneLayer{
+      .buffer = buffer,
+      .displayFrame = layer.getDisplayFrame(),
+      .sourceCrop = layer.getSourceCropInt(),
+      .inSyncFd = inSyncFd,
+  };
+}
+
 struct BufferSpec;
 typedef int (*ConverterFunction)(const BufferSpec& src, const BufferSpec& dst,
                                  bool v_flip);
@@ -396,8 +531,66 @@ std::optional<BufferSpec> GetBufferSpec(GrallocBuffer& buffer,
                     bufferStrideBytes, GetDrmFormatBytesPerPixel(bufferFormat));
 }
 
+// Returns true if the layer maps one to one onto its display frame so that
+// any part of it can be composed on its own. YUV buffers are excluded as their
+// subsampled chroma planes can not be clipped at odd offsets.
+bool CanClipLayer(const Layer& layer, uint32_t drmFormat) {
+  return !LayerNeedsScaling(layer) &&
+         GetRotationFromTransform(layer.getTransform()) == libyuv::kRotate0 &&
+         drmFormat != DRM_FORMAT_YVU420;
+}
+
+// Bands smaller than this are not worth handing to another thread.
+static constexpr const int64_t kMinCompositionBandPixels = 64 * 1024;
+
+static constexpr const unsigned kMaxCompositionBands = 8;
+
+// Rows of a layer carried through all of its composition operations at once
+// are sized to stay in the CPU's L2 cache.
+static constexpr const int kCompositionStripBytes = 64 * 1024;
+
+// Splits |rect| into at most |maxBands| horizontal bands of similar height.
+std::vector<hwc_rect_t> SplitIntoBands(const hwc_rect_t& rect,
+                                       std::size_t maxBands) {
+  const int width = rect.right - rect.left;
+  const int height = rect.bottom - rect.top;
+
+  const int64_t pixels = static_cast<int64_t>(width) * height;
+  const int numBands = static_cast<int>(
+      std::max<int64_t>(1, std::min<int64_t>({static_cast<int64_t>(maxBands),
+                                              pixels / kMinCompositionBandPixels,
+                                              height})));
+  const int bandHeight = (height + numBands - 1) / numBands;
+
+  std::vector<hwc_rect_t> bands;
+  for (int top = rect.top; top < rect.bottom; top += bandHeight) {
+    bands.push_back({rect.left, top, rect.right,
+                     std::min(top + bandHeight, rect.bottom)});
+  }
+  return bands;
+}
+
 }  // namespace
 
+// How a source buffer is drawn onto its display frame.
+struct GuestComposer::LayerComposition {
+  BufferSpec src;
+  hwc_rect_t displayFrame;
+  libyuv::RotationMode rotation;
+  bool needsScaling;
+  bool needsVFlip;
+  bool needsAttenuation;
+  bool needsBlending;
+};
+
+struct GuestComposer::LayerSource {
+  std::optional<GrallocBuffer> buffer;
+  std::optional<GrallocBufferView> bufferView;
+  // The converted, scaled and rotated layer when it can not be clipped.
+  std::vector<uint8_t> preparedBuffer;
+  std::optional<LayerComposition> composition;
+};
+
 HWC2::Error GuestComposer::init(const HotplugCallback& cb) {
   DEBUG_LOG("%s", __FUNCTION__);
 
@@ -406,9 +599,26 @@ HWC2::Error GuestComposer::init(const HotplugCallback& cb) {
     return HWC2::Error::NoResources;
   }
 
+  const unsigned numBands =
+      std::clamp(std::thread::hardware_concurrency(), 1u, kMaxCompositionBands);
+  mBandScratchBuffers.resize(numBands);
+  if (numBands > 1) {
+    mWorkPool = std::make_unique<android::base::guest::WorkPool>(numBands);
+  }
+
   return HWC2::Error::None;
 }
 
+GuestComposer::GuestComposerDisplayInfo* GuestComposer::findDisplayInfo(
+    hwc2_display_t displayId) {
+  std::lock_guard<std::mutex> lock(mDisplayInfosMutex);
+  auto it = mDisplayInfos.find(displayId);
+  if (it == mDisplayInfos.end()) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
 HWC2::Error GuestComposer::onDisplayCreate(Display* display) {
   hwc2_display_t displayId = display->getId();
   hwc2_config_t displayConfigId;
@@ -438,12 +648,16 @@ HWC2::Error GuestComposer::onDisplayCreate(Display* display) {
     return error;
   }
 
-  auto it = mDisplayInfos.find(displayId);
-  if (it != mDisplayInfos.end()) {
+  if (findDisplayInfo(displayId) != nullptr) {
     ALOGE("%s: display:%" PRIu64 " already created?", __FUNCTION__, displayId);
   }
 
-  GuestComposerDisplayInfo& displayInfo = mDisplayInfos[displayId];
+  GuestComposerDisplayInfo* displayInfoPtr;
+  {
+    std::lock_guard<std::mutex> lock(mDisplayInfosMutex);
+    displayInfoPtr = &mDisplayInfos[displayId];
+  }
+  GuestComposerDisplayInfo& displayInfo = *displayInfoPtr;
 
   uint32_t bufferStride;
   buffer_handle_t bufferHandle;
@@ -487,18 +701,17 @@ HWC2::Error GuestComposer::onDisplayCreate(Display* display) {
 HWC2::Error GuestComposer::onDisplayDestroy(Display* display) {
   auto displayId = display->getId();
 
-  auto it = mDisplayInfos.find(displayId);
-  if (it == mDisplayInfos.end()) {
+  GuestComposerDisplayInfo* displayInfo = findDisplayInfo(displayId);
+  if (displayInfo == nullptr) {
     ALOGE("%s: display:%" PRIu64 " missing display buffers?", __FUNCTION__,
           displayId);
     return HWC2::Error::BadDisplay;
   }
 
-  GuestComposerDisplayInfo& displayInfo = mDisplayInfos[displayId];
-
-  GraphicBufferAllocator::get().free(displayInfo.compositionResultBuffer);
+  GraphicBufferAllocator::get().free(displayInfo->compositionResultBuffer);
 
-  mDisplayInfos.erase(it);
+  std::lock_guard<std::mutex> lock(mDisplayInfosMutex);
+  mDisplayInfos.erase(displayId);
 
   return HWC2::Error::None;
 }
@@ -661,6 +874,30 @@ HWC2::Error GuestComposer::validateDisplay(
     }
   }
 
+  GuestComposerDisplayInfo* displayInfo = findDisplayInfo(displayId);
+  if (displayInfo != nullptr) {
+    displayInfo->planeLayers.clear();
+
+    // Drop the framebuffers of buffers that are no longer shown. The last
+    // commit's plane layers hold on to theirs until the next commit.
+    std::unordered_set<buffer_handle_t> layerBuffers;
+    for (Layer* layer : layers) {
+      layerBuffers.insert(layer->getBuffer().getBuffer());
+    }
+    for (auto it = displayInfo->planeLayerBuffers.begin();
+         it != displayInfo->planeLayerBuffers.end();) {
+      if (layerBuffers.count(it->first) == 0) {
+        it = displayInfo->planeLayerBuffers.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    if (!fallbackToClientComposition) {
+      assignPlaneLayers(display, displayInfo);
+    }
+  }
+
   return HWC2::Error::None;
 }
 
@@ -675,13 +912,13 @@ std::tuple<HWC2::Error, base::unique_fd> GuestComposer::presentDisplay(
     return std::make_tuple(HWC2::Error::None, base::unique_fd());
   }
 
-  auto it = mDisplayInfos.find(displayId);
-  if (it == mDisplayInfos.end()) {
+  GuestComposerDisplayInfo* displayInfoPtr = findDisplayInfo(displayId);
+  if (displayInfoPtr == nullptr) {
     ALOGE("%s: display:%" PRIu64 " not found", __FUNCTION__, displayId);
     return std::make_tuple(HWC2::Error::NoResources, base::unique_fd());
   }
 
-  GuestComposerDisplayInfo& displayInfo = it->second;
+  GuestComposerDisplayInfo& displayInfo = *displayInfoPtr;
 
   if (displayInfo.compositionResultBuffer == nullptr) {
     ALOGE("%s: display:%" PRIu64 " missing composition result buffer",
@@ -753,6 +990,22 @@ std::tuple<HWC2::Error, base::unique_fd> GuestComposer::presentDisplay(
         return layer->getCompositionType() == HWC2::Composition::Client;
       });
 
+  std::vector<hwc_rect_t> damagedRects;
+  if (!noOpComposition) {
+    damagedRects = getDamagedRects(display, displayInfo,            //
+                                   compositionResultBufferWidth,   //
+                                   compositionResultBufferHeight,  //
+                                   allLayersClientComposed);
+    // Until this composition completes the result buffer is in an unknown
+    // state.
+    displayInfo.previousCompositionValid = false;
+
+    DEBUG_LOG("%s display:%" PRIu64 " recomposing %zu damaged rects",
+              __FUNCTION__, displayId, damagedRects.size());
+  }
+
+  std::unique_lock<std::mutex> compositionLock(mCompositionMutex);
+
   if (noOpComposition) {
     ALOGW("%s: display:%" PRIu64 " empty composition", __FUNCTION__, displayId);
   } else if (allLayersClientComposed) {
@@ -783,8 +1036,8 @@ std::tuple<HWC2::Error, base::unique_fd> GuestComposer::presentDisplay(
       return std::make_tuple(HWC2::Error::NoResources, base::unique_fd());
     }
 
-    std::size_t clientTargetPlaneSize =
-        clientTargetPlaneLayouts[0].totalSizeInBytes;
+    std::size_t clientTargetStride =
+        clientTargetPlaneLayouts[0].strideInBytes;
 
     auto clientTargetDataOpt = clientTargetBufferView.Get();
     if (!clientTargetDataOpt) {
@@ -793,57 +1046,156 @@ std::tuple<HWC2::Error, base::unique_fd> GuestComposer::presentDisplay(
     }
     auto* clientTargetData = reinterpret_cast<uint8_t*>(*clientTargetDataOpt);
 
-    std::memcpy(compositionResultBufferData, clientTargetData,
-                clientTargetPlaneSize);
+    for (const hwc_rect_t& rect : damagedRects) {
+      const std::size_t rowBytes = (rect.right - rect.left) * 4;
+      for (int y = rect.top; y < rect.bottom; y++) {
+        std::memcpy(compositionResultBufferData +
+                        y * compositionResultBufferStride + rect.left * 4,
+                    clientTargetData + y * clientTargetStride + rect.left * 4,
+                    rowBytes);
+      }
+    }
   } else {
+    const std::optional<ColorTransformWithMatrix> colorTransform =
+        display->hasColorTransform()
+            ? std::make_optional(display->getColorTransform())
+            : std::nullopt;
+
+    // Lock each layer that overlaps the damage once. The damaged rects are
+    // then split into horizontal bands that are composed concurrently.
+    std::deque<LayerSource> sources;
+    std::vector<const LayerSource*> sourcePtrs;
     for (Layer* layer : layers) {
       const auto layerId = layer->getId();
       const auto layerCompositionType = layer->getCompositionType();
-      if (layerCompositionType != HWC2::Composition::Device) {
+      if (layerCompositionType != HWC2::Composition::Device ||
+          displayInfo.isPlaneLayer(layerId)) {
+        continue;
+      }
+
+      const hwc_rect_t frame = layer->getDisplayFrame();
+      const bool damaged = std::any_of(
+          damagedRects.begin(), damagedRects.end(),
+          [&](const hwc_rect_t& rect) {
+            return !IsEmptyRect(IntersectRects(rect, frame));
+          });
+      if (!damaged) {
         continue;
       }
 
-      HWC2::Error error = composeLayerInto(layer,                          //
-                                           compositionResultBufferData,    //
-                                           compositionResultBufferWidth,   //
-                                           compositionResultBufferHeight,  //
-                                           compositionResultBufferStride,  //
-                                           4);
+      LayerSource& source = sources.emplace_back();
+      HWC2::Error error = prepareLayerSource(layer, &source);
       if (error != HWC2::Error::None) {
         ALOGE("%s: display:%" PRIu64 " failed to compose layer:%" PRIu64,
               __FUNCTION__, displayId, layerId);
         return std::make_tuple(error, base::unique_fd());
       }
+      sourcePtrs.push_back(&source);
+    }
+
+    for (const hwc_rect_t& rect : damagedRects) {
+      const std::vector<hwc_rect_t> bands =
+          SplitIntoBands(rect, mBandScratchBuffers.size());
+      std::vector<HWC2::Error> bandErrors(bands.size(), HWC2::Error::None);
+
+      auto composeBandAt = [&](std::size_t i) {
+        bandErrors[i] = composeBand(sourcePtrs, bands[i],           //
+                                    compositionResultBufferData,    //
+                                    compositionResultBufferWidth,   //
+                                    compositionResultBufferHeight,  //
+                                    compositionResultBufferStride,  //
+                                    colorTransform,                 //
+                                    &mBandScratchBuffers[i]);
+      };
+
+      if (bands.size() == 1) {
+        composeBandAt(0);
+      } else {
+        std::vector<android::base::guest::WorkPool::Task> tasks;
+        for (std::size_t i = 0; i < bands.size(); i++) {
+          tasks.push_back([&composeBandAt, i]() { composeBandAt(i); });
+        }
+        mWorkPool->waitAll(mWorkPool->schedule(tasks));
+      }
+
+      for (HWC2::Error error : bandErrors) {
+        if (error != HWC2::Error::None) {
+          ALOGE("%s: display:%" PRIu64 " failed to compose damaged rect",
+                __FUNCTION__, displayId);
+          return std::make_tuple(error, base::unique_fd());
+        }
+      }
     }
   }
 
-  if (display->hasColorTransform()) {
+  if (allLayersClientComposed && display->hasColorTransform()) {
     const ColorTransformWithMatrix colorTransform =
         display->getColorTransform();
 
-    HWC2::Error error =
-        applyColorTransformToRGBA(colorTransform,                 //
-                                  compositionResultBufferData,    //
-                                  compositionResultBufferWidth,   //
-                                  compositionResultBufferHeight,  //
-                                  compositionResultBufferStride);
-    if (error != HWC2::Error::None) {
-      ALOGE("%s: display:%" PRIu64 " failed to apply color transform",
-            __FUNCTION__, displayId);
-      return std::make_tuple(error, base::unique_fd());
+    // Pixels outside of the damage were already transformed when they were
+    // composed.
+    for (const hwc_rect_t& rect : damagedRects) {
+      HWC2::Error error = applyColorTransformToRGBA(
+          colorTransform,                                      //
+          compositionResultBufferData +                        //
+              rect.top * compositionResultBufferStride +       //
+              rect.left * 4,                                   //
+          rect.right - rect.left,                              //
+          rect.bottom - rect.top,                              //
+          compositionResultBufferStride);
+      if (error != HWC2::Error::None) {
+        ALOGE("%s: display:%" PRIu64 " failed to apply color transform",
+              __FUNCTION__, displayId);
+        return std::make_tuple(error, base::unique_fd());
+      }
     }
   }
 
-  DEBUG_LOG("%s display:%" PRIu64 " flushing drm buffer", __FUNCTION__,
-            displayId);
+  compositionLock.unlock();
+
+  if (!noOpComposition) {
+    saveCompositionState(display, &displayInfo, allLayersClientComposed);
+  }
+
+  DEBUG_LOG("%s display:%" PRIu64 " flushing drm buffer, %zu plane layers",
+            __FUNCTION__, displayId, displayInfo.planeLayers.size());
+
+  // The planes wait on the layers' acquire fences instead of the composer.
+  std::vector<base::unique_fd> planeLayerFences;
+  planeLayerFences.reserve(displayInfo.planeLayers.size());
+  std::vector<DrmPlaneLayer> drmPlaneLayers;
+  for (const PlaneLayer& planeLayer : displayInfo.planeLayers) {
+    Layer* layer = display->getLayer(planeLayer.id);
+    if (layer == nullptr) {
+      continue;
+    }
+    planeLayerFences.push_back(layer->getBuffer().getFence());
+    drmPlaneLayers.push_back(MakeDrmPlaneLayer(
+        *layer, planeLayer.buffer.get(), planeLayerFences.back()));
+  }
 
   auto [error, outRetireFence] =
       displayInfo.compositionResultDrmBuffer->flushToDisplay(
-          static_cast<int>(displayId), -1);
+          static_cast<int>(displayId), -1, drmPlaneLayers);
   if (error != HWC2::Error::None) {
     ALOGE("%s: display:%" PRIu64 " failed to flush drm buffer" PRIu64,
           __FUNCTION__, displayId);
+    displayInfo.planeLayers.clear();
+    return std::make_tuple(error, std::move(outRetireFence));
+  }
+
+  // The buffers of the previous commit's plane layers stay on screen until
+  // this commit lands.
+  display->clearReleaseFencesAndIdsLocked();
+  for (const PlaneLayer& planeLayer : displayInfo.scannedOutPlaneLayers) {
+    if (display->getLayer(planeLayer.id) != nullptr) {
+      display->addReleaseFenceLocked(
+          planeLayer.id, base::unique_fd(dup(outRetireFence.get())));
+    }
   }
+  displayInfo.scannedOutPlaneLayers = std::move(displayInfo.planeLayers);
+  displayInfo.planeLayers.clear();
+
   return std::make_tuple(error, std::move(outRetireFence));
 }
 
@@ -875,48 +1227,430 @@ bool GuestComposer::canComposeLayer(Layer* layer) {
   return true;
 }
 
-HWC2::Error GuestComposer::composeLayerInto(
-    Layer* srcLayer, std::uint8_t* dstBuffer, std::uint32_t dstBufferWidth,
-    std::uint32_t dstBufferHeight, std::uint32_t dstBufferStrideBytes,
-    std::uint32_t dstBufferBytesPerPixel) {
-  ATRACE_CALL();
+bool GuestComposer::canScanOutLayer(Layer* layer, std::uint32_t displayWidth,
+                                    std::uint32_t displayHeight) {
+  if (layer->getCompositionType() != HWC2::Composition::Device ||
+      layer->getTransform() != 0) {
+    return false;
+  }
 
-  libyuv::RotationMode rotation =
-      GetRotationFromTransform(srcLayer->getTransform());
+  const hwc_rect_t frame = layer->getDisplayFrame();
+  const hwc_rect_t crop = layer->getSourceCropInt();
+  if (IsEmptyRect(frame) || IsEmptyRect(crop) || frame.left < 0 ||
+      frame.top < 0 || frame.right > static_cast<int>(displayWidth) ||
+      frame.bottom > static_cast<int>(displayHeight)) {
+    return false;
+  }
+
+  buffer_handle_t bufferHandle = layer->getBuffer().getBuffer();
+  if (bufferHandle == nullptr) {
+    return false;
+  }
 
-  auto srcBufferOpt = mGralloc.Import(srcLayer->waitAndGetBuffer());
-  if (!srcBufferOpt) {
+  auto bufferOpt = mGralloc.Import(bufferHandle);
+  if (!bufferOpt) {
+    return false;
+  }
+
+  auto bufferFormatOpt = bufferOpt->GetDrmFormat();
+  if (!bufferFormatOpt) {
+    return false;
+  }
+
+  // Planes blend with premultiplied alpha, so a layer that ignores its alpha
+  // must not have any.
+  switch (layer->getBlendMode()) {
+    case HWC2::BlendMode::Premultiplied:
+      return true;
+    case HWC2::BlendMode::None:
+      return *bufferFormatOpt == DRM_FORMAT_XBGR8888 ||
+             *bufferFormatOpt == DRM_FORMAT_RGB565 ||
+             *bufferFormatOpt == DRM_FORMAT_YVU420;
+    default:
+      return false;
+  }
+}
+
+std::shared_ptr<DrmBuffer> GuestComposer::getPlaneLayerBuffer(
+    GuestComposerDisplayInfo* displayInfo, Layer* layer) {
+  buffer_handle_t bufferHandle = layer->getBuffer().getBuffer();
+  std::shared_ptr<DrmBuffer>& buffer =
+      displayInfo->planeLayerBuffers[bufferHandle];
+  if (!buffer) {
+    buffer = std::make_shared<DrmBuffer>(bufferHandle, mDrmPresenter);
+  }
+  return buffer;
+}
+
+void GuestComposer::assignPlaneLayers(Display* display,
+                                      GuestComposerDisplayInfo* displayInfo) {
+  if (mPresentDisabled || display->hasColorTransform() ||
+      !displayInfo->compositionResultDrmBuffer) {
+    return;
+  }
+
+  auto compositionResultBufferOpt =
+      mGralloc.Import(displayInfo->compositionResultBuffer);
+  if (!compositionResultBufferOpt) {
+    return;
+  }
+  auto displayWidthOpt = compositionResultBufferOpt->GetWidth();
+  auto displayHeightOpt = compositionResultBufferOpt->GetHeight();
+  if (!displayWidthOpt || !displayHeightOpt) {
+    return;
+  }
+
+  // Planes stack above the composition result, so only a run of layers from
+  // the top of the stack can be moved onto them.
+  const std::vector<Layer*>& layers = display->getOrderedLayers();
+  std::vector<PlaneLayer> candidates;
+  for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
+    Layer* layer = *it;
+    if (!canScanOutLayer(layer, *displayWidthOpt, *displayHeightOpt)) {
+      break;
+    }
+    std::shared_ptr<DrmBuffer> buffer = getPlaneLayerBuffer(displayInfo, layer);
+    if (!buffer->hasFramebuffer()) {
+      break;
+    }
+    candidates.push_back(PlaneLayer{
+        .id = layer->getId(),
+        .buffer = std::move(buffer),
+    });
+  }
+  std::reverse(candidates.begin(), candidates.end());
+
+  // Drop layers from the bottom of the run until the planes accept the rest.
+  while (!candidates.empty()) {
+    std::vector<DrmPlaneLayer> drmPlaneLayers;
+    for (const PlaneLayer& candidate : candidates) {
+      drmPlaneLayers.push_back(MakeDrmPlaneLayer(
+          *display->getLayer(candidate.id), candidate.buffer.get(), -1));
+    }
+    if (displayInfo->compositionResultDrmBuffer->testPlaneLayers(
+            static_cast<int>(display->getId()), drmPlaneLayers)) {
+      DEBUG_LOG("%s display:%" PRIu64 " scanning out %zu layers on planes",
+                __FUNCTION__, display->getId(), candidates.size());
+      displayInfo->planeLayers = std::move(candidates);
+      return;
+    }
+    candidates.erase(candidates.begin());
+  }
+}
+
+std::vector<hwc_rect_t> GuestComposer::getDamagedRects(
+    Display* display, const GuestComposerDisplayInfo& displayInfo,
+    std::uint32_t width, std::uint32_t height, bool clientComposed) {
+  const hwc_rect_t bounds = {0, 0, static_cast<int>(width),
+                             static_cast<int>(height)};
+
+  const std::optional<ColorTransformWithMatrix> colorTransform =
+      display->hasColorTransform()
+          ? std::make_optional(display->getColorTransform())
+          : std::nullopt;
+
+  if (!displayInfo.previousCompositionValid ||
+      displayInfo.previousClientComposed != clientComposed ||
+      !SameColorTransform(displayInfo.previousColorTransform, colorTransform)) {
+    return {bounds};
+  }
+
+  std::vector<hwc_rect_t> rects;
+
+  if (clientComposed) {
+    const std::vector<hwc_rect_t>& damage = display->getClientTargetDamage();
+    if (damage.empty()) {
+      return {bounds};
+    }
+    for (const hwc_rect_t& rect : damage) {
+      AddDamagedRect(&rects, rect, bounds);
+    }
+    return rects;
+  }
+
+  // Layers scanned out on planes are not part of the composition result.
+  std::vector<Layer*> deviceLayers;
+  for (Layer* layer : display->getOrderedLayers()) {
+    if (layer->getCompositionType() == HWC2::Composition::Device &&
+        !displayInfo.isPlaneLayer(layer->getId())) {
+      deviceLayers.push_back(layer);
+    }
+  }
+
+  for (Layer* layer : deviceLayers) {
+    const hwc_rect_t frame = layer->getDisplayFrame();
+
+    auto previousIt = std::find_if(
+        displayInfo.previousLayers.begin(), displayInfo.previousLayers.end(),
+        [&](const ComposedLayerInfo& info) {
+          return info.id == layer->getId();
+        });
+    if (previousIt == displayInfo.previousLayers.end()) {
+      AddDamagedRect(&rects, frame, bounds);
+      continue;
+    }
+
+    const ComposedLayerInfo& previous = *previousIt;
+    if (!SameRect(previous.displayFrame, frame) ||
+        !SameRect(previous.sourceCrop, layer->getSourceCropInt()) ||
+        previous.transform != layer->getTransform() ||
+        previous.blendMode != layer->getBlendMode() ||
+        previous.z != layer->getZ()) {
+      AddDamagedRect(&rects, previous.displayFrame, bounds);
+      AddDamagedRect(&rects, frame, bounds);
+      continue;
+    }
+
+    const std::vector<hwc_rect_t>& damage = layer->getSurfaceDamage();
+    if (damage.empty()) {
+      AddDamagedRect(&rects, frame, bounds);
+      continue;
+    }
+    for (const hwc_rect_t& rect : damage) {
+      if (!IsEmptyRect(rect)) {
+        AddDamagedRect(&rects, GetLayerDamageOnDisplay(*layer, rect), bounds);
+      }
+    }
+  }
+
+  for (const ComposedLayerInfo& previous : displayInfo.previousLayers) {
+    bool stillPresent = std::any_of(
+        deviceLayers.begin(), deviceLayers.end(),
+        [&](const Layer* layer) { return layer->getId() == previous.id; });
+    if (!stillPresent) {
+      AddDamagedRect(&rects, previous.displayFrame, bounds);
+    }
+  }
+
+  return rects;
+}
+
+void GuestComposer::saveCompositionState(Display* display,
+                                         GuestComposerDisplayInfo* displayInfo,
+                                         bool clientComposed) {
+  displayInfo->previousCompositionValid = true;
+  displayInfo->previousClientComposed = clientComposed;
+  displayInfo->previousColorTransform =
+      display->hasColorTransform()
+          ? std::make_optional(display->getColorTransform())
+          : std::nullopt;
+
+  displayInfo->previousLayers.clear();
+  for (Layer* layer : display->getOrderedLayers()) {
+    if (layer->getCompositionType() != HWC2::Composition::Device ||
+        displayInfo->isPlaneLayer(layer->getId())) {
+      continue;
+    }
+    displayInfo->previousLayers.push_back(ComposedLayerInfo{
+        .id = layer->getId(),
+        .displayFrame = layer->getDisplayFrame(),
+        .sourceCrop = layer->getSourceCropInt(),
+        .transform = layer->getTransform(),
+        .blendMode = layer->getBlendMode(),
+        .z = layer->getZ(),
+    });
+  }
+}
+
+HWC2::Error GuestComposer::prepareLayerSource(Layer* layer,
+                                              LayerSource* source) {
+  ATRACE_CALL();
+
+  source->buffer = mGralloc.Import(layer->waitAndGetBuffer());
+  if (!source->buffer) {
     ALOGE("%s: failed to import layer buffer.", __FUNCTION__);
     return HWC2::Error::NoResources;
   }
-  GrallocBuffer& srcBuffer = *srcBufferOpt;
 
-  auto srcBufferViewOpt = srcBuffer.Lock();
-  if (!srcBufferViewOpt) {
+  source->bufferView = source->buffer->Lock();
+  if (!source->bufferView) {
     ALOGE("%s: failed to lock import layer buffer.", __FUNCTION__);
     return HWC2::Error::NoResources;
   }
-  GrallocBufferView& srcBufferView = *srcBufferViewOpt;
-
-  hwc_rect_t srcLayerCrop = srcLayer->getSourceCropInt();
-  hwc_rect_t srcLayerDisplayFrame = srcLayer->getDisplayFrame();
 
-  auto srcLayerSpecOpt = GetBufferSpec(srcBuffer, srcBufferView, srcLayerCrop);
+  auto srcLayerSpecOpt = GetBufferSpec(*source->buffer, *source->bufferView,
+                                       layer->getSourceCropInt());
   if (!srcLayerSpecOpt) {
     return HWC2::Error::NoResources;
   }
-  BufferSpec srcLayerSpec = *srcLayerSpecOpt;
+
+  const hwc_transform_t transform = layer->getTransform();
+  LayerComposition composition = {
+      .src = *srcLayerSpecOpt,
+      .displayFrame = layer->getDisplayFrame(),
+      .rotation = GetRotationFromTransform(transform),
+      .needsScaling = LayerNeedsScaling(*layer),
+      .needsVFlip = GetVFlipFromTransform(transform),
+      .needsAttenuation = LayerNeedsAttenuation(*layer),
+      .needsBlending = LayerNeedsBlending(*layer),
+  };
+
+  const hwc_rect_t frame = composition.displayFrame;
+  if (CanClipLayer(*layer, composition.src.drmFormat) || IsEmptyRect(frame)) {
+    source->composition = composition;
+    return HWC2::Error::None;
+  }
+
+  // Convert, scale and rotate the whole layer once so that only the per pixel
+  // attenuation and blending are left to do band by band.
+  const int width = frame.right - frame.left;
+  const int height = frame.bottom - frame.top;
+  const int strideBytes = AlignToPower2(width * 4, 4);
+  source->preparedBuffer.resize(strideBytes * height);
+
+  LayerComposition whole = composition;
+  whole.displayFrame = {0, 0, width, height};
+  whole.needsAttenuation = false;
+  whole.needsBlending = false;
+
+  HWC2::Error error =
+      composeInto(whole, source->preparedBuffer.data(), width, height,
+                  strideBytes, 4, whole.displayFrame, &mScratchBuffers);
+  if (error != HWC2::Error::None) {
+    return error;
+  }
+
+  composition.src =
+      BufferSpec(source->preparedBuffer.data(), width, height, strideBytes);
+  composition.src.drmFormat = DRM_FORMAT_XBGR8888;
+  composition.rotation = libyuv::kRotate0;
+  composition.needsScaling = false;
+  composition.needsVFlip = false;
+  source->composition = composition;
+  return HWC2::Error::None;
+}
+
+HWC2::Error GuestComposer::composeBand(
+    const std::vector<const LayerSource*>& sources, const hwc_rect_t& band,
+    std::uint8_t* dstBuffer, std::uint32_t dstBufferWidth,
+    std::uint32_t dstBufferHeight, std::uint32_t dstBufferStrideBytes,
+    const std::optional<ColorTransformWithMatrix>& colorTransform,
+    ScratchBuffers* scratch) {
+  ATRACE_CALL();
+
+  // Uncovered parts of the display are transparent black.
+  const std::size_t rowBytes = (band.right - band.left) * 4;
+  for (int y = band.top; y < band.bottom; y++) {
+    std::memset(dstBuffer + y * dstBufferStrideBytes + band.left * 4, 0,
+                rowBytes);
+  }
+
+  for (const LayerSource* source : sources) {
+    HWC2::Error error =
+        composeInto(*source->composition, dstBuffer, dstBufferWidth,
+                    dstBufferHeight, dstBufferStrideBytes, 4, band, scratch);
+    if (error != HWC2::Error::None) {
+      return error;
+    }
+  }
+
+  if (colorTransform) {
+    return applyColorTransformToRGBA(
+        *colorTransform,                                               //
+        dstBuffer + band.top * dstBufferStrideBytes + band.left * 4,  //
+        band.right - band.left,                                        //
+        band.bottom - band.top,                                        //
+        dstBufferStrideBytes);
+  }
+
+  return HWC2::Error::None;
+}
+
+HWC2::Error GuestComposer::composeInto(const LayerComposition& composition,
+                                       std::uint8_t* dstBuffer,
+                                       std::uint32_t dstBufferWidth,
+                                       std::uint32_t dstBufferHeight,
+                                       std::uint32_t dstBufferStrideBytes,
+                                       std::uint32_t dstBufferBytesPerPixel,
+                                       const hwc_rect_t& dstClip,
+                                       ScratchBuffers* scratch) {
+  ATRACE_CALL();
+
+  BufferSpec srcLayerSpec = composition.src;
+  hwc_rect_t srcLayerDisplayFrame = composition.displayFrame;
+  libyuv::RotationMode rotation = composition.rotation;
+
+  const hwc_rect_t clippedFrame = IntersectRects(srcLayerDisplayFrame, dstClip);
+  if (IsEmptyRect(clippedFrame)) {
+    return HWC2::Error::None;
+  }
+
+  if (!RectContains(dstClip, srcLayerDisplayFrame)) {
+    if (composition.needsScaling || rotation != libyuv::kRotate0) {
+      ALOGE("%s: can not clip a scaled or rotated layer", __FUNCTION__);
+      return HWC2::Error::BadLayer;
+    }
+
+    // Without scaling or rotation the clipped display frame maps one to one
+    // onto the source crop, vertically mirrored when flipped.
+    srcLayerSpec.cropX += clippedFrame.left - srcLayerDisplayFrame.left;
+    srcLayerSpec.cropWidth = clippedFrame.right - clippedFrame.left;
+    if (composition.needsVFlip) {
+      srcLayerSpec.cropY += srcLayerDisplayFrame.bottom - clippedFrame.bottom;
+    } else {
+      srcLayerSpec.cropY += clippedFrame.top - srcLayerDisplayFrame.top;
+    }
+    srcLayerSpec.cropHeight = clippedFrame.bottom - clippedFrame.top;
+
+    srcLayerDisplayFrame = clippedFrame;
+  }
 
   // TODO(jemoreira): Remove the hardcoded fomat.
-  bool needsConversion = srcLayerSpec.drmFormat != DRM_FORMAT_XBGR8888;
-  bool needsScaling = LayerNeedsScaling(*srcLayer);
+  // ABGR8888 has the destination's layout, so any other step can read it
+  // directly and a plain copy is only needed when there is no other step.
+  bool needsConversion = srcLayerSpec.drmFormat != DRM_FORMAT_XBGR8888 &&
+                         srcLayerSpec.drmFormat != DRM_FORMAT_ABGR8888;
+  bool needsScaling = composition.needsScaling;
   bool needsRotation = rotation != libyuv::kRotate0;
   bool needsTranspose = needsRotation && rotation != libyuv::kRotate180;
-  bool needsVFlip = GetVFlipFromTransform(srcLayer->getTransform());
-  bool needsAttenuation = LayerNeedsAttenuation(*srcLayer);
-  bool needsBlending = LayerNeedsBlending(*srcLayer);
+  bool needsVFlip = composition.needsVFlip;
+  bool needsAttenuation = composition.needsAttenuation;
+  bool needsBlending = composition.needsBlending;
+  // Vertical flip is not an operation of its own, it is done by whichever
+  // operation runs first.
   bool needsCopy = !(needsConversion || needsScaling || needsRotation ||
-                     needsVFlip || needsAttenuation || needsBlending);
+                     needsAttenuation || needsBlending);
+
+  // Without scaling or rotation every remaining operation works row by row.
+  // When several are needed, run them one strip of rows at a time so that
+  // each intermediate result is still in cache when the next operation reads
+  // it, instead of making a full pass over the frame per operation.
+  const int numOperations = (needsConversion ? 1 : 0) +
+                            (needsAttenuation ? 1 : 0) +
+                            (needsBlending ? 1 : 0) + (needsCopy ? 1 : 0);
+  const int frameWidth = srcLayerDisplayFrame.right - srcLayerDisplayFrame.left;
+  const int frameHeight =
+      srcLayerDisplayFrame.bottom - srcLayerDisplayFrame.top;
+  int stripRows = std::max<int>(
+      1, kCompositionStripBytes / (frameWidth * dstBufferBytesPerPixel));
+  // Chroma of YUV sources covers two rows, so a strip must start an even
+  // number of rows into the source crop for the conversion to sample it
+  // where it belongs. Strips map to the source bottom up when flipped, so
+  // then the odd row, if any, goes to the first strip.
+  const bool subsampled = needsConversion && srcLayerSpec.buffer_ycbcr;
+  if (subsampled) {
+    stripRows = std::max(2, stripRows & ~1);
+  }
+  if (!needsScaling && !needsRotation && numOperations > 1 &&
+      frameHeight > stripRows) {
+    int rows = stripRows;
+    if (subsampled && needsVFlip) {
+      rows = (frameHeight - 1) % stripRows + 1;
+    }
+    for (int top = srcLayerDisplayFrame.top; top < srcLayerDisplayFrame.bottom;
+         top += rows, rows = stripRows) {
+      const hwc_rect_t strip = {
+          srcLayerDisplayFrame.left, top, srcLayerDisplayFrame.right,
+          std::min(top + rows, srcLayerDisplayFrame.bottom)};
+      HWC2::Error error = composeInto(composition, dstBuffer, dstBufferWidth,
+                                      dstBufferHeight, dstBufferStrideBytes,
+                                      dstBufferBytesPerPixel, strip, scratch);
+      if (error != HWC2::Error::None) {
+        return error;
+      }
+    }
+    return HWC2::Error::None;
+  }
 
   BufferSpec dstLayerSpec(
       dstBuffer,
@@ -952,7 +1686,7 @@ HWC2::Error GuestComposer::composeLayerInto(
 
   for (int i = 0; i < neededScratchBuffers; i++) {
     BufferSpec mScratchBufferspec(
-        getRotatingScratchBuffer(mScratchBufferSizeBytes, i),
+        scratch->getRotatingScratchBuffer(mScratchBufferSizeBytes, i),
         mScratchBufferWidth, mScratchBufferHeight, mScratchBufferStrideBytes);
     dstBufferStack.push_back(mScratchBufferspec);
   }
@@ -987,7 +1721,7 @@ HWC2::Error GuestComposer::composeLayerInto(
 
       // In case of a scale, the source frame may be bigger than the default tmp
       // buffer size
-      dstBufferSpec.buffer = getSpecialScratchBuffer(needed_size);
+      dstBufferSpec.buffer = scratch->getSpecialScratchBuffer(needed_size);
     }
 
     int retval = DoConversion(srcLayerSpec, dstBufferSpec, needsVFlip);
@@ -1142,8 +1876,8 @@ HWC2::Error GuestComposer::applyColorTransformToRGBA(
   return HWC2::Error::None;
 }
 
-uint8_t* GuestComposer::getRotatingScratchBuffer(std::size_t neededSize,
-                                                 std::uint32_t order) {
+uint8_t* GuestComposer::ScratchBuffers::getRotatingScratchBuffer(
+    std::size_t neededSize, std::uint32_t order) {
   static constexpr const int kNumScratchBufferPieces = 2;
 
   std::size_t totalNeededSize = neededSize * kNumScratchBufferPieces;
@@ -1156,7 +1890,8 @@ uint8_t* GuestComposer::getRotatingScratchBuffer(std::size_t neededSize,
   return &mScratchBuffer[bufferOffset];
 }
 
-uint8_t* GuestComposer::getSpecialScratchBuffer(size_t neededSize) {
+uint8_t* GuestComposer::ScratchBuffers::getSpecialScratchBuffer(
+    std::size_t neededSize) {
   if (mSpecialScratchBuffer.size() < neededSize) {
     mSpecialScratchBuffer.resize(neededSize);
   }
@@ -17,12 +17,17 @@
 #ifndef ANDROID_HWC_GUESTCOMPOSER_H
 #define ANDROID_HWC_GUESTCOMPOSER_H
 
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
 #include "Common.h"
 #include "Composer.h"
 #include "Display.h"
 #include "DrmPresenter.h"
 #include "Gralloc.h"
 #include "Layer.h"
+#include "android/base/threads/AndroidWorkPool.h"
 
 namespace android {
 
@@ -79,20 +84,131 @@ class GuestComposer : public Composer {
   // Returns true if the given layer's buffer has supported format.
   bool canComposeLayer(Layer* layer);
 
-  // Composes the given layer into the given destination buffer.
-  HWC2::Error composeLayerInto(Layer* layer, std::uint8_t* dstBuffer,
-                               std::uint32_t dstBufferWidth,
-                               std::uint32_t dstBufferHeight,
-                               std::uint32_t dstBufferStrideBytes,
-                               std::uint32_t dstBufferBytesPerPixel);
+  // Returns true if the given layer can be handed to a display plane as is.
+  bool canScanOutLayer(Layer* layer, std::uint32_t displayWidth,
+                       std::uint32_t displayHeight);
+
+  // Scratch memory for the intermediate steps of composing a layer. Each
+  // composition band has its own so that bands can be composed concurrently.
+  struct ScratchBuffers {
+    uint8_t* getRotatingScratchBuffer(std::size_t neededSize,
+                                      std::uint32_t order);
+    uint8_t* getSpecialScratchBuffer(std::size_t neededSize);
+
+    std::vector<uint8_t> mScratchBuffer;
+    std::vector<uint8_t> mSpecialScratchBuffer;
+  };
+
+  // How a source buffer is drawn onto its display frame.
+  struct LayerComposition;
+
+  // A device composed layer with its buffer locked for the current present.
+  struct LayerSource;
+
+  // Locks the given layer's buffer. Layers that can not be clipped are also
+  // converted, scaled and rotated into a buffer of their display frame's
+  // size, so that any layer source can be composed one band at a time.
+  HWC2::Error prepareLayerSource(Layer* layer, LayerSource* source);
+
+  // Clears the given band of the destination buffer, composes the given
+  // layer sources into it and applies the color transform.
+  HWC2::Error composeBand(
+      const std::vector<const LayerSource*>& sources, const hwc_rect_t& band,
+      std::uint8_t* dstBuffer, std::uint32_t dstBufferWidth,
+      std::uint32_t dstBufferHeight, std::uint32_t dstBufferStrideBytes,
+      const std::optional<ColorTransformWithMatrix>& colorTransform,
+      ScratchBuffers* scratch);
+
+  // Composes the part of the given layer composition that falls inside
+  // |dstClip| into the given destination buffer.
+  static HWC2::Error composeInto(const LayerComposition& composition,
+                                 std::uint8_t* dstBuffer,
+                                 std::uint32_t dstBufferWidth,
+                                 std::uint32_t dstBufferHeight,
+                                 std::uint32_t dstBufferStrideBytes,
+                                 std::uint32_t dstBufferBytesPerPixel,
+                                 const hwc_rect_t& dstClip,
+                                 ScratchBuffers* scratch);
+
+  // The parts of a device composed layer that affect where it is drawn.
+  struct ComposedLayerInfo {
+    hwc2_layer_t id;
+    hwc_rect_t displayFrame;
+    hwc_rect_t sourceCrop;
+    hwc_transform_t transform;
+    HWC2::BlendMode blendMode;
+    uint32_t z;
+  };
+
+  // A device composed layer that is scanned out on its own display plane
+  // instead of being composed into the composition result.
+  struct PlaneLayer {
+    hwc2_layer_t id;
+    std::shared_ptr<DrmBuffer> buffer;
+  };
 
   struct GuestComposerDisplayInfo {
     // Additional per display buffer for the composition result.
     buffer_handle_t compositionResultBuffer = nullptr;
 
     std::unique_ptr<DrmBuffer> compositionResultDrmBuffer;
+
+    // The plane layers chosen by the last validate, bottom to top.
+    std::vector<PlaneLayer> planeLayers;
+    // The plane layers of the last commit. Their framebuffers must outlive
+    // the commit that takes them off the planes.
+    std::vector<PlaneLayer> scannedOutPlaneLayers;
+
+    // Drm framebuffers of the layer buffers tried on planes, so that a buffer
+    // shown across frames keeps its framebuffer. Only buffers that are set
+    // on a layer of the display are kept, as a freed handle may be reused.
+    std::unordered_map<buffer_handle_t, std::shared_ptr<DrmBuffer>>
+        planeLayerBuffers;
+
+    bool isPlaneLayer(hwc2_layer_t layerId) const {
+      for (const PlaneLayer& planeLayer : planeLayers) {
+        if (planeLayer.id == layerId) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // What the composition result buffer currently holds. Only the damaged
+    // parts of it are recomposed on the next present.
+    bool previousCompositionValid = false;
+    bool previousClientComposed = false;
+    std::optional<ColorTransformWithMatrix> previousColorTransform;
+    std::vector<ComposedLayerInfo> previousLayers;
   };
 
+  // Returns the non overlapping rects of the composition result that must be
+  // recomposed for the next present of the given display.
+  std::vector<hwc_rect_t> getDamagedRects(
+      Display* display, const GuestComposerDisplayInfo& displayInfo,
+      std::uint32_t width, std::uint32_t height, bool clientComposed);
+
+  void saveCompositionState(Display* display,
+                            GuestComposerDisplayInfo* displayInfo,
+                            bool clientComposed);
+
+  // Moves the topmost device composed layers that the display's free planes
+  // accept, as checked with a test-only commit, out of composition.
+  void assignPlaneLayers(Display* display,
+                         GuestComposerDisplayInfo* displayInfo);
+
+  // Returns the cached drm framebuffer of the given layer's buffer, creating
+  // it on first use.
+  std::shared_ptr<DrmBuffer> getPlaneLayerBuffer(
+      GuestComposerDisplayInfo* displayInfo, Layer* layer);
+
+  // Returns the info of the given display, or null if it was not created.
+  // The info itself is only used under the display's state lock.
+  GuestComposerDisplayInfo* findDisplayInfo(hwc2_display_t displayId);
+
+  // Displays may be presented concurrently while hotplug adds and removes
+  // displays. This only guards the map; entries do not move when it changes.
+  std::mutex mDisplayInfosMutex;
   std::unordered_map<hwc2_display_t, GuestComposerDisplayInfo> mDisplayInfos;
 
   Gralloc mGralloc;
@@ -103,10 +219,6 @@ class GuestComposer : public Composer {
   // spamming logcat with DRM commit failures.
   bool mPresentDisabled = false;
 
-  uint8_t* getRotatingScratchBuffer(std::size_t neededSize,
-                                    std::uint32_t order);
-  uint8_t* getSpecialScratchBuffer(std::size_t neededSize);
-
   HWC2::Error applyColorTransformToRGBA(
       const ColorTransformWithMatrix& colotTransform,  //
       std::uint8_t* buffer,                            //
@@ -114,8 +226,15 @@ class GuestComposer : public Composer {
       std::uint32_t bufferHeight,                      //
       std::uint32_t bufferStrideBytes);
 
-  std::vector<uint8_t> mScratchBuffer;
-  std::vector<uint8_t> mSpecialScratchBuffer;
+  // Used for preparing layer sources on the composer thread.
+  ScratchBuffers mScratchBuffers;
+  // One per composition band.
+  std::vector<ScratchBuffers> mBandScratchBuffers;
+  // Composes bands concurrently, null when there is a single band.
+  std::unique_ptr<android::base::guest::WorkPool> mWorkPool;
+  // The scratch buffers and the work pool are shared by all displays, so
+  // displays presented on their own present threads take turns composing.
+  std::mutex mCompositionMutex;
 };
 
 }  // namespace android
@@ -28,6 +28,7 @@
 #include <ui/GraphicBufferAllocator.h>
 #include <ui/GraphicBufferMapper.h>
 
+#include <algorithm>
 #include <optional>
 #include <tuple>
 
@@ -81,41 +82,16 @@ typedef struct compose_device_v2 {
   struct compose_layer layer[0];
 } ComposeDevice_v2;
 
-class ComposeMsg {
- public:
-  ComposeMsg(uint32_t layerCnt = 0)
-      : mData(sizeof(ComposeDevice) + layerCnt * sizeof(ComposeLayer)) {
-    mComposeDevice = reinterpret_cast<ComposeDevice*>(mData.data());
-    mLayerCnt = layerCnt;
-  }
-
-  ComposeDevice* get() { return mComposeDevice; }
-
-  uint32_t getLayerCnt() { return mLayerCnt; }
-
- private:
-  std::vector<uint8_t> mData;
-  uint32_t mLayerCnt;
-  ComposeDevice* mComposeDevice;
-};
-
-class ComposeMsg_v2 {
- public:
-  ComposeMsg_v2(uint32_t layerCnt = 0)
-      : mData(sizeof(ComposeDevice_v2) + layerCnt * sizeof(ComposeLayer)) {
-    mComposeDevice = reinterpret_cast<ComposeDevice_v2*>(mData.data());
-    mLayerCnt = layerCnt;
-  }
-
-  ComposeDevice_v2* get() { return mComposeDevice; }
-
-  uint32_t getLayerCnt() { return mLayerCnt; }
-
- private:
-  std::vector<uint8_t> mData;
-  uint32_t mLayerCnt;
-  ComposeDevice_v2* mComposeDevice;
-};
+// Whether SurfaceFlinger reported that the content of |layer| did not change
+// since the previous frame, which it does with an empty damage rect.
+// No damage information means that the whole buffer may have changed.
+bool HasUnchangedContent(const Layer* layer) {
+  const std::vector<hwc_rect_t>& damage = layer->getSurfaceDamage();
+  return !damage.empty() &&
+         std::all_of(damage.begin(), damage.end(), [](const hwc_rect_t& r) {
+           return r.left >= r.right || r.top >= r.bottom;
+         });
+}
 
 const native_handle_t* AllocateDisplayColorBuffer(int width, int height) {
   const uint32_t layerCount = 1;
@@ -186,9 +162,17 @@ HWC2::Error HostComposer::createHostComposerDisplayInfo(
     return error;
   }
 
-  HostComposerDisplayInfo& displayInfo = mDisplayInfos[displayId];
+  HostComposerDisplayInfo* displayInfoPtr;
+  {
+    std::lock_guard<std::mutex> lock(mDisplayInfosMutex);
+    displayInfoPtr = &mDisplayInfos[displayId];
+  }
+  HostComposerDisplayInfo& displayInfo = *displayInfoPtr;
 
   displayInfo.hostDisplayId = hostDisplayId;
+  // The composition result buffer is replaced, so the next frame is always
+  // sent to the host in full.
+  displayInfo.lastComposeValid = false;
 
   if (displayInfo.compositionResultBuffer) {
     FreeDisplayColorBuffer(displayInfo.compositionResultBuffer);
@@ -209,6 +193,16 @@ HWC2::Error HostComposer::createHostComposerDisplayInfo(
   return HWC2::Error::None;
 }
 
+HostComposer::HostComposerDisplayInfo* HostComposer::findDisplayInfo(
+    hwc2_display_t displayId) {
+  std::lock_guard<std::mutex> lock(mDisplayInfosMutex);
+  auto it = mDisplayInfos.find(displayId);
+  if (it == mDisplayInfos.end()) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
 HWC2::Error HostComposer::onDisplayCreate(Display* display) {
   HWC2::Error error = HWC2::Error::None;
 
@@ -312,14 +306,14 @@ HWC2::Error HostComposer::onDisplayCreate(Display* display) {
 HWC2::Error HostComposer::onDisplayDestroy(Display* display) {
   hwc2_display_t displayId = display->getId();
 
-  auto it = mDisplayInfos.find(displayId);
-  if (it == mDisplayInfos.end()) {
+  HostComposerDisplayInfo* displayInfoPtr = findDisplayInfo(displayId);
+  if (displayInfoPtr == nullptr) {
     ALOGE("%s: display:%" PRIu64 " missing display buffers?", __FUNCTION__,
           displayId);
     return HWC2::Error::BadDisplay;
   }
 
-  HostComposerDisplayInfo& displayInfo = mDisplayInfos[displayId];
+  HostComposerDisplayInfo& displayInfo = *displayInfoPtr;
 
   if (displayId != 0) {
     DEFINE_AND_VALIDATE_HOST_CONNECTION
@@ -330,7 +324,8 @@ HWC2::Error HostComposer::onDisplayDestroy(Display* display) {
 
   FreeDisplayColorBuffer(displayInfo.compositionResultBuffer);
 
-  mDisplayInfos.erase(it);
+  std::lock_guard<std::mutex> lock(mDisplayInfosMutex);
+  mDisplayInfos.erase(displayId);
 
   return HWC2::Error::None;
 }
@@ -338,14 +333,14 @@ HWC2::Error HostComposer::onDisplayDestroy(Display* display) {
 HWC2::Error HostComposer::onDisplayClientTargetSet(Display* display) {
   hwc2_display_t displayId = display->getId();
 
-  auto it = mDisplayInfos.find(displayId);
-  if (it == mDisplayInfos.end()) {
+  HostComposerDisplayInfo* displayInfoPtr = findDisplayInfo(displayId);
+  if (displayInfoPtr == nullptr) {
     ALOGE("%s: display:%" PRIu64 " missing display buffers?", __FUNCTION__,
           displayId);
     return HWC2::Error::BadDisplay;
   }
 
-  HostComposerDisplayInfo& displayInfo = mDisplayInfos[displayId];
+  HostComposerDisplayInfo& displayInfo = *displayInfoPtr;
 
   if (mIsMinigbm) {
     FencedBuffer& clientTargetFencedBuffer = display->getClientTarget();
@@ -437,15 +432,15 @@ HWC2::Error HostComposer::validateDisplay(
 
 std::tuple<HWC2::Error, base::unique_fd> HostComposer::presentDisplay(
     Display* display) {
-  auto it = mDisplayInfos.find(display->getId());
+  HostComposerDisplayInfo* displayInfoPtr = findDisplayInfo(display->getId());
   base::unique_fd outRetireFence;
-  if (it == mDisplayInfos.end()) {
+  if (displayInfoPtr == nullptr) {
     ALOGE("%s: failed to find display buffers for display:%" PRIu64,
           __FUNCTION__, display->getId());
     return std::make_tuple(HWC2::Error::BadDisplay, base::unique_fd());
   }
 
-  HostComposerDisplayInfo& displayInfo = it->second;
+  HostComposerDisplayInfo& displayInfo = *displayInfoPtr;
 
   HostConnection* hostCon;
   ExtendedRCEncoderContext* rcEnc;
@@ -482,6 +477,7 @@ std::tuple<HWC2::Error, base::unique_fd> HostComposer::presentDisplay(
       ALOGW(
           "%s display has no layers to compose, flushing client target buffer.",
           __FUNCTION__);
+      displayInfo.lastComposeValid = false;
 
       FencedBuffer& displayClientTarget = display->getClientTarget();
       if (displayClientTarget.getBuffer() != nullptr) {
@@ -499,29 +495,26 @@ std::tuple<HWC2::Error, base::unique_fd> HostComposer::presentDisplay(
       return std::make_tuple(HWC2::Error::None, std::move(outRetireFence));
     }
 
-    std::unique_ptr<ComposeMsg> composeMsg;
-    std::unique_ptr<ComposeMsg_v2> composeMsgV2;
-
-    if (hostCompositionV1) {
-      composeMsg.reset(new ComposeMsg(numLayer));
-    } else {
-      composeMsgV2.reset(new ComposeMsg_v2(numLayer));
-    }
-
     // Handle the composition
-    ComposeDevice* p;
-    ComposeDevice_v2* p2;
+    std::vector<uint8_t>& compose = displayInfo.nextCompose;
+    compose.assign((hostCompositionV1 ? sizeof(ComposeDevice)
+                                      : sizeof(ComposeDevice_v2)) +
+                       numLayer * sizeof(ComposeLayer),
+                   0);
+    ComposeDevice* p = nullptr;
+    ComposeDevice_v2* p2 = nullptr;
     ComposeLayer* l;
 
     if (hostCompositionV1) {
-      p = composeMsg->get();
+      p = reinterpret_cast<ComposeDevice*>(compose.data());
       l = p->layer;
     } else {
-      p2 = composeMsgV2->get();
+      p2 = reinterpret_cast<ComposeDevice_v2*>(compose.data());
       l = p2->layer;
     }
 
     std::vector<hwc2_layer_t> releaseLayerIds;
+    bool contentUnchanged = true;
     for (auto layer : layers) {
       // TODO: use local var composisitonType to store getCompositionType()
       if (layer->getCompositionType() != HWC2::Composition::Device &&
@@ -533,6 +526,7 @@ std::tuple<HWC2::Error, base::unique_fd> HostComposer::presentDisplay(
       // send layer composition command to host
       if (layer->getCompositionType() == HWC2::Composition::Device) {
         releaseLayerIds.emplace_back(layer->getId());
+        contentUnchanged = contentUnchanged && HasUnchangedContent(layer);
 
         base::unique_fd fence = layer->getBuffer().getFence();
         if (fence.ok()) {
@@ -584,32 +578,41 @@ std::tuple<HWC2::Error, base::unique_fd> HostComposer::presentDisplay(
       p2->numLayers = numLayer;
     }
 
-    void* buffer;
-    uint32_t bufferSize;
-    if (hostCompositionV1) {
-      buffer = (void*)p;
-      bufferSize = sizeof(ComposeDevice) + numLayer * sizeof(ComposeLayer);
+    // The host composes each command from scratch and has no notion of an
+    // update to the previous one. When the command and every layer's content
+    // are the same as in the last frame, the composition result on screen is
+    // already this frame, so skip the host round trip. The retire fence is
+    // still created for this present, so that it signals after the previous
+    // composition and carries this frame's present time.
+    const bool skipCompose = contentUnchanged &&
+                             displayInfo.lastComposeValid &&
+                             compose == displayInfo.lastCompose;
+    if (skipCompose) {
+      DEBUG_LOG("%s: display:%" PRIu64 " unchanged, skipping host composition",
+                __FUNCTION__, display->getId());
+      display->setPresentSkippedLocked();
     } else {
-      bufferSize = sizeof(ComposeDevice_v2) + numLayer * sizeof(ComposeLayer);
-      buffer = (void*)p2;
-    }
+      void* buffer = compose.data();
+      uint32_t bufferSize = compose.size();
 
-    base::unique_fd retire_fd;
-    hostCon->lock();
-    if (rcEnc->hasAsyncFrameCommands()) {
-      if (mIsMinigbm) {
-        rcEnc->rcComposeAsyncWithoutPost(rcEnc, bufferSize, buffer);
-      } else {
-        rcEnc->rcComposeAsync(rcEnc, bufferSize, buffer);
-      }
-    } else {
-      if (mIsMinigbm) {
-        rcEnc->rcComposeWithoutPost(rcEnc, bufferSize, buffer);
+      hostCon->lock();
+      if (rcEnc->hasAsyncFrameCommands()) {
+        if (mIsMinigbm) {
+          rcEnc->rcComposeAsyncWithoutPost(rcEnc, bufferSize, buffer);
+        } else {
+          rcEnc->rcComposeAsync(rcEnc, bufferSize, buffer);
+        }
       } else {
-        rcEnc->rcCompose(rcEnc, bufferSize, buffer);
+        if (mIsMinigbm) {
+          rcEnc->rcComposeWithoutPost(rcEnc, bufferSize, buffer);
+        } else {
+          rcEnc->rcCompose(rcEnc, bufferSize, buffer);
+        }
       }
+      hostCon->unlock();
     }
-    hostCon->unlock();
+
+    base::unique_fd retire_fd;
 
     // Send a retire fence and use it as the release fence for all layers,
     // since media expects it
@@ -646,6 +649,10 @@ std::tuple<HWC2::Error, base::unique_fd> HostComposer::presentDisplay(
     }
 
     outRetireFence = base::unique_fd(dup(retire_fd.get()));
+    if (!skipCompose) {
+      displayInfo.lastCompose.swap(compose);
+      displayInfo.lastComposeValid = true;
+    }
     if (useRcCommandToSync) {
       hostCon->lock();
       if (rcEnc->hasAsyncFrameCommands()) {
@@ -658,6 +665,7 @@ std::tuple<HWC2::Error, base::unique_fd> HostComposer::presentDisplay(
 
   } else {
     // we set all layers Composition::Client, so do nothing.
+    displayInfo.lastComposeValid = false;
     FencedBuffer& displayClientTarget = display->getClientTarget();
     base::unique_fd fence = displayClientTarget.getFence();
     if (mIsMinigbm) {
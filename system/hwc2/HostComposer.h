@@ -18,7 +18,9 @@
 #define ANDROID_HWC_HOSTCOMPOSER_H
 
 #include <android-base/unique_fd.h>
+#include <mutex>
 #include <tuple>
+#include <vector>
 
 #include "Common.h"
 #include "Composer.h"
@@ -80,8 +82,24 @@ class HostComposer : public Composer {
 
     // Drm info for the displays client target buffer.
     std::unique_ptr<DrmBuffer> clientTargetDrmBuffer;
+
+    // The last compose command sent to the host. Cleared whenever the
+    // display stops showing its result.
+    bool lastComposeValid = false;
+    std::vector<uint8_t> lastCompose;
+
+    // Scratch space for building the next compose command.
+    std::vector<uint8_t> nextCompose;
   };
 
+  // Returns the info of the given display, or null if it was not created.
+  // The info itself is only used under the display's state lock.
+  HostComposerDisplayInfo* findDisplayInfo(hwc2_display_t displayId);
+
+  // Displays are presented on their own present threads, each with its own
+  // host connection, while hotplug adds and removes displays. This only
+  // guards the map; entries do not move when it changes.
+  std::mutex mDisplayInfosMutex;
   std::unordered_map<hwc2_display_t, HostComposerDisplayInfo> mDisplayInfos;
 
   DrmPresenter mDrmPresenter;
@@ -64,12 +64,18 @@ HWC2::Error Layer::setCursorPosition(int32_t /*x*/, int32_t /*y*/) {
   return HWC2::Error::None;
 }
 
-HWC2::Error Layer::setSurfaceDamage(hwc_region_t /*damage*/) {
+HWC2::Error Layer::setSurfaceDamage(hwc_region_t damage) {
   DEBUG_LOG("%s layer:%" PRIu64, __FUNCTION__, mId);
 
+  mSurfaceDamage.resize(damage.numRects);
+  std::copy_n(damage.rects, damage.numRects, mSurfaceDamage.data());
   return HWC2::Error::None;
 }
 
+const std::vector<hwc_rect_t>& Layer::getSurfaceDamage() const {
+  return mSurfaceDamage;
+}
+
 HWC2::Error Layer::setBlendMode(int32_t m) {
   const auto blendMode = static_cast<HWC2::BlendMode>(m);
   const auto blendModeString = to_string(blendMode);
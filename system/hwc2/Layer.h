@@ -44,6 +44,8 @@ class Layer {
   HWC2::Error setCursorPosition(int32_t x, int32_t y);
 
   HWC2::Error setSurfaceDamage(hwc_region_t damage);
+  // Damaged rects in buffer coordinates. Empty means the whole buffer.
+  const std::vector<hwc_rect_t>& getSurfaceDamage() const;
 
   HWC2::Error setBlendMode(int32_t mode);
   HWC2::BlendMode getBlendMode() const;
@@ -16,11 +16,71 @@
 
 #include "VsyncThread.h"
 
+#include <android-base/stringprintf.h>
+#include <sync/sync.h>
+
+#include <algorithm>
+#include <cstdlib>
 #include <thread>
 
 namespace android {
 namespace {
 
+using android::base::StringPrintf;
+
+// Present fences that have not signaled after this many are dropped.
+constexpr const std::size_t kMaxPendingPresents = 8;
+
+constexpr const int64_t kPresentLatencyBucketNanos = 1000000;
+
+// A new sample moves the learned present timing by 1/kTimingFilterWeight of
+// its error.
+constexpr const int64_t kTimingFilterWeight = 8;
+
+// Vsyncs are only aligned to landings once this many were seen and their
+// phase jitters less than a period divided by kMaxLandingJitterDivisor.
+constexpr const uint64_t kMinPresentsForPhaseLock = 16;
+constexpr const int64_t kMaxLandingJitterDivisor = 16;
+
+// The vsync phase moves at most a period divided by this per vsync, so that
+// vsync timestamps stay smooth for SurfaceFlinger's vsync model.
+constexpr const int64_t kMaxPhaseStepDivisor = 16;
+
+constexpr const int kMaxFollowsPhaseCorrectionScore = 8;
+
+int64_t PositiveModulo(int64_t value, int64_t modulo) {
+  return ((value % modulo) + modulo) % modulo;
+}
+
+// Wraps a phase difference into [-period/2, period/2).
+int64_t WrapPhase(int64_t phase, int64_t period) {
+  phase = PositiveModulo(phase, period);
+  return phase >= period / 2 ? phase - period : phase;
+}
+
+// Returns 1 and the time at which the fence signaled once it has signaled,
+// 0 while it is pending and a negative value on error.
+int GetFenceSignalTime(base::borrowed_fd fence, int64_t* outSignalTimeNanos) {
+  struct sync_file_info* info = sync_file_info(fence.get());
+  if (info == nullptr) {
+    return -1;
+  }
+
+  const int status = info->status;
+  if (status == 1) {
+    const struct sync_fence_info* fenceInfos = sync_get_fence_info(info);
+    int64_t signalTimeNanos = 0;
+    for (uint32_t i = 0; i < info->num_fences; i++) {
+      signalTimeNanos = std::max(
+          signalTimeNanos, static_cast<int64_t>(fenceInfos[i].timestamp_ns));
+    }
+    *outSignalTimeNanos = signalTimeNanos;
+  }
+
+  sync_file_info_free(info);
+  return status;
+}
+
 std::chrono::time_point<std::chrono::steady_clock> asTimePoint(int64_t nanos) {
   return std::chrono::time_point<std::chrono::steady_clock>(
       std::chrono::nanoseconds(nanos));
@@ -134,22 +194,177 @@ std::chrono::nanoseconds VsyncThread::updateVsyncPeriodLocked(
   if (mPendingUpdate && now > mPendingUpdate->updateAfter) {
     mVsyncPeriod = mPendingUpdate->period;
     mPendingUpdate.reset();
+
+    // Phases learned for the previous period are meaningless for the new one.
+    mPresentTiming = PresentTiming();
   }
 
   return mVsyncPeriod;
 }
 
+void VsyncThread::trackPresentFence(base::unique_fd presentFence) {
+  std::unique_lock<std::mutex> lock(mStateMutex);
+
+  if (mPendingPresents.size() >= kMaxPendingPresents) {
+    mPendingPresents.pop_front();
+  }
+  mPendingPresents.push_back(PendingPresent{
+      .fence = std::move(presentFence),
+      .vsync = mPreviousVsync,
+  });
+}
+
+void VsyncThread::updatePresentTimingLocked() {
+  while (!mPendingPresents.empty()) {
+    const PendingPresent& present = mPendingPresents.front();
+
+    int64_t landedNanos = 0;
+    const int status = GetFenceSignalTime(present.fence, &landedNanos);
+    if (status == 0) {
+      // Fences signal in order.
+      break;
+    }
+    if (status > 0) {
+      recordPresentLocked(present.vsync, landedNanos);
+    }
+    mPendingPresents.pop_front();
+  }
+}
+
+void VsyncThread::recordPresentLocked(
+    std::chrono::time_point<std::chrono::steady_clock> vsync,
+    int64_t landedNanos) {
+  PresentTiming& timing = mPresentTiming;
+  const int64_t period = asNanos(mVsyncPeriod);
+  const int64_t latency = std::max<int64_t>(0, landedNanos - asNanos(vsync));
+
+  const std::size_t bucket = std::min<std::size_t>(
+      latency / kPresentLatencyBucketNanos, kPresentLatencyBuckets - 1);
+  ++timing.latencyHistogram[bucket];
+
+  // The frame landed after the vsync following the one it was composed for.
+  const bool missed = latency > period;
+  if (missed) {
+    ++timing.missedFrames;
+  }
+
+  if (timing.presents == 0) {
+    timing.latencyNanos = latency;
+    timing.landingPhaseNanos = PositiveModulo(landedNanos, period);
+    timing.wakeupOffsetNanos = period * 3 / 4;
+  } else {
+    const int64_t latencyError = latency - timing.latencyNanos;
+    timing.latencyNanos += latencyError / kTimingFilterWeight;
+    timing.latencyJitterNanos +=
+        (std::abs(latencyError) - timing.latencyJitterNanos) /
+        kTimingFilterWeight;
+
+    const int64_t phaseError =
+        WrapPhase(landedNanos - timing.landingPhaseNanos, period);
+    timing.landingPhaseNanos = PositiveModulo(
+        timing.landingPhaseNanos + phaseError / kTimingFilterWeight, period);
+    timing.landingPhaseJitterNanos +=
+        (std::abs(phaseError) - timing.landingPhaseJitterNanos) /
+        kTimingFilterWeight;
+
+    // Landings paced by the host stay put when the vsync phase moves while
+    // landings paced by the guest move along with it.
+    if (std::abs(timing.phaseCorrectionNanos) >= period / 64) {
+      const int64_t landingMove =
+          WrapPhase(landedNanos - timing.previousLandedNanos, period);
+      const bool followed =
+          std::abs(landingMove - timing.phaseCorrectionNanos) <
+          std::abs(landingMove);
+      timing.followsPhaseCorrectionScore =
+          std::clamp(timing.followsPhaseCorrectionScore + (followed ? 1 : -1),
+                     -kMaxFollowsPhaseCorrectionScore,
+                     kMaxFollowsPhaseCorrectionScore);
+    }
+  }
+  timing.phaseCorrectionNanos = 0;
+  timing.previousLandedNanos = landedNanos;
+
+  // Wake up closer to the landing while frames make it and back off quickly
+  // when one does not.
+  if (missed) {
+    timing.wakeupOffsetNanos =
+        std::min(timing.wakeupOffsetNanos + period / 8, period * 3 / 4);
+  } else {
+    timing.wakeupOffsetNanos =
+        std::max(timing.wakeupOffsetNanos - period / 64, period / 8);
+  }
+
+  ++timing.presents;
+}
+
+bool VsyncThread::isPhaseLockedLocked() const {
+  const PresentTiming& timing = mPresentTiming;
+  const int64_t period = asNanos(mVsyncPeriod);
+  return !mPendingUpdate && timing.presents >= kMinPresentsForPhaseLock &&
+         timing.landingPhaseJitterNanos < period / kMaxLandingJitterDivisor &&
+         timing.followsPhaseCorrectionScore <= 0;
+}
+
+std::chrono::nanoseconds VsyncThread::getPhaseCorrectionLocked() {
+  if (!isPhaseLockedLocked()) {
+    return std::chrono::nanoseconds(0);
+  }
+
+  PresentTiming& timing = mPresentTiming;
+  const int64_t period = asNanos(mVsyncPeriod);
+
+  const int64_t targetPhase = PositiveModulo(
+      timing.landingPhaseNanos - timing.wakeupOffsetNanos, period);
+  const int64_t currentPhase = PositiveModulo(asNanos(mPreviousVsync), period);
+  const int64_t correction =
+      std::clamp(WrapPhase(targetPhase - currentPhase, period),
+                 -period / kMaxPhaseStepDivisor, period / kMaxPhaseStepDivisor);
+
+  timing.phaseCorrectionNanos += correction;
+  return std::chrono::nanoseconds(correction);
+}
+
+std::string VsyncThread::dump() {
+  std::unique_lock<std::mutex> lock(mStateMutex);
+
+  const PresentTiming& timing = mPresentTiming;
+  const auto asMillis = [](int64_t nanos) { return nanos / 1000000.0; };
+
+  std::string result = StringPrintf(
+      "  vsync period: %.3f ms, phase locked: %s\n"
+      "  presents: %" PRIu64 ", missed frames: %" PRIu64 "\n"
+      "  present latency: %.3f ms, jitter: %.3f ms\n"
+      "  landing phase: %.3f ms, jitter: %.3f ms, wakeup offset: %.3f ms\n"
+      "  present latency histogram (ms: presents):\n",
+      asMillis(asNanos(mVsyncPeriod)), isPhaseLockedLocked() ? "yes" : "no",
+      timing.presents, timing.missedFrames, asMillis(timing.latencyNanos),
+      asMillis(timing.latencyJitterNanos), asMillis(timing.landingPhaseNanos),
+      asMillis(timing.landingPhaseJitterNanos),
+      asMillis(timing.wakeupOffsetNanos));
+  for (std::size_t i = 0; i < kPresentLatencyBuckets; i++) {
+    if (timing.latencyHistogram[i] == 0) {
+      continue;
+    }
+    const bool last = i == kPresentLatencyBuckets - 1;
+    result += StringPrintf("    %s%zu: %" PRIu64 "\n", last ? ">=" : "", i,
+                           timing.latencyHistogram[i]);
+  }
+  return result;
+}
+
 bool VsyncThread::threadLoop() {
   DEBUG_LOG("%s: for display:%" PRIu64 " started", __FUNCTION__, mDisplayId);
 
   std::chrono::nanoseconds vsyncPeriod = mVsyncPeriod;
+  std::chrono::nanoseconds phaseCorrection(0);
 
   int vsyncs = 0;
   auto previousLog = std::chrono::steady_clock::now();
   while (true) {
     auto now = std::chrono::steady_clock::now();
 
-    auto nextVsync = GetNextVsyncInPhase(vsyncPeriod, mPreviousVsync, now);
+    auto nextVsync = GetNextVsyncInPhase(
+        vsyncPeriod, mPreviousVsync + phaseCorrection, now);
     std::this_thread::sleep_until(nextVsync);
 
     {
@@ -160,6 +375,9 @@ bool VsyncThread::threadLoop() {
       // Display has finished refreshing at previous vsync period. Update the
       // vsync period if there was a pending update.
       vsyncPeriod = updateVsyncPeriodLocked(mPreviousVsync);
+
+      updatePresentTimingLocked();
+      phaseCorrection = getPhaseCorrectionLocked();
     }
 
     if (mVsyncEnabled) {
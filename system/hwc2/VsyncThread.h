@@ -17,12 +17,16 @@
 #ifndef ANDROID_HWC_VSYNCTHREAD_H
 #define ANDROID_HWC_VSYNCTHREAD_H
 
+#include <android-base/unique_fd.h>
 #include <android/hardware/graphics/common/1.0/types.h>
 #include <utils/Thread.h>
 
+#include <array>
 #include <chrono>
+#include <deque>
 #include <mutex>
 #include <optional>
+#include <string>
 
 #include "Common.h"
 
@@ -54,12 +58,36 @@ class VsyncThread : public Thread {
       hwc_vsync_period_change_constraints_t* newVsyncPeriodChangeConstraints,
       hwc_vsync_period_change_timeline_t* timeline);
 
+  // Watches the given present fence. The times at which present fences
+  // signal are used to learn when frames actually land on the host and to
+  // move the vsync phase so that the compositor wakes up just early enough
+  // for its frames to make the next landing.
+  void trackPresentFence(base::unique_fd presentFence);
+
+  // Returns the learned present timing and the present latency histogram.
+  std::string dump();
+
  private:
   bool threadLoop() final;
 
   std::chrono::nanoseconds updateVsyncPeriodLocked(
       std::chrono::time_point<std::chrono::steady_clock> now);
 
+  // Consumes the signaled present fences.
+  void updatePresentTimingLocked();
+
+  void recordPresentLocked(
+      std::chrono::time_point<std::chrono::steady_clock> vsync,
+      int64_t landedNanos);
+
+  // Returns true once present fences reveal a stable host landing phase that
+  // vsyncs can be aligned to.
+  bool isPhaseLockedLocked() const;
+
+  // Returns how far to move the vsync phase towards the learned landing
+  // phase before the next vsync.
+  std::chrono::nanoseconds getPhaseCorrectionLocked();
+
   const hwc2_display_t mDisplayId;
 
   std::mutex mStateMutex;
@@ -79,6 +107,40 @@ class VsyncThread : public Thread {
     std::chrono::time_point<std::chrono::steady_clock> updateAfter;
   };
   std::optional<PendingUpdate> mPendingUpdate;
+
+  struct PendingPresent {
+    base::unique_fd fence;
+    // The vsync that the presented frame was composed for.
+    std::chrono::time_point<std::chrono::steady_clock> vsync;
+  };
+  std::deque<PendingPresent> mPendingPresents;
+
+  static constexpr const std::size_t kPresentLatencyBuckets = 64;
+
+  // Learned from present fences, reset when the vsync period changes.
+  struct PresentTiming {
+    uint64_t presents = 0;
+    uint64_t missedFrames = 0;
+    // Exponentially weighted mean and mean absolute deviation of the time
+    // from the vsync a frame was composed for to its present fence signal.
+    int64_t latencyNanos = 0;
+    int64_t latencyJitterNanos = 0;
+    // The same for the phase, modulo the vsync period, of the signals.
+    int64_t landingPhaseNanos = 0;
+    int64_t landingPhaseJitterNanos = 0;
+    int64_t previousLandedNanos = 0;
+    // How long before the landing phase vsyncs are sent while locked.
+    int64_t wakeupOffsetNanos = 0;
+    // Vsync phase moved since the previous signal, and whether landings
+    // follow such moves, which they do when the guest rather than the host
+    // paces the frames and there is no host phase to lock to.
+    int64_t phaseCorrectionNanos = 0;
+    int followsPhaseCorrectionScore = 0;
+    // Present latency in one millisecond buckets. The last bucket also
+    // counts all longer latencies.
+    std::array<uint64_t, kPresentLatencyBuckets> latencyHistogram = {};
+  };
+  PresentTiming mPresentTiming;
 };
 
 }  // namespace android